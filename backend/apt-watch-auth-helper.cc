@@ -35,6 +35,9 @@ string cmd;
 /** If \b true, the command is run in an xterm (via xterm -e) */
 bool run_xterm;
 
+/** Buffers replies arriving from the slave. */
+msg_reader slave_reader;
+
 /** Handles PAM interaction. */
 int my_conv(int num_msg,
 	    const pam_message **msg,
@@ -64,7 +67,7 @@ int my_conv(int num_msg,
 	  break;
 	default:
 	  {
-	    write_msg(APPLET_REPLY_AUTH_FAIL, 1,
+	    write_msg(1, APPLET_REPLY_AUTH_FAIL,
 		      "Unknown PAM query type");
 	    exit(-1); // return a "failed" code instead?
 	  }
@@ -88,25 +91,34 @@ int my_conv(int num_msg,
       if(msg[i]->msg_style==PAM_PROMPT_ECHO_OFF ||
 	 msg[i]->msg_style==PAM_PROMPT_ECHO_ON)
 	{
-	  string::size_type len;
+	  msg_frame frame;
+	  string response;
 
-	  if(read(0, &len, sizeof(len))<(int) sizeof(len))
+	  if(!slave_reader.read_frame(0, frame))
 	    // The user cancelled the interaction.
 	    exit(0);
 
+	  if(frame.id()!=APPLET_CMD_AUTHREPLY || !frame.get_string(response))
+	    {
+	      write_msg(1, APPLET_REPLY_AUTH_FAIL,
+			"Protocol error: garbled reply");
+	      exit(-1);
+	    }
+
 	  // Avoid DoS with a threshold that's much larger than necessary.
 	  // (email me if you have a 1001-byte root password and you think
 	  // this limit is unreasonable :) )
-	  if(len>1000 || len>PAM_MAX_MSG_SIZE)
+	  if(response.size()>1000 || response.size()>PAM_MAX_MSG_SIZE)
 	    {
-	      write_msg(APPLET_REPLY_AUTH_FAIL, 1,
+	      write_msg(1, APPLET_REPLY_AUTH_FAIL,
 			"Protocol error: absurd reply length");
 	      exit(-1);
 	    }
 
-	  char *s=(char *) malloc(len+1);
-	  read(0, s, len);
-	  s[len]=0;
+	  char *s=strdup(response.c_str());
+
+	  response.replace(0, response.size(), response.size(), '\0');
+	  frame.wipe();
 
 	  reply[i].resp=s;
 
@@ -190,7 +202,7 @@ int main(int argc, char **argv)
 
       if(rval!=PAM_SUCCESS)
 	{
-	  write_msg(APPLET_REPLY_AUTH_FAIL, outfd,
+	  write_msg(outfd, APPLET_REPLY_AUTH_FAIL,
 		    string("Unable to initialize PAM: ")+pam_strerror(pam_handle, rval));
 
 	  pam_end(pam_handle, rval);
@@ -239,6 +251,11 @@ int main(int argc, char **argv)
 
       setegid(0);
 
+      // The package manager is about to trust these; a crash must
+      // not leave a half-written index or archive behind, or lose
+      // the downloaded copy of one.
+      set_commit_policy(COMMIT_DURABLE);
+
       copy_recursive(home+"/.apt-watch/lists", "/var/lib/apt/lists");
       move_recursive(home+"/.apt-watch/archives", "/var/cache/apt/archives");
     }
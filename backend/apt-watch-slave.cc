@@ -25,9 +25,12 @@
 
 #include <dirent.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <utime.h>
 
@@ -35,23 +38,101 @@
 #include "config.h"
 #endif
 
-#ifdef HAVE_LIBFAM
-#include <fam.h>
-#endif
-
+#include <algorithm>
+#include <map>
+#include <set>
 #include <string>
+#include <vector>
 
 #include "apt-watch-common.h"
+#include "archive-index.h"
+#include "cache-fingerprint.h"
+#include "change-watcher.h"
+#include "download-journal.h"
+#include "dpkg-status.h"
+#include "event-loop.h"
 #include "fileutl.h"
+#include "origin-rules.h"
+#include "parallel-scan.h"
+#include "progress-block.h"
+#include "snapshot.h"
 
 using namespace std;
 
 pkgCacheFile *cache=NULL;
 
-#ifdef HAVE_LIBFAM
-FAMConnection famconn;
-bool fam_available;
-#endif
+/** \b false if the cache has been closed to save memory while the
+ *  slave is idle; see ensure_cache_open().
+ */
+bool cache_open=false;
+
+/** Bumped every time the cache is opened or closed, so that anything
+ *  computed from it can tell whether it is stale.  Never 0.
+ */
+unsigned long cache_generation=1;
+
+/** The rules that decide how urgent an upgrade is. */
+origin_rules upgrade_rules;
+
+/** For each PackageFile in the open cache (indexed by its ID), the
+ *  upgrade class upgrade_rules assigns it.  Filled in by open_cache().
+ */
+vector<unsigned char> file_classes;
+
+/** The inputs the currently open cache was built from; empty if the
+ *  cache is not known to be up-to-date.
+ */
+cache_fingerprint cache_inputs;
+
+/** The result of upgrade_status() for the currently open cache. */
+unsigned int cached_upgrade_status=0;
+
+/** One available upgrade. */
+struct upgrade_entry
+{
+  std::string installed_version;
+  std::string candidate_version;
+  unsigned char upgrade_class;
+};
+
+/** The available upgrades (excluding those classed "none"), keyed
+ *  by package name (with the architecture if it's not the native
+ *  one).
+ */
+typedef map<string, upgrade_entry> upgrade_set;
+
+upgrade_set upgrades;
+
+/** The dpkg status the open cache was built from, read just before
+ *  opening it; only held until the next scan takes it over, so that
+ *  just one copy stays around.
+ */
+dpkg_status opened_status;
+bool opened_status_valid=false;
+
+/** The dpkg status that the upgrades set reflects; thrown away along
+ *  with the cache when the slave goes idle.
+ */
+dpkg_status scanned_status;
+bool scanned_status_valid=false;
+
+/** Notices changes to the system lists, status file and sources. */
+change_watcher watcher;
+
+/** The change_kind mask of everything that changed since the last
+ *  reload or update.
+ */
+int pending_changes=0;
+
+/** The contents of the system and private archive directories. */
+archive_index archives;
+unsigned int sysarchive_index, privatearchive_index;
+
+/** What the downloads so far set out to fetch, and what arrived. */
+download_journal journal;
+
+/** The user's home directory, or NULL when running SUID. */
+const char *HOME;
 
 /** Stores the location of the system lists.
  */
@@ -61,38 +142,112 @@ string syslistdir;
  */
 string sysarchivedir;
 
-/** The time of the last change to the system package cache.
- *
- *  We reload 60 seconds after the last change (to avoid constant
- *  reloads when the user is installing or removing packages)
- *
- *  As a special case, this is 0 if there is no pending reload.
+/** Drives everything the slave waits for. */
+event_loop main_loop;
+
+/** Fires RELOAD_DELAY seconds after the last change to the system
+ *  package cache (to avoid constant reloads when the user is
+ *  installing or removing packages).  Disarmed if there is no
+ *  pending reload.
  */
-time_t last_cache_change=0;
+event_timer reload_timer;
 
 /** How long to wait before reloading the cache. */
 const int RELOAD_DELAY=60;
 
+/** Fires after APT-Watch::Idle-Timeout minutes without a command, to
+ *  close the cache.
+ */
+event_timer idle_timer;
+
+/** The fds the event callbacks talk to. */
+struct slave_io
+{
+  int cmdfd;
+  int outfd;
+};
+
+slave_io slave_fds={0, 1};
+
 /** The fd which is used to send messages to the auth helper. */
 int to_authhelper_fd=-1;
 
 /** The fd which is used to receive messages from the auth helper. */
 int from_authhelper_fd=-1;
 
+/** Auth helpers that have been started but not reaped yet. */
+vector<pid_t> authhelper_pids;
+
+/** Buffers commands arriving from the applet. */
+msg_reader cmd_reader;
+
+/** Buffers messages arriving from the auth helper. */
+msg_reader authhelper_reader;
+
+/** The shared progress block, if the applet asked for one. */
+progress_block *progress_shm=NULL;
+
+/** The memfd behind progress_shm. */
+int progress_shm_fd=-1;
+
+/** If \b true, fetch progress only goes to progress_shm. */
+bool progress_shm_enabled=false;
+
+static void do_progress_shm_enable(msg_frame &frame);
+static void on_authhelper_input(int fd, void *data);
+
 static void setup_archive_dir(int outfd);
 static void setup_list_dir(int outfd);
+static void setup_cache_dir(int outfd);
 static void write_progress_update(int fd, string Op, float Percent, bool MajorChange);
+static bool reopen_cache(OpProgress &progress, int outfd);
+static void add_list_files(pkgAcquire &fetcher, set<string> &lists);
+static void finish_update(const set<string> &lists, int outfd);
+static void open_journal();
+
+/** Returns a monotonic timestamp in milliseconds. */
+static unsigned long long monotonic_ms()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
 
-// Sends messages to the given fd for overall progress, compressed by 1/2.
+  return ts.tv_sec*1000ULL+ts.tv_nsec/1000000;
+}
+
+// Sends the raw fetch numbers to the given fd, at most
+// APT-Watch::Progress::Max-Rate times a second.
 //
 // Do anything on Fail?
 class slaveAcquireStatus:public pkgAcquireStatus
 {
   bool needed_media_change;
 
+  bool cancelled;
+
+  /** If not NULL, the package fetched by each item of a download. */
+  const map<pkgAcquire::Item *, string> *fetched_packages;
+  unsigned char fetched_class;
+
   int fd;
+
+  unsigned char phase;
+
+  /** The minimum time between two progress messages. */
+  unsigned long long interval_ms;
+
+  unsigned long long last_sent_ms;
+
+  msg_builder msg;
 public:
-  slaveAcquireStatus(int _fd):needed_media_change(false), fd(_fd) {}
+  slaveAcquireStatus(int _fd, unsigned char _phase)
+    :needed_media_change(false), cancelled(false), fetched_packages(NULL),
+     fetched_class(UPGRADE_CLASS_NONE), fd(_fd), phase(_phase), last_sent_ms(0)
+  {
+    int rate=_config->FindI("APT-Watch::Progress::Max-Rate", 4);
+
+    interval_ms=rate>0?1000/rate:0;
+  }
 
   // This should never happen for an update, but be robust if it does.
   //
@@ -124,69 +279,94 @@ public:
   }
 #endif
 
-  void update_progress()
+  /** Send the current numbers unless one was sent very recently.
+   *  Forced updates (start and end of a fetch) always go out.
+   */
+  void update_progress(bool force=false, bool active=true)
   {
-    if(fd!=-1)
-      {
-	float Percent;
+    if(fd==-1)
+      return;
 
-	if(TotalBytes+TotalItems>0)
-	  Percent=0.5*((100.0*(CurrentBytes+CurrentItems)))/(TotalBytes+TotalItems);
-	else
-	  Percent=0;
+    unsigned long long now=0;
 
-	char buf[512];
-	if(TotalBytes==0)
-	  snprintf(buf, sizeof(buf),
-		   "%ld/%ld items",
-		   CurrentItems, TotalItems);
-	else
-	  snprintf(buf, sizeof(buf),
-		   "%sb/%sb",
-		   SizeToStr(CurrentBytes).c_str(), SizeToStr(TotalBytes).c_str());
+    // Publishing to shared memory is just a few stores, so it is
+    // never rate-limited.
+    if(!progress_shm_enabled)
+      {
+	now=monotonic_ms();
 
-	string output=buf;
+	if(!force && last_sent_ms!=0 && now-last_sent_ms<interval_ms)
+	  return;
+      }
 
-	if(CurrentCPS>0)
-	  {
-	    unsigned long ETA = (unsigned long)((TotalBytes - CurrentBytes)/CurrentCPS);
+    fetch_progress p;
 
-	    output=output+"; "+TimeToStr(ETA)+" remaining";
-	  }
+    p.current_bytes=(uint64_t) CurrentBytes;
+    p.total_bytes=(uint64_t) TotalBytes;
+    p.current_items=CurrentItems;
+    p.total_items=TotalItems;
+    p.cps=(uint64_t) CurrentCPS;
+    if(CurrentCPS>0 && TotalBytes>CurrentBytes)
+      p.eta=(uint64_t) ((TotalBytes-CurrentBytes)/CurrentCPS);
+    p.phase=phase;
 
-	write_progress_update(fd, output.c_str(), Percent, false);
+    if(progress_shm_enabled)
+      progress_block_publish(progress_shm, p, active);
+    else
+      {
+	last_sent_ms=now;
+
+	msg.begin(APPLET_REPLY_FETCH_PROGRESS);
+	put_fetch_progress(msg, p).send(fd);
       }
   }
 
-  bool Pulse(pkgAcquire *Owner)
+  /** Announce each package of the given class as it arrives. */
+  void set_fetched_packages(const map<pkgAcquire::Item *, string> *names,
+			    unsigned char upgrade_class)
   {
-    bool cancelled=false;
+    fetched_packages=names;
+    fetched_class=upgrade_class;
+  }
 
-    pkgAcquireStatus::Pulse(Owner);
+  /** \return \b true if the user cancelled the fetch. */
+  bool was_cancelled() const {return cancelled;}
 
-    // check for a cancel message.
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(0, &readfds);
+  /** Report later progress as part of the given phase. */
+  void set_phase(unsigned char _phase) {phase=_phase;}
 
-    struct timeval tm;
-    tm.tv_sec=0;
-    tm.tv_usec=0;
+  bool Pulse(pkgAcquire *Owner)
+  {
+    pkgAcquireStatus::Pulse(Owner);
 
-    select(1, &readfds, NULL, NULL, &tm);
+    // check for a cancel message.
+    struct pollfd pfd;
+    pfd.fd=0;
+    pfd.events=POLLIN;
 
-    if(FD_ISSET(0, &readfds))
+    if(poll(&pfd, 1, 0)>0)
       {
-	unsigned char msgid;
 	// assume EOF
-	if(read(0, &msgid, sizeof(msgid))==sizeof(msgid) &&
-	   msgid!=APPLET_CMD_ABORT_DOWNLOAD)
+	if(cmd_reader.fill(0)<=0)
+	  cancelled=true;
+
+	msg_frame frame;
+	while(cmd_reader.next(frame))
 	  {
-	    write_msg(1, APPLET_REPLY_FATALERROR, "Protocol error: received non-abort message during a download.");
-	    exit(-1);
+	    if(frame.id()==APPLET_CMD_PROGRESS_SHM_ENABLE)
+	      {
+		do_progress_shm_enable(frame);
+		continue;
+	      }
+
+	    if(frame.id()!=APPLET_CMD_ABORT_DOWNLOAD)
+	      {
+		write_msg(1, APPLET_REPLY_FATALERROR, "Protocol error: received non-abort message during a download.");
+		exit(-1);
+	      }
+
+	    cancelled=true;
 	  }
-
-	cancelled=true;
       }
 
     if(needed_media_change)
@@ -199,18 +379,44 @@ public:
 
   void IMSHit(pkgAcquire::ItemDesc&) {update_progress();}
   void Fetch(pkgAcquire::ItemDesc&) {update_progress();}
-  void Done(pkgAcquire::ItemDesc&) {update_progress();}
+  void Done(pkgAcquire::ItemDesc &Itm)
+  {
+    update_progress();
+
+    if(fetched_packages!=NULL)
+      {
+	map<pkgAcquire::Item *, string>::const_iterator found=fetched_packages->find(Itm.Owner);
+
+	if(found!=fetched_packages->end() &&
+	   Itm.Owner->Status==pkgAcquire::Item::StatDone)
+	  {
+	    // Recorded as it happens, in case we don't get to the end.
+	    journal.done(flNotDir(Itm.Owner->DestFile));
+
+	    if(fd!=-1)
+	      msg_builder(APPLET_REPLY_PACKAGE_FETCHED)
+		.put_string(found->second)
+		.put_byte(fetched_class)
+		.send(fd);
+	  }
+      }
+  }
   void Fail(pkgAcquire::ItemDesc&) {update_progress();}
 
-  void Start() {update_progress();}
+  void Start()
+  {
+    pkgAcquireStatus::Start();
+    update_progress(true);
+  }
 
   void Stop()
   {
+    pkgAcquireStatus::Stop();
+
     if(fd!=-1)
       {
-	unsigned char msgtype=APPLET_REPLY_PROGRESS_DONE;
-
-	write(fd, &msgtype, sizeof(msgtype));
+	update_progress(true, false);
+	write_msgid(fd, APPLET_REPLY_PROGRESS_DONE);
       }
   }
 };
@@ -223,7 +429,8 @@ protected:
 		     string ver,
 		     struct stat &stat)
   {
-    unlink(file);
+    if(unlink(file)==0)
+      journal.forget(flNotDir(file));
   }
 };
 
@@ -233,6 +440,8 @@ static void do_autoclean()
     {
       my_cleaner cleaner;
 
+      open_journal();
+
       cleaner.Go(_config->FindDir("Dir::Cache::archives"), *cache);
       cleaner.Go(_config->FindDir("Dir::Cache::archives")+"partial/", *cache);
     }
@@ -240,14 +449,15 @@ static void do_autoclean()
 
 static void write_progress_update(int fd, string Op, float Percent, bool MajorChange)
 {
-  unsigned char msgid=APPLET_REPLY_PROGRESS_UPDATE;
-
-  write(fd, &msgid, sizeof(msgid));
-
-  write_string(fd, Op);
-
-  write(fd, &Percent, sizeof(Percent));
-  write(fd, &MajorChange, sizeof(MajorChange));
+  // Progress messages are by far the most frequent, so reuse one
+  // buffer for all of them.
+  static msg_builder msg;
+
+  msg.begin(APPLET_REPLY_PROGRESS_UPDATE)
+    .put_string(Op)
+    .put_float(Percent)
+    .put_bool(MajorChange)
+    .send(fd);
 }
 
 class SlaveProgress:public OpProgress
@@ -278,8 +488,7 @@ protected:
 public:
   void Done()
   {
-    unsigned char msgid=APPLET_REPLY_PROGRESS_DONE;
-    write(fd, &msgid, sizeof(msgid));
+    write_msgid(fd, APPLET_REPLY_PROGRESS_DONE);
   }
 };
 
@@ -313,89 +522,410 @@ void copy_lists()
     copy_newer_recursive(syslistdir, mylistdir);
 }
 
-/** Tests whether a particular version is security-related.
- *
- *  \return \b true iff the given package version comes from security.d.o
+/** Run the origin rules over every package file; called each time
+ *  the cache is opened, so that checking a version later is just a
+ *  few lookups.
+ */
+static void classify_package_files()
+{
+  file_classes.assign((*cache)->Head().PackageFileCount,
+		      UPGRADE_CLASS_NORMAL);
+
+  for(pkgCache::PkgFileIterator F=(*cache)->GetCache().FileBegin();
+      !F.end(); ++F)
+    file_classes[F->ID]=upgrade_rules.classify(F);
+}
+
+/** \return the most urgent class of any file the given version is
+ *  available from.
  */
-static bool version_is_security(const pkgCache::VerIterator &ver)
+static unsigned char version_class(const pkgCache::VerIterator &ver)
 {
+  unsigned char rval=UPGRADE_CLASS_NONE;
+
   for(pkgCache::VerFileIterator F=ver.FileList(); !F.end(); ++F)
-    if(string(F.File().Site())=="security.debian.org")
-      return true;
+    {
+      unsigned long id=F.File()->ID;
 
-  return false;
+      if(id<file_classes.size() && file_classes[id]>rval)
+	rval=file_classes[id];
+    }
+
+  return rval;
+}
+
+/** \return the most urgent class of any file in the open cache that
+ *  came from the given source, matched by host and distribution.
+ *  Before an update this is the best guess at which sources supply
+ *  the urgent upgrades.
+ */
+static unsigned char meta_index_class(const metaIndex *meta)
+{
+  unsigned char rval=UPGRADE_CLASS_NONE;
+
+  if(!cache_open)
+    return rval;
+
+  string host=URI(meta->GetURI()).Host;
+  string dist=meta->GetDist();
+
+  // "stable/updates" and the like.
+  string base=dist.substr(0, dist.find('/'));
+
+  for(pkgCache::PkgFileIterator F=(*cache)->GetCache().FileBegin();
+      !F.end(); ++F)
+    {
+      if(F.Site()==NULL || host!=F.Site())
+	continue;
+
+      if((F.Archive()!=NULL && (dist==F.Archive() || base==F.Archive())) ||
+	 (F.Codename()!=NULL && (dist==F.Codename() || base==F.Codename())))
+	if(F->ID<file_classes.size() && file_classes[F->ID]>rval)
+	  rval=file_classes[F->ID];
+    }
+
+  return rval;
 }
 
-/** Tests whether a package's candidate version is security-related.
+/** \return the class of the upgrade to a package's candidate version.
  *  (convenience around the above)
  */
-static bool upgrade_is_security(const pkgCache::PkgIterator &pkg)
+static unsigned char upgrade_class(const pkgCache::PkgIterator &pkg)
+{
+  if(pkg.end())
+    return UPGRADE_CLASS_NONE;
+
+  return version_class((*cache)[pkg].CandidateVerIter(*cache));
+}
+
+/** Where the upgrade snapshot lives; only meaningful if HOME is set. */
+static string snapshot_file()
 {
-  return !pkg.end() &&
-    version_is_security((*cache)[pkg].CandidateVerIter(*cache));
+  return string(HOME)+"/.apt-watch/snapshot";
 }
 
 /** Checks what sort of upgrades are available.
  *
- *  \return 0 if no upgrades, 1 for non-security upgrades, 2 for
- *    security upgrades
+ *  \return the most urgent UPGRADE_CLASS_* of any upgrade;
+ *  UPGRADE_CLASS_NONE if there are none (upgrades classed "none"
+ *  don't count).
+ */
+static unsigned int upgrade_status();
+
+/** Fill in entry if pkg has an upgrade that counts.  Only reads the
+ *  cache, so it may run on several threads at once.
+ */
+static bool get_upgrade_entry(const pkgCache::PkgIterator &pkg,
+			      upgrade_entry &entry)
+{
+  if(pkg.CurrentVer().end() || !(*cache)[pkg].Upgradable())
+    return false;
+
+  unsigned char c=upgrade_class(pkg);
+
+  if(c==UPGRADE_CLASS_NONE)
+    return false;
+
+  entry.installed_version=pkg.CurrentVer().VerStr();
+  entry.candidate_version=(*cache)[pkg].CandidateVerIter(*cache).VerStr();
+  entry.upgrade_class=c;
+
+  return true;
+}
+
+/** Add pkg to the upgrades set if it is upgradable; otherwise make
+ *  sure it is not in it.
+ */
+static void update_upgrade_entry(const pkgCache::PkgIterator &pkg)
+{
+  upgrade_entry entry;
+
+  if(get_upgrade_entry(pkg, entry))
+    upgrades[pkg.FullName(true)]=entry;
+  else
+    upgrades.erase(pkg.FullName(true));
+}
+
+/** The work shared by the threads of a full upgrade scan. */
+struct upgrade_scan
+{
+  /** The installed packages. */
+  vector<pkgCache::PkgIterator> packages;
+
+  /** What each worker found. */
+  vector<vector<pair<string, upgrade_entry> > > found;
+};
+
+static void scan_upgrades(size_t begin, size_t end,
+			  unsigned int worker, void *data)
+{
+  upgrade_scan *scan=(upgrade_scan *) data;
+  vector<pair<string, upgrade_entry> > &found=scan->found[worker];
+
+  for(size_t i=begin; i<end; ++i)
+    {
+      const pkgCache::PkgIterator &pkg=scan->packages[i];
+      upgrade_entry entry;
+
+      if(get_upgrade_entry(pkg, entry))
+	found.push_back(make_pair(pkg.FullName(true), entry));
+    }
+}
+
+/** Work out the overall status from the upgrades set, and remember it
+ *  for the next time we start.
+ */
+static unsigned int summarize_upgrades()
+{
+  upgrade_snapshot snap;
+
+  for(upgrade_set::const_iterator i=upgrades.begin(); i!=upgrades.end(); ++i)
+    {
+      snap.packages.push_back(i->first);
+
+      if(i->second.upgrade_class>snap.status)
+	snap.status=i->second.upgrade_class;
+    }
+
+  cached_upgrade_status=snap.status;
+
+  if(HOME)
+    {
+      snap.when=time(0);
+      snap.fingerprint=cache_inputs.digest();
+
+      write_snapshot(snapshot_file(), snap);
+    }
+
+  return snap.status;
+}
+
+/** Make the status the open cache was built from the one the
+ *  upgrades set reflects.
+ */
+static void take_opened_status()
+{
+  scanned_status.swap(opened_status);
+  scanned_status_valid=opened_status_valid;
+
+  free_dpkg_status(opened_status);
+  opened_status_valid=false;
+}
+
+/** Checks what sort of upgrades are available, looking at every
+ *  package.
+ *
+ *  \return the most urgent UPGRADE_CLASS_* of any upgrade;
+ *  UPGRADE_CLASS_NONE if there are none (upgrades classed "none"
+ *  don't count).
  */
 static unsigned int upgrade_status()
 {
-  bool upgrades_exist=false;
+  upgrade_scan scan;
 
+  // Walking the package list has to be done in order, but it's cheap;
+  // the per-package checks are what's worth spreading across CPUs.
   for(pkgCache::PkgIterator i=(*cache)->PkgBegin(); !i.end(); ++i)
-    if(!i.CurrentVer().end() && (*cache)[i].Upgradable())
-      {
-	upgrades_exist=true;
+    if(!i.CurrentVer().end())
+      scan.packages.push_back(i);
 
-	if(upgrade_is_security(i))
-	  return 2;
-      }
+  unsigned int threads=scan_threads(scan.packages.size());
+
+  scan.found.resize(threads);
+  parallel_scan(scan.packages.size(), threads, scan_upgrades, &scan);
+
+  upgrades.clear();
+
+  for(unsigned int i=0; i<threads; ++i)
+    upgrades.insert(scan.found[i].begin(), scan.found[i].end());
 
-  return upgrades_exist?1:0;
+  take_opened_status();
+
+  return summarize_upgrades();
 }
 
-static void write_cmd_reply(int outfd)
+/** Like upgrade_status(), but only looks at the packages whose dpkg
+ *  status changed since the last scan.  Only valid when nothing but
+ *  the status file changed (so no candidate version can have moved).
+ */
+static unsigned int update_upgrade_status()
+{
+  if(!scanned_status_valid || !opened_status_valid)
+    return upgrade_status();
+
+  vector<string> changed;
+  diff_dpkg_status(scanned_status, opened_status, changed);
+
+  for(vector<string>::const_iterator i=changed.begin(); i!=changed.end(); ++i)
+    {
+      string::size_type colon=i->rfind(':');
+      string name(*i, 0, colon);
+      string arch(*i, colon+1);
+
+      if(arch.empty() || arch=="all")
+	arch="native";
+
+      pkgCache::PkgIterator pkg=(*cache)->GetCache().FindPkg(name, arch);
+
+      if(!pkg.end())
+	update_upgrade_entry(pkg);
+      else
+	{
+	  // Gone from the cache altogether.
+	  upgrades.erase(name);
+	  upgrades.erase(name+":"+arch);
+	}
+    }
+
+  take_opened_status();
+
+  return summarize_upgrades();
+}
+
+/** Fingerprint what the cache would be built from right now. */
+static void fingerprint_inputs(cache_fingerprint &fp)
+{
+  vector<string> listdirs;
+
+  listdirs.push_back(syslistdir);
+
+  string mylistdir=_config->FindDir("Dir::State::Lists");
+  if(mylistdir!=syslistdir)
+    listdirs.push_back(mylistdir);
+
+  fingerprint_cache_inputs(fp, listdirs);
+}
+
+/** Reply to a command with the given upgrade status. */
+static void write_cmd_reply(int outfd, unsigned int status)
 {
   unsigned char msgid;
 
-  switch(upgrade_status())
+  switch(status)
+    {
+    case UPGRADE_CLASS_NONE: msgid=APPLET_REPLY_CMD_COMPLETE_NOUPGRADES; break;
+    case UPGRADE_CLASS_NORMAL: msgid=APPLET_REPLY_CMD_COMPLETE_UPGRADES; break;
+    default: msgid=APPLET_REPLY_CMD_COMPLETE_SECURITY_UPGRADES; break;
+    }
+
+  msg_builder(msgid).put_byte(status).send(outfd);
+}
+
+static void write_cmd_reply(int outfd)
+{
+  write_cmd_reply(outfd, upgrade_status());
+}
+
+/** (Re)open the cache.  Everything that opens the cache goes through
+ *  here.
+ */
+static bool open_cache(OpProgress &progress)
+{
+  // Read before opening: if the status file changes in between, the
+  // next status-only reload sees those packages as changed again.
+  opened_status_valid=read_dpkg_status(_config->FindFile("Dir::State::status"),
+				       opened_status);
+
+  cache->Close();
+
+  ++cache_generation;
+  cache_open=cache->Open(&progress, false);
+
+  if(cache_open)
+    classify_package_files();
+  else
     {
-    case 0: msgid=APPLET_REPLY_CMD_COMPLETE_NOUPGRADES; break;
-    case 1: msgid=APPLET_REPLY_CMD_COMPLETE_UPGRADES; break;
-    case 2: msgid=APPLET_REPLY_CMD_COMPLETE_SECURITY_UPGRADES; break;
-    default: msgid=APPLET_REPLY_CMD_COMPLETE_NOUPGRADES; break;
+      file_classes.clear();
+
+      free_dpkg_status(opened_status);
+      opened_status_valid=false;
     }
 
-  write_msgid(outfd, msgid);
+  return cache_open;
+}
+
+/** Tell the applet what the upgrade state was when we last looked,
+ *  so it has something to show while the cache loads.  \b current
+ *  is set if the cache inputs haven't changed since then.
+ */
+static void write_provisional_reply(int outfd, const cache_fingerprint &fp)
+{
+  upgrade_snapshot snap;
+
+  if(!HOME || !read_snapshot(snapshot_file(), snap))
+    return;
+
+  msg_builder(APPLET_REPLY_INIT_PROVISIONAL)
+    .put_byte(snap.status)
+    .put_bool(snap.fingerprint==fp.digest())
+    .put_uint64(snap.when)
+    .put_uint32(snap.packages.size())
+    .send(outfd);
 }
 
 static void write_init_reply(int outfd)
 {
   unsigned char msgid;
+  unsigned int status=upgrade_status();
+
+  switch(status)
+    {
+    case UPGRADE_CLASS_NONE: msgid=APPLET_REPLY_INIT_OK_NOUPGRADES; break;
+    case UPGRADE_CLASS_NORMAL: msgid=APPLET_REPLY_INIT_OK_UPGRADES; break;
+    default: msgid=APPLET_REPLY_INIT_OK_SECURITY_UPGRADES; break;
+    }
+
+  msg_builder(msgid).put_byte(status).send(outfd);
+}
+
+/** Reopen the cache if it was closed while idle.  Returns \b false
+ *  (after reporting the errors) if it can't be opened.
+ */
+static bool ensure_cache_open(int outfd)
+{
+  if(cache_open)
+    return true;
+
+  setup_list_dir(outfd);
+  setup_cache_dir(outfd);
 
-  switch(upgrade_status())
+  SlaveProgress progress(outfd);
+
+  cache_fingerprint fp;
+  fingerprint_inputs(fp);
+
+  if(!open_cache(progress))
+    {
+      cache_inputs.clear();
+      dump_errors(APPLET_REPLY_FATALERROR, outfd);
+      return false;
+    }
+
+  // Keep the remembered status in line with what's now open, so the
+  // reload shortcut stays honest; a reload request is already
+  // pending if anything changed.
+  if(fp!=cache_inputs)
     {
-    case 0: msgid=APPLET_REPLY_INIT_OK_NOUPGRADES; break;
-    case 1: msgid=APPLET_REPLY_INIT_OK_UPGRADES; break;
-    case 2: msgid=APPLET_REPLY_INIT_OK_SECURITY_UPGRADES; break;
-    default: msgid=APPLET_REPLY_INIT_OK_NOUPGRADES; break;
+      cache_inputs=fp;
+      upgrade_status();
     }
+  else
+    take_opened_status();
 
-  write_msgid(outfd, msgid);
+  return true;
 }
 
 static void do_update(int outfd)
 {
   setup_list_dir(outfd);
+  setup_cache_dir(outfd);
   setup_archive_dir(outfd);
 
   SlaveProgress progress(outfd);
 
   copy_lists();
 
-  slaveAcquireStatus log(outfd);
+  slaveAcquireStatus log(outfd, PROGRESS_PHASE_UPDATE);
   pkgSourceList sources;
 
   if(sources.ReadMainList()==false || _error->PendingError())
@@ -432,17 +962,82 @@ static void do_update(int outfd)
       return;
     }
 
-  cache->Close();
-  if(!cache->Open(&progress, false))
-    {
-      dump_errors(APPLET_REPLY_FATALERROR, outfd);
-      return;
-    }
+  if(!reopen_cache(progress, outfd))
+    return;
 
-  if(!fetcher.Clean(_config->FindDir("Dir::State::lists")) ||
-     !fetcher.Clean(_config->FindDir("Dir::State::lists")+"partial/"))
-    {
-      dump_errors(APPLET_REPLY_FATALERROR, outfd);
+  set<string> lists;
+  add_list_files(fetcher, lists);
+
+  finish_update(lists, outfd);
+}
+
+/** Rebuild the cache from freshly fetched lists.  Returns \b false
+ *  (after reporting the errors) if it can't be opened.
+ */
+static bool reopen_cache(OpProgress &progress, int outfd)
+{
+  // Taken before opening, so that anything which changes while the
+  // cache is being built is caught by the next reload.
+  cache_fingerprint fp;
+  fingerprint_inputs(fp);
+
+  if(!open_cache(progress))
+    {
+      cache_inputs.clear();
+      dump_errors(APPLET_REPLY_FATALERROR, outfd);
+      return false;
+    }
+
+  cache_inputs=fp;
+
+  return true;
+}
+
+/** Note the names of the files that the fetcher's items wrote, so
+ *  that cleaning up after an update keeps them.
+ */
+static void add_list_files(pkgAcquire &fetcher, set<string> &lists)
+{
+  for(pkgAcquire::ItemIterator i=fetcher.ItemsBegin();
+      i!=fetcher.ItemsEnd(); ++i)
+    lists.insert(flNotDir((*i)->DestFile));
+}
+
+/** As pkgAcquire::Clean(), but keeping the given files: an update
+ *  that fetched its lists with several fetchers keeps all of them.
+ */
+static bool clean_lists(const string &dir, const set<string> &lists)
+{
+  DIR *d=opendir(dir.c_str());
+
+  if(d==NULL)
+    return _error->Errno("opendir", "Unable to read %s", dir.c_str());
+
+  for(dirent *e=readdir(d); e!=NULL; e=readdir(d))
+    {
+      string name=e->d_name;
+
+      if(name=="lock" || name=="partial" || name=="." || name==".." ||
+	 lists.count(name)>0)
+	continue;
+
+      unlink((dir+name).c_str());
+    }
+
+  closedir(d);
+
+  return true;
+}
+
+/** Throw away the lists that the update didn't fetch, clean the
+ *  archives, and tell the applet that the update is done.
+ */
+static void finish_update(const set<string> &lists, int outfd)
+{
+  if(!clean_lists(_config->FindDir("Dir::State::lists"), lists) ||
+     !clean_lists(_config->FindDir("Dir::State::lists")+"partial/", lists))
+    {
+      dump_errors(APPLET_REPLY_FATALERROR, outfd);
       return;
     }
 
@@ -464,48 +1059,79 @@ static void do_update(int outfd)
       write_cmd_reply(outfd);
 
       // Cancel any pending reload.
-      last_cache_change=0;
+      reload_timer.disarm();
+      pending_changes=0;
     }
 }
 
 static void do_reload(int outfd)
 {
   setup_list_dir(outfd);
+  setup_cache_dir(outfd);
   setup_archive_dir(outfd);
-  
-  SlaveProgress progress(outfd);
 
-  copy_lists();
-
-  cache->Close();
+  cache_fingerprint fp;
+  fingerprint_inputs(fp);
 
-  if(!cache->Open(&progress, false))
-    dump_errors(APPLET_REPLY_FATALERROR, outfd);
+  if(!cache_inputs.empty() && fp==cache_inputs)
+    // Nothing the cache depends on has changed; rebuilding it would
+    // just produce the same answer.
+    write_cmd_reply(outfd, cached_upgrade_status);
   else
-    write_cmd_reply(outfd);
+    {
+      SlaveProgress progress(outfd);
+
+      // If only the dpkg status file changed (the usual case after
+      // the user installs something), the lists are as they were:
+      // skip syncing them and let apt reuse its source cache, so that
+      // only the status information and the depcache are rebuilt.
+      bool status_only=!cache_inputs.empty() &&
+	(pending_changes&~CHANGE_STATUS)==0 &&
+	fp.same_except(cache_inputs, _config->FindFile("Dir::State::status"));
+
+      if(!status_only)
+	{
+	  copy_lists();
+
+	  // The private lists may have just changed.
+	  fingerprint_inputs(fp);
+	}
+
+      if(!open_cache(progress))
+	{
+	  cache_inputs.clear();
+	  dump_errors(APPLET_REPLY_FATALERROR, outfd);
+	}
+      else
+	{
+	  cache_inputs=fp;
+
+	  // With the lists untouched, only packages whose dpkg status
+	  // changed can have changed upgrade status.
+	  if(status_only)
+	    write_cmd_reply(outfd, update_upgrade_status());
+	  else
+	    write_cmd_reply(outfd);
+	}
+    }
 
   // Cancel any pending reload.
-  last_cache_change=0;
+  reload_timer.disarm();
+  pending_changes=0;
 }
 
-static void do_su(int cmdfd, int outfd)
+static void do_su(msg_frame &frame, int cmdfd, int outfd)
 {
   bool run_xterm=0;
-  read(cmdfd, &run_xterm, sizeof(run_xterm));
-
-  char *cmdchstr=read_string(cmdfd);
+  string cmd;
 
-  if(cmdchstr==NULL)
+  if(!frame.get_bool(run_xterm) || !frame.get_string(cmd))
     {
       write_msg(outfd, APPLET_REPLY_AUTH_FAIL, "Protocol error: can't read the string which should be sent.");
-      free(cmdchstr);
 
       return;
     }
 
-  string cmd=cmdchstr;
-  //free(cmdchstr);
-
   // Abort if we already have an auth helper running.
   //
   // NOTE: this is not terribly robust; it means that if the auth
@@ -527,12 +1153,21 @@ static void do_su(int cmdfd, int outfd)
       return;
     }
 
-  switch(fork())
+  pid_t pid;
+
+  switch(pid=fork())
     {
     case 0:
       {
 	char authhelper[]=LIBEXECDIR "/apt-watch-auth-helper";
 
+	// The slave blocks SIGCHLD for its signalfd; don't pass that on
+	// to the helper and the package manager.
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_UNBLOCK, &mask, NULL);
+
 	close(cmdfd);
 	close(outfd);
 
@@ -551,7 +1186,7 @@ static void do_su(int cmdfd, int outfd)
 	else
 	  execl(authhelper, authhelper, cmd.c_str(), NULL);
 
-	write_errno(helpertoslave[1], APPLET_REPLY_AUTH_FAIL, "Unable to execute \""+string(authhelper)+"\": %s");
+	write_errno(1, APPLET_REPLY_AUTH_FAIL, "Unable to execute \""+string(authhelper)+"\": %s");
 	exit(-1);
       }
     case -1:
@@ -561,7 +1196,7 @@ static void do_su(int cmdfd, int outfd)
       close(helpertoslave[0]);
       close(helpertoslave[1]);
 
-      write_errno(cmdfd, APPLET_REPLY_AUTH_FAIL, "Unable to fork: %s");
+      write_errno(outfd, APPLET_REPLY_AUTH_FAIL, "Unable to fork: %s");
       return;
 
     default:
@@ -571,74 +1206,323 @@ static void do_su(int cmdfd, int outfd)
       to_authhelper_fd=slavetohelper[1];
       from_authhelper_fd=helpertoslave[0];
 
+      authhelper_pids.push_back(pid);
+
+      main_loop.add_fd(from_authhelper_fd, on_authhelper_input, &slave_fds);
+
       break;
     }
 }
 
-static void do_auth_reply(int cmdfd, int outfd)
+static void do_auth_reply(msg_frame &frame, int outfd)
 {
-  char *s=read_string(cmdfd);
+  string s;
 
-  if(!s)
+  if(!frame.get_string(s))
     write_msg(outfd, APPLET_REPLY_AUTH_ERRORMSG, "Protocol error reading the command to execute.");
   else if(to_authhelper_fd!=-1)
-    write_string(to_authhelper_fd, s);
+    {
+      msg_builder msg(APPLET_CMD_AUTHREPLY);
 
-  free(s);
+      msg.put_string(s).send(to_authhelper_fd);
+      msg.wipe();
+    }
+
+  s.replace(0, s.size(), s.size(), '\0');
+  frame.wipe();
+}
+
+/** Create the shared progress block and tell the applet where to
+ *  find it.  The applet opens /proc/<pid>/fd/<fd>, since a pipe
+ *  can't carry the descriptor itself.  If shared memory isn't
+ *  available, nothing is sent and progress keeps going down the pipe.
+ */
+static void do_progress_shm_request(int outfd)
+{
+  if(progress_shm==NULL)
+    progress_shm_fd=progress_block_create(&progress_shm);
+
+  if(progress_shm_fd==-1)
+    return;
+
+  msg_builder(APPLET_REPLY_PROGRESS_SHM)
+    .put_uint32(getpid())
+    .put_uint32(progress_shm_fd)
+    .send(outfd);
 }
 
-static bool candidate_in_system_cache(pkgCache::PkgIterator &pkg)
+static void do_progress_shm_enable(msg_frame &frame)
 {
-  // This ASS U ME s that apt-pkg places things in
-  // [Dir::Cache::archives]/name_version_arch.deb .  See
-  // acquire_item.cc:376 (from apt 0.5.4)
+  bool enable;
 
-  pkgCache::VerIterator candver=(*cache)[pkg].CandidateVerIter(*cache);
+  if(frame.get_bool(enable))
+    progress_shm_enabled=enable && progress_shm!=NULL;
+}
+
+/** \return the name of the given version's .deb in the archives.
+ *
+ *  This ASS U ME s that apt-pkg places things in
+ *  [Dir::Cache::archives]/name_version_arch.deb .  See
+ *  acquire_item.cc:376 (from apt 0.5.4)
+ */
+static string archive_file_name(const pkgCache::VerIterator &ver)
+{
+  return QuoteString(ver.ParentPkg().Name(),"_:") + '_' +
+    QuoteString(ver.VerStr(),"_:") + '_' +
+    QuoteString(ver.Arch(),"_:.") + ".deb";
+}
 
-  if(candver.end())
+/** \return the strongest hash the index gives for the given
+ *  version's .deb, as "TYPE:value", or "" if there is none.
+ */
+static string archive_hash(pkgRecords &records,
+			   const pkgCache::VerIterator &ver)
+{
+  pkgRecords::Parser &parse=records.Lookup(ver.FileList());
+
+  string hash=parse.SHA256Hash();
+  if(!hash.empty())
+    return "SHA256:"+hash;
+
+  hash=parse.SHA1Hash();
+  if(!hash.empty())
+    return "SHA1:"+hash;
+
+  hash=parse.MD5Hash();
+  if(!hash.empty())
+    return "MD5Sum:"+hash;
+
+  return "";
+}
+
+/** Load the download journal afresh: the auth helper moves the
+ *  private archives away, journal and all.
+ */
+static void open_journal()
+{
+  journal.open(_config->FindDir("Dir::Cache::archives")+"partial/apt-watch.journal");
+}
+
+/** Tests whether the given version's .deb is already in the system
+ *  archive directory, or (complete) in our private one.
+ */
+static bool already_downloaded(const pkgCache::VerIterator &ver)
+{
+  if(ver.end())
     // hm
     return true;
 
-  string fn=sysarchivedir +
-    QuoteString(candver.ParentPkg().Name(),"_:") + '_' +
-    QuoteString(candver.VerStr(),"_:") + '_' +
-    QuoteString(candver.Arch(),"_:.") + ".deb";
+  string fn=archive_file_name(ver);
 
-  return access(fn.c_str(), F_OK)==0;
+  // A size mismatch is what apt itself uses to spot an interrupted
+  // download.
+  return archives.find(sysarchive_index, fn, ver->Size) ||
+    (privatearchive_index!=sysarchive_index &&
+     archives.find(privatearchive_index, fn, ver->Size));
 }
 
-static void do_download(int cmdfd, int outfd)
+/** Something to fetch: a package and the version to download. */
+struct fetch_job
 {
-  setup_archive_dir(outfd);
+  pkgCache::PkgIterator pkg;
+  pkgCache::VerIterator ver;
+};
 
-  bool download_all;
-  read(cmdfd, &download_all, sizeof(download_all));
+/** What installing the upgrades of some class would pull in. */
+struct upgrade_plan
+{
+  /** The cache_generation this was computed for; 0 if never. */
+  unsigned long generation;
 
-  slaveAcquireStatus log(outfd);
-  pkgAcquire fetcher;
-  
-  if (!fetcher.Setup(&log, ""))
+  /** Every package that would be installed, whether or not its .deb
+   *  is already around.
+   */
+  vector<fetch_job> jobs;
+
+  /** The total size of those .debs. */
+  unsigned long long download_size;
+
+  upgrade_plan():generation(0), download_size(0) {}
+};
+
+/** Plans for downloading the upgrades of at least each class; see
+ *  get_upgrade_plan().
+ */
+upgrade_plan upgrade_plans[UPGRADE_CLASS_CRITICAL+1];
+
+/** Read a plan off a scratch depcache: the packages marked for
+ *  installation that can be reached from the given upgrades.
+ *
+ *  Only the upgrades and what they depend on are visited, rather
+ *  than the whole package cache: the packages that end up marked are
+ *  the upgrades themselves plus whatever auto-installation reached
+ *  through their dependencies, so a walk along the dependencies of
+ *  marked packages finds all of them.
+ */
+static void read_upgrade_plan(pkgDepCache &scratch,
+			      const vector<pkgCache::PkgIterator> &roots,
+			      upgrade_plan &plan)
+{
+  pkgCache &pkgcache=*cache->GetPkgCache();
+
+  plan.jobs.clear();
+  plan.download_size=0;
+
+  vector<bool> visited(pkgcache.Head().PackageCount, false);
+  vector<pkgCache::PkgIterator> queue;
+
+  for(vector<pkgCache::PkgIterator>::const_iterator i=roots.begin();
+      i!=roots.end(); ++i)
+    if(!visited[(*i)->ID])
+      {
+	visited[(*i)->ID]=true;
+	queue.push_back(*i);
+      }
+
+  for(vector<pkgCache::PkgIterator>::size_type n=0; n<queue.size(); ++n)
     {
-      dump_errors(APPLET_REPLY_FATALERROR, outfd);
-      return;
+      pkgCache::PkgIterator pkg=queue[n];
+
+      if(!scratch[pkg].Install())
+	continue;
+
+      fetch_job job;
+      job.pkg=pkg;
+      job.ver=scratch[pkg].CandidateVerIter(scratch);
+      plan.jobs.push_back(job);
+
+      plan.download_size+=job.ver->Size;
+
+      for(pkgCache::DepIterator dep=job.ver.DependsList(); !dep.end(); ++dep)
+	{
+	  pkgCache::PkgIterator target=dep.TargetPkg();
+
+	  if(!visited[target->ID])
+	    {
+	      visited[target->ID]=true;
+	      queue.push_back(target);
+	    }
+
+	  // Virtual packages are satisfied by their providers.
+	  for(pkgCache::PrvIterator prv=target.ProvidesList(); !prv.end(); ++prv)
+	    {
+	      pkgCache::PkgIterator owner=prv.OwnerPkg();
+
+	      if(!visited[owner->ID])
+		{
+		  visited[owner->ID]=true;
+		  queue.push_back(owner);
+		}
+	    }
+	}
     }
-  
-  pkgSourceList sources;
-  pkgRecords records(*cache);
 
-  if(sources.ReadMainList()==false || _error->PendingError())
+  plan.generation=cache_generation;
+}
+
+/** Work out the plans for every class on one scratch depcache.  The
+ *  upgrades are marked a class at a time, most urgent first, and each
+ *  plan is read off once its class is marked: the plan for a class
+ *  takes in those of the more urgent ones, as downloading it would.
+ */
+static void build_upgrade_plans()
+{
+  pkgCache &pkgcache=*cache->GetPkgCache();
+
+  // The live depcache is left alone, so marking here can't leak into
+  // later status checks.
+  pkgDepCache scratch(&pkgcache, cache->GetPolicy());
+  scratch.Init(NULL);
+
+  vector<pkgCache::PkgIterator> by_class[UPGRADE_CLASS_CRITICAL+1];
+
+  for(upgrade_set::const_iterator i=upgrades.begin(); i!=upgrades.end(); ++i)
     {
-      dump_errors(APPLET_REPLY_FATALERROR, outfd);
-      return;
+      pkgCache::PkgIterator pkg=pkgcache.FindPkg(i->first);
+
+      if(!pkg.end())
+	by_class[min<unsigned char>(i->second.upgrade_class,
+				    UPGRADE_CLASS_CRITICAL)].push_back(pkg);
     }
 
-  FileFd lock;
-  lock.Fd(GetLock(_config->FindDir("Dir::State::Lists")+"lock"));
-  if(_error->PendingError())
+  vector<pkgCache::PkgIterator> roots;
+
+  for(int c=UPGRADE_CLASS_CRITICAL; c>=UPGRADE_CLASS_NONE; --c)
     {
-      dump_errors(APPLET_REPLY_FATALERROR, outfd);
-      return;
+      const vector<pkgCache::PkgIterator> &added=by_class[c];
+
+      {
+	// The depcache's bookkeeping sweep runs once, when the group
+	// ends, rather than after every mark.
+	pkgDepCache::ActionGroup group(scratch);
+
+	// Mark first without autoinst, so that the upgrades
+	// themselves take precedence over anything their
+	// dependencies would pick...
+	for(vector<pkgCache::PkgIterator>::const_iterator i=added.begin();
+	    i!=added.end(); ++i)
+	  scratch.MarkInstall(*i, false);
+
+	// ...then with it, to resolve the dependencies in one go.
+	for(vector<pkgCache::PkgIterator>::const_iterator i=added.begin();
+	    i!=added.end(); ++i)
+	  scratch.MarkInstall(*i, true);
+      }
+
+      roots.insert(roots.end(), added.begin(), added.end());
+
+      read_upgrade_plan(scratch, roots, upgrade_plans[c]);
     }
+}
+
+/** \return the plan for downloading the upgrades of at least the
+ *  given class, working them all out only if the cache changed since
+ *  they were last asked for.
+ */
+static const upgrade_plan &get_upgrade_plan(unsigned char min_class)
+{
+  if(min_class>UPGRADE_CLASS_CRITICAL)
+    min_class=UPGRADE_CLASS_CRITICAL;
+
+  upgrade_plan &plan=upgrade_plans[min_class];
+
+  if(plan.generation!=cache_generation)
+    build_upgrade_plans();
+
+  return plan;
+}
+
+/** Orders fetch jobs smallest first. */
+struct smaller_download
+{
+  bool operator()(const fetch_job &a, const fetch_job &b) const
+  {
+    return a.ver->Size<b.ver->Size;
+  }
+};
+
+/** Fetch one round of packages, along with the given package lists
+ *  if \b indexes is not NULL.
+ *
+ *  \return \b true if every package in the round was fetched.
+ */
+static bool fetch_round(const vector<fetch_job> &jobs,
+			unsigned char upgrade_class,
+			slaveAcquireStatus &log,
+			pkgSourceList &sources, pkgRecords &records,
+			const vector<metaIndex *> *indexes,
+			set<string> *lists)
+{
+  pkgAcquire fetcher;
+
+  if(!fetcher.Setup(&log, ""))
+    return false;
+
+  if(indexes!=NULL)
+    for(vector<metaIndex *>::const_iterator i=indexes->begin();
+	i!=indexes->end(); ++i)
+      if(!(*i)->GetIndexes(&fetcher))
+	return false;
 
   // A pox on undocumented APIs!
   //
@@ -648,35 +1532,36 @@ static void do_download(int cmdfd, int outfd)
   // *distinct* strings here.
   vector<string *> filenames;
 
-  // Download every upgradable file; include files that are depended upon.
+  // Which package each item fetches, for the completion messages.
+  map<pkgAcquire::Item *, string> names;
 
-  // Mark first without autoinst
-  for(pkgCache::PkgIterator pkg=(*cache)->PkgBegin(); !pkg.end(); ++pkg)
-    if(!pkg.CurrentVer().end() && (*cache)[pkg].Upgradable() &&	
-       (download_all || upgrade_is_security(pkg)))
-      (*cache)->MarkInstall(pkg);
+  for(vector<fetch_job>::const_iterator i=jobs.begin(); i!=jobs.end(); ++i)
+    {
+      filenames.push_back(new string());
 
-  // Next with.
-  for(pkgCache::PkgIterator pkg=(*cache)->PkgBegin(); !pkg.end(); ++pkg)
-    if(!pkg.CurrentVer().end() && (*cache)[pkg].Upgradable() &&	
-       (download_all || upgrade_is_security(pkg)))
-      (*cache)->MarkInstall(pkg, true);
+      pkgAcquire::Item *item=new pkgAcqArchive(&fetcher, &sources, &records,
+					       i->ver, *(filenames.back()));
 
-  // TODO: exclude files whose .deb already exists in the system directory.
-  // TODO: exclude held files.
-  for(pkgCache::PkgIterator pkg=(*cache)->PkgBegin(); !pkg.end(); ++pkg)
-    if((*cache)[pkg].Install() &&
-       !candidate_in_system_cache(pkg))
-      {
-	filenames.push_back(new string());
+      names[item]=i->pkg.FullName(true);
+    }
 
-	new pkgAcqArchive(&fetcher, &sources, &records,
-			  (*cache)[pkg].CandidateVerIter(*cache),
-			  *(filenames.back()));
-      }
+  log.set_fetched_packages(&names, upgrade_class);
 
+  bool ok=(fetcher.Run()==pkgAcquire::Continue);
 
-  fetcher.Run();
+  log.set_fetched_packages(NULL, upgrade_class);
+
+  // A list that isn't there (a missing translation, say) is no
+  // reason to think the packages weren't fetched.
+  for(pkgAcquire::ItemIterator i=fetcher.ItemsBegin();
+      i!=fetcher.ItemsEnd(); ++i)
+    if(names.count(*i)==0)
+      {
+	if(lists!=NULL)
+	  lists->insert(flNotDir((*i)->DestFile));
+      }
+    else if((*i)->Status!=pkgAcquire::Item::StatDone)
+      ok=false;
 
   while(!filenames.empty())
     {
@@ -684,6 +1569,179 @@ static void do_download(int cmdfd, int outfd)
       filenames.pop_back();
     }
 
+  return ok;
+}
+
+/** Fetch the package lists of the given sources, adding the names of
+ *  their files to \b lists.
+ *
+ *  \return \b false if the fetch failed outright.
+ */
+static bool fetch_indexes(const vector<metaIndex *> &indexes,
+			  slaveAcquireStatus &log, set<string> &lists)
+{
+  pkgAcquire fetcher;
+
+  if(!fetcher.Setup(&log, ""))
+    return false;
+
+  for(vector<metaIndex *>::const_iterator i=indexes.begin();
+      i!=indexes.end(); ++i)
+    if(!(*i)->GetIndexes(&fetcher))
+      return false;
+
+  bool ok=(fetcher.Run()!=pkgAcquire::Failed);
+
+  add_list_files(fetcher, lists);
+
+  return ok;
+}
+
+/** How far a series of download rounds has got. */
+struct download_progress
+{
+  /** \b false once any round failed to fetch everything. */
+  bool all_ready;
+
+  /** The least urgent class announced as ready so far. */
+  int ready_class;
+
+  download_progress()
+    :all_ready(true), ready_class(UPGRADE_CLASS_CRITICAL+1)
+  {
+  }
+};
+
+/** Download the upgrades of at least the given class, in rounds: the
+ *  most urgent class first, and within each round the smallest
+ *  packages first, so that security fixes are on disk as early as
+ *  possible.
+ *
+ *  If \b indexes is not NULL, those package lists are fetched along
+ *  with the first round that has anything to fetch (or on their own,
+ *  if none does), and the names of their files are added to \b lists.
+ */
+static void download_rounds(unsigned char min_class,
+			    slaveAcquireStatus &log,
+			    pkgSourceList &sources,
+			    download_progress &done,
+			    int outfd,
+			    const vector<metaIndex *> *indexes=NULL,
+			    set<string> *lists=NULL)
+{
+  pkgRecords records(*cache);
+
+  open_journal();
+
+  // Packages already handled by a more urgent round; a dependency of
+  // a security upgrade is fetched along with it.
+  vector<bool> scheduled((*cache)->Head().PackageCount, false);
+
+  // Download every upgradable file; include files that are depended upon.
+  //
+  // TODO: exclude held files.
+  for(int c=UPGRADE_CLASS_CRITICAL; c>=min_class && !log.was_cancelled(); --c)
+    {
+      const upgrade_plan &plan=get_upgrade_plan(c);
+
+      if(plan.jobs.empty())
+	continue;
+
+      vector<fetch_job> round;
+
+      for(vector<fetch_job>::const_iterator i=plan.jobs.begin();
+	  i!=plan.jobs.end(); ++i)
+	if(!scheduled[i->pkg->ID])
+	  {
+	    scheduled[i->pkg->ID]=true;
+
+	    if(i->ver.end())
+	      continue;
+
+	    // The archives have the last word: a file the journal says
+	    // we fetched may have been cleaned away since, or never
+	    // made it out of a private directory.
+	    string fn=archive_file_name(i->ver);
+	    string hash=archive_hash(records, i->ver);
+
+	    if(already_downloaded(i->ver))
+	      continue;
+
+	    if(journal.is_done(fn, i->ver->Size, hash))
+	      journal.forget(fn);
+
+	    journal.planned(fn, i->ver->Size, hash);
+	    round.push_back(*i);
+	  }
+
+      sort(round.begin(), round.end(), smaller_download());
+
+      if(!round.empty())
+	{
+	  if(!fetch_round(round, c, log, sources, records, indexes, lists))
+	    done.all_ready=false;
+
+	  indexes=NULL;
+	}
+
+      // Everything this class (and anything more urgent) needs is on
+      // disk.
+      if(done.all_ready && c<done.ready_class)
+	{
+	  done.ready_class=c;
+	  msg_builder(APPLET_REPLY_CLASS_READY).put_byte(c).send(outfd);
+	}
+    }
+
+  if(indexes!=NULL && !log.was_cancelled())
+    fetch_indexes(*indexes, log, *lists);
+}
+
+/** Download the upgrades that are available now. */
+static void do_download(msg_frame &frame, int outfd)
+{
+  setup_archive_dir(outfd);
+
+  bool download_all;
+  if(!frame.get_bool(download_all))
+    {
+      write_msg(outfd, APPLET_REPLY_FATALERROR, "Protocol error: can't read which upgrades to download.");
+      return;
+    }
+
+  if(!ensure_cache_open(outfd))
+    {
+      write_msgid(outfd, APPLET_REPLY_DOWNLOAD_COMPLETE);
+      return;
+    }
+
+  slaveAcquireStatus log(outfd, PROGRESS_PHASE_DOWNLOAD);
+
+  pkgSourceList sources;
+
+  if(sources.ReadMainList()==false || _error->PendingError())
+    {
+      dump_errors(APPLET_REPLY_FATALERROR, outfd);
+      return;
+    }
+
+  FileFd lock;
+  lock.Fd(GetLock(_config->FindDir("Dir::State::Lists")+"lock"));
+  if(_error->PendingError())
+    {
+      dump_errors(APPLET_REPLY_FATALERROR, outfd);
+      return;
+    }
+
+  // Without the watcher, nobody tells us when the archives change.
+  if(watcher.get_fd()==-1)
+    archives.invalidate();
+
+  download_progress done;
+
+  download_rounds(download_all?UPGRADE_CLASS_NORMAL:UPGRADE_CLASS_SECURITY,
+		  log, sources, done, outfd);
+
   // Nothing else to do right now: if the update failed, that's
   // Someone Else's Problem.
 
@@ -693,7 +1751,110 @@ static void do_download(int cmdfd, int outfd)
   write_msgid(outfd, APPLET_REPLY_DOWNLOAD_COMPLETE);
 }
 
-const char *HOME;
+/** Update the package lists and download the upgrades in one go.  The
+ *  sources that supplied the urgent upgrades last time are fetched
+ *  first; as soon as the cache is rebuilt from them, the urgent
+ *  upgrades download alongside the rest of the lists.  Then the
+ *  cache is rebuilt again and everything else is downloaded.
+ */
+static void do_update_and_download(msg_frame &frame, int outfd)
+{
+  bool download_all;
+  if(!frame.get_bool(download_all))
+    {
+      write_msg(outfd, APPLET_REPLY_FATALERROR, "Protocol error: can't read which upgrades to download.");
+      return;
+    }
+
+  setup_list_dir(outfd);
+  setup_cache_dir(outfd);
+  setup_archive_dir(outfd);
+
+  SlaveProgress progress(outfd);
+
+  copy_lists();
+
+  slaveAcquireStatus log(outfd, PROGRESS_PHASE_UPDATE);
+  pkgSourceList sources;
+
+  if(sources.ReadMainList()==false || _error->PendingError())
+    {
+      dump_errors(APPLET_REPLY_FATALERROR, outfd);
+      return;
+    }
+
+  FileFd lock;
+  lock.Fd(GetLock(_config->FindDir("Dir::State::Lists")+"lock"));
+  if(_error->PendingError())
+    {
+      dump_errors(APPLET_REPLY_FATALERROR, outfd);
+      return;
+    }
+
+  // Judged by the cache from before the update, if there is one.
+  vector<metaIndex *> urgent, rest;
+
+  for(pkgSourceList::const_iterator i=sources.begin(); i!=sources.end(); ++i)
+    if(meta_index_class(*i)>=UPGRADE_CLASS_SECURITY)
+      urgent.push_back(*i);
+    else
+      rest.push_back(*i);
+
+  // Nothing to put first: fetch everything up front.
+  if(urgent.empty())
+    urgent.swap(rest);
+
+  // The lists this update fetched: cleaning up keeps exactly those.
+  set<string> lists;
+
+  if(!fetch_indexes(urgent, log, lists))
+    {
+      dump_errors(APPLET_REPLY_FATALERROR, outfd);
+      return;
+    }
+
+  if(!reopen_cache(progress, outfd))
+    return;
+
+  download_progress done;
+
+  if(!rest.empty() && !log.was_cancelled())
+    {
+      download_rounds(UPGRADE_CLASS_SECURITY, log, sources, done, outfd,
+		      &rest, &lists);
+
+      if(!reopen_cache(progress, outfd))
+	return;
+    }
+
+  if(!log.was_cancelled())
+    {
+      // The event loop isn't running to pass on what we just fetched.
+      archives.invalidate();
+
+      log.set_phase(PROGRESS_PHASE_DOWNLOAD);
+
+      download_rounds(download_all?UPGRADE_CLASS_NORMAL:UPGRADE_CLASS_SECURITY,
+		      log, sources, done, outfd);
+    }
+
+  // Some lists may never have been fetched: they mustn't be cleaned
+  // up, nor the update reported as finished.
+  if(log.was_cancelled())
+    {
+      // Nothing scans the new cache, so nothing takes this over.
+      free_dpkg_status(opened_status);
+      opened_status_valid=false;
+
+      if(_error->PendingError())
+	dump_errors(APPLET_REPLY_FATALERROR, outfd);
+
+      write_msgid(outfd, APPLET_REPLY_DOWNLOAD_COMPLETE);
+      return;
+    }
+
+  finish_update(lists, outfd);
+}
 
 /** If the archive directory is not writable, put archives in
  *  ~/.apt-watch/archives.
@@ -757,226 +1918,379 @@ static void setup_list_dir(int outfd)
     }
 }
 
+/** If the system binary caches are not writable, keep them in
+ *  ~/.apt-watch/cache; otherwise apt rebuilds them in memory, parsing
+ *  every list, each time the cache is opened.
+ *
+ *  apt checks the caches against the list files itself; the stamp
+ *  file additionally throws them away if they were built from a
+ *  different list directory or by a different libapt-pkg.
+ */
+static void setup_cache_dir(int outfd)
+{
+  string srcpkgcache=_config->FindFile("Dir::Cache::srcpkgcache");
+
+  if(srcpkgcache.empty() || !HOME)
+    return;
+
+  string mycachedir=string(HOME)+"/.apt-watch/cache";
+
+  // Already set up.
+  if(flNotFile(srcpkgcache)==mycachedir+"/")
+    return;
+
+  if(access(flNotFile(srcpkgcache).c_str(), W_OK)==0)
+    return;
+
+  if(access(mycachedir.c_str(), F_OK)!=0)
+    mkdir(mycachedir.c_str(), 0755);
+
+  string pkgcache=mycachedir+"/pkgcache.bin";
+  srcpkgcache=mycachedir+"/srcpkgcache.bin";
+
+  string stampfile=mycachedir+"/stamp";
+  string stamp=_config->FindDir("Dir::State::lists")+"\n"+pkgLibVersion+"\n";
+
+  char buf[1024];
+  ssize_t len=0;
+  int fd=open(stampfile.c_str(), O_RDONLY);
+
+  if(fd!=-1)
+    {
+      len=read(fd, buf, sizeof(buf));
+      close(fd);
+    }
+
+  if(len<0 || string(buf, len)!=stamp)
+    {
+      unlink(pkgcache.c_str());
+      unlink(srcpkgcache.c_str());
+
+      fd=open(stampfile.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+      if(fd!=-1)
+	{
+	  if(write(fd, stamp.c_str(), stamp.size())!=(ssize_t) stamp.size())
+	    unlink(stampfile.c_str());
+	  close(fd);
+	}
+    }
+
+  _config->Set("Dir::Cache::pkgcache", pkgcache);
+  _config->Set("Dir::Cache::srcpkgcache", srcpkgcache);
+}
+
+/** Reap any auth helpers that have exited.  Only our own helpers
+ *  are waited for, so this can't steal apt's children.
+ */
+static void reap_auth_helpers()
+{
+  vector<pid_t>::iterator i=authhelper_pids.begin();
+
+  while(i!=authhelper_pids.end())
+    {
+      int Status=0;
+
+      if(waitpid(*i, &Status, WNOHANG)!=0)
+	i=authhelper_pids.erase(i);
+      else
+	++i;
+    }
+}
+
 static void shutdown_auth_helper()
 {
-  int Status = 0;
+  if(from_authhelper_fd!=-1)
+    main_loop.remove_fd(from_authhelper_fd);
+
   close(to_authhelper_fd);
   close(from_authhelper_fd);
 
   to_authhelper_fd=-1;
   from_authhelper_fd=-1;
 
-  // reap any dead children
-  while (waitpid(-1, &Status, WNOHANG) > 0)
-  ;
-  
+  authhelper_reader.clear();
+
+  // If the helper is still running, it exits when it sees its pipes
+  // close, and SIGCHLD brings us back here.
+  reap_auth_helpers();
+}
+
+static void slave_handle_cmd(msg_frame &frame, int cmdfd, int outfd)
+{
+  switch(frame.id())
+    {
+    case APPLET_CMD_UPDATE:
+      do_update(outfd);
+      break;
+    case APPLET_CMD_RELOAD:
+      do_reload(outfd);
+      break;
+    case APPLET_CMD_SU:
+      do_su(frame, cmdfd, outfd);
+      break;
+    case APPLET_CMD_AUTHREPLY:
+      do_auth_reply(frame, outfd);
+      break;
+    case APPLET_CMD_AUTHCANCEL:
+      shutdown_auth_helper();
+      break;
+    case APPLET_CMD_DOWNLOAD:
+      do_download(frame, outfd);
+      break;
+    case APPLET_CMD_ABORT_DOWNLOAD:
+      // Arrived after the operation finished; ignore it as promised
+      // in protocol.txt.
+      break;
+    case APPLET_CMD_PROGRESS_SHM_REQUEST:
+      do_progress_shm_request(outfd);
+      break;
+    case APPLET_CMD_PROGRESS_SHM_ENABLE:
+      do_progress_shm_enable(frame);
+      break;
+    case APPLET_CMD_UPDATE_AND_DOWNLOAD:
+      do_update_and_download(frame, outfd);
+      break;
+    default:
+      {
+	char s[1024];
+	snprintf(s, sizeof(s)-1, "Bad command ID %d", frame.id());
+	write_msg(outfd, APPLET_REPLY_FATALERROR, s);
+      }
+      break;
+    }
 }
 
 /** Returns \b true to terminate the program successfully. */
 bool slave_handle_input(int cmdfd, int outfd)
 {
-  unsigned char c;
-
-  if(read(cmdfd, &c, sizeof(c))<(int) sizeof(c))
+  if(cmd_reader.fill(cmdfd)<=0)
     {
       // assume we should terminate.
       return true;
     }
-  else
-    switch(c)
+
+  // One read can carry several commands.
+  msg_frame frame;
+  while(cmd_reader.next(frame))
+    slave_handle_cmd(frame, cmdfd, outfd);
+
+  if(cmd_reader.corrupt())
+    {
+      write_msg(outfd, APPLET_REPLY_FATALERROR, "Protocol error: garbled command stream.");
+      return true;
+    }
+
+  return false;
+}
+
+/** Handles one message from the auth helper.  Returns \b false if
+ *  the helper was shut down.
+ */
+static bool slave_handle_auth_msg(msg_frame &frame, int outfd)
+{
+  // Any APPLET_REPLY_AUTH* command is possible.
+  //
+  // We just forward them to our parent.  Frames are written
+  // atomically, but we still look at each one so we know when the
+  // helper is done.
+  switch(frame.id())
+    {
+      // These all pass a single string as an argument.
+    case APPLET_REPLY_AUTH_PROMPT_NOECHO:
+    case APPLET_REPLY_AUTH_PROMPT_ECHO:
+    case APPLET_REPLY_AUTH_ERRORMSG:
+    case APPLET_REPLY_AUTH_INFO:
+    case APPLET_REPLY_AUTH_FAIL:
       {
-      case APPLET_CMD_UPDATE:
-	do_update(outfd);
-	break;
-      case APPLET_CMD_RELOAD:
-	do_reload(outfd);
-	break;
-      case APPLET_CMD_SU:
-	do_su(cmdfd, outfd);
-	break;
-      case APPLET_CMD_AUTHREPLY:
-	do_auth_reply(cmdfd, outfd);
-	break;
-      case APPLET_CMD_AUTHCANCEL:
-	shutdown_auth_helper();
-	break;
-      case APPLET_CMD_DOWNLOAD:
-	do_download(cmdfd, outfd);
-	break;
-      default:
-	{
-	  char s[1024];
-	  snprintf(s, sizeof(s)-1, "Bad command ID %d", c);
-	  write_msg(outfd, APPLET_REPLY_FATALERROR, s);
-	}
-	break;
+	string s;
+
+	if(!frame.get_string(s))
+	  {
+	    write_msg(outfd, APPLET_REPLY_AUTH_FAIL, "Couldn't read a message from the authentication helper.");
+	    shutdown_auth_helper();
+	    return false;
+	  }
+	else
+	  write_msg(outfd, frame.id(), s);
+
+	return true;
       }
 
-  return false;
+    case APPLET_REPLY_AUTH_OK:
+      write_msgid(outfd, frame.id());
+      return true;
+
+    case APPLET_REPLY_AUTH_FINISHED:
+      write_msgid(outfd, frame.id());
+      shutdown_auth_helper();
+      return false;
+
+    default:
+      write_msg(outfd, APPLET_REPLY_AUTH_FAIL, "Garbled reply from the authentication helper.");
+      shutdown_auth_helper();
+      return false;
+    }
 }
 
 static void slave_handle_auth_input(int outfd)
 {
-  unsigned char c;
-
   if(from_authhelper_fd==-1)
     {
       write_msg(outfd, APPLET_REPLY_AUTH_FAIL, "Internal error: I want to read an authentication message but the pipe is closed.");
       return;
     }
 
-  if(read(from_authhelper_fd, &c, sizeof(c))<(int) sizeof(c))
-    shutdown_auth_helper();
-  else
-    // Any APPLET_REPLY_AUTH* command is possible.
-    //
-    // We just forward them to our parent.  We do NOT splice the pipe
-    // with our parent's pipe: while it is an idea, atomic write()s
-    // are not currently used, which could cause problems.
-    switch(c)
-      {
-	// These all pass a single string as an argument.
-      case APPLET_REPLY_AUTH_PROMPT_NOECHO:
-      case APPLET_REPLY_AUTH_PROMPT_ECHO:
-      case APPLET_REPLY_AUTH_ERRORMSG:
-      case APPLET_REPLY_AUTH_INFO:
-      case APPLET_REPLY_AUTH_FAIL:
-	{
-	  char *s=read_string(from_authhelper_fd);
-
-	  if(s==NULL)
-	    {
-	      write_errno(outfd, APPLET_REPLY_AUTH_FAIL, "Couldn't read a message from the authentication helper: %s");
-	      shutdown_auth_helper();
-	    }
-	  else
-	    write_msg(outfd, c, s);
+  if(authhelper_reader.fill(from_authhelper_fd)<=0)
+    {
+      shutdown_auth_helper();
+      return;
+    }
 
-	  free(s);
-	  break;
-	}
+  msg_frame frame;
+  while(authhelper_reader.next(frame))
+    if(!slave_handle_auth_msg(frame, outfd))
+      return;
 
-      case APPLET_REPLY_AUTH_OK:
-	write_msgid(outfd, c);
-	break;
-	
-      case APPLET_REPLY_AUTH_FINISHED:
-	write_msgid(outfd, c);
-	shutdown_auth_helper();
-	break;
-	
-      default:
-	write_msg(outfd, APPLET_REPLY_AUTH_FAIL, "Garbled reply from the authentication helper.");
-	shutdown_auth_helper();
-	break;
-      }
+  if(authhelper_reader.corrupt())
+    {
+      write_msg(outfd, APPLET_REPLY_AUTH_FAIL, "Garbled reply from the authentication helper.");
+      shutdown_auth_helper();
+    }
 }
 
-#ifdef HAVE_LIBFAM
-void slave_handle_fam()
+static void on_changes(int fd, void *data)
 {
-  FAMEvent ev;
+  int changes=watcher.read_changes();
 
-  while(FAMPending(&famconn))
+  if(changes&CHANGE_ARCHIVES)
+    archives.invalidate();
+
+  if(changes&CHANGE_ALL)
     {
-      FAMNextEvent(&famconn, &ev);
+      pending_changes|=changes&CHANGE_ALL;
 
-      // Ignore lockfiles.
-      if(strcmp(ev.filename, "lock")==0)
-	continue;
+      // Restart the countdown.
+      reload_timer.arm(RELOAD_DELAY);
+    }
+}
 
-      switch(ev.code)
-	{
-	case FAMChanged:
-	case FAMDeleted:
-	case FAMCreated:
-	  last_cache_change=time(0);
-	  break;
-
-      	default:
-	  // Drop other events on the floor.
-	  break;
-	}
+static void on_cmd_input(int fd, void *data)
+{
+  slave_io *io=(slave_io *) data;
+
+  if(slave_handle_input(io->cmdfd, io->outfd))
+    main_loop.quit(0);
+  else
+    {
+      // Restart the idle countdown.
+      int idle_minutes=_config->FindI("APT-Watch::Idle-Timeout", 0);
+
+      if(idle_minutes>0)
+	idle_timer.arm(idle_minutes*60);
     }
 }
-#endif
 
-int slave_main(int cmdfd, int outfd)
+/** Nothing has happened for a while: drop the cache, keeping only
+ *  the upgrade status and the fingerprint it was computed from.  A
+ *  reload with unchanged inputs is answered from those; anything
+ *  else reopens the cache (from the saved binary caches, so that's
+ *  cheap).
+ */
+static void on_idle_timer(int fd, void *data)
 {
-  // eternal loop.
-  while(1)
+  idle_timer.acknowledge();
+  idle_timer.disarm();
+
+  // The auth helper's completion leads to a reload, so wait for it.
+  if(to_authhelper_fd!=-1)
     {
-      fd_set readfds;
-      int res;
-      int highest=-1;
-      int famfd=fam_available?FAMCONNECTION_GETFD(&famconn):-1;
+      idle_timer.arm(_config->FindI("APT-Watch::Idle-Timeout", 0)*60);
+      return;
+    }
 
-      struct timeval tm;
+  if(cache_open)
+    {
+      cache->Close();
+      ++cache_generation;
+      cache_open=false;
+      file_classes.clear();
+
+      // The next status-only reload falls back to a full scan.
+      free_dpkg_status(scanned_status);
+      scanned_status_valid=false;
+    }
+}
 
-      FD_ZERO(&readfds);
-      FD_SET(cmdfd, &readfds);
-      highest=max(highest, cmdfd);
+static void on_authhelper_input(int fd, void *data)
+{
+  slave_io *io=(slave_io *) data;
 
-#ifdef HAVE_LIBFAM
-      if(fam_available)
-	{
-	  FD_SET(famfd, &readfds);
-	  highest=max(highest, famfd);
-	}
-#endif
+  slave_handle_auth_input(io->outfd);
+}
 
-      if(from_authhelper_fd!=-1)
-	{
-	  FD_SET(from_authhelper_fd, &readfds);
-	  highest=max(highest, from_authhelper_fd);
-	}
+/** A reload is overdue.
+ *
+ *  A slightly quirky way of doing this: we send a message to the
+ *  applet requesting a reload command.  This roundabout approach is
+ *  used in order to avoid any potential race conditions (if a reload
+ *  is inappropriate, the applet will just drop the message on the
+ *  floor -- the only reason it can be inappropriate is if a reload or
+ *  update is already "under progress" -- meaning that we haven't read
+ *  the message requesting it yet).
+ */
+static void on_reload_timer(int fd, void *data)
+{
+  slave_io *io=(slave_io *) data;
 
-      // See how long to select for.
-      if(last_cache_change==0)
-	res=select(highest+1, &readfds, NULL, NULL, NULL);
-      else
-	{
-	  time_t curtime=time(0);
+  reload_timer.acknowledge();
+  reload_timer.disarm();
 
-	  if(last_cache_change+RELOAD_DELAY<curtime)
-	    tm.tv_sec=0;
-	  else
-	    tm.tv_sec=last_cache_change+RELOAD_DELAY-curtime;
-	  tm.tv_usec=0;
+  write_msgid(io->outfd, APPLET_REPLY_REQUEST_RELOAD);
+}
 
-	  res=select(highest+1, &readfds, NULL, NULL, &tm);
-	}
+static void on_sigchld(int fd, void *data)
+{
+  drain_signal_fd(fd);
+
+  reap_auth_helpers();
+}
 
-      if(FD_ISSET(cmdfd, &readfds))
-	if(slave_handle_input(cmdfd, outfd))
-	  return 0;
+int slave_main(int cmdfd, int outfd)
+{
+  slave_fds.cmdfd=cmdfd;
+  slave_fds.outfd=outfd;
 
-#ifdef HAVE_LIBFAM
-      if(fam_available && FD_ISSET(famfd, &readfds))
-	slave_handle_fam();
-#endif
+  if(!main_loop.add_fd(cmdfd, on_cmd_input, &slave_fds))
+    {
+      write_errno(outfd, APPLET_REPLY_FATALERROR, "Can't watch for commands: %s");
+      return -1;
+    }
 
-      if(from_authhelper_fd!=-1 && FD_ISSET(from_authhelper_fd, &readfds))
-	slave_handle_auth_input(outfd);
-
-      // A slightly quirky way of doing this: if a reload is overdue,
-      // we send a message to the applet requesting a reload command.
-      // This roundabout approach is used in order to avoid any
-      // potential race conditions (if a reload is inappropriate, the
-      // applet will just drop the message on the floor -- the only
-      // reason it can be inappropriate is if a reload or update is
-      // already "under progress" -- meaning that we haven't read the
-      // message requesting it yet).
-      if(last_cache_change>0 &&
-	 time(0)>last_cache_change &&
-	 time(0)-last_cache_change>=RELOAD_DELAY)
-	{
-	  unsigned char msgtype=APPLET_REPLY_REQUEST_RELOAD;
-	  write(outfd, &msgtype, 1);
+  if(watcher.get_fd()!=-1)
+    main_loop.add_fd(watcher.get_fd(), on_changes, &slave_fds);
 
-	  last_cache_change=0;
-	}
+  if(reload_timer.get_fd()!=-1)
+    main_loop.add_fd(reload_timer.get_fd(), on_reload_timer, &slave_fds);
+
+  if(idle_timer.get_fd()!=-1)
+    {
+      main_loop.add_fd(idle_timer.get_fd(), on_idle_timer, &slave_fds);
+
+      int idle_minutes=_config->FindI("APT-Watch::Idle-Timeout", 0);
+      if(idle_minutes>0)
+	idle_timer.arm(idle_minutes*60);
     }
+
+  int sigchldfd=open_signal_fd(SIGCHLD);
+  if(sigchldfd!=-1)
+    main_loop.add_fd(sigchldfd, on_sigchld, &slave_fds);
+
+  int rval=main_loop.run();
+
+  if(sigchldfd!=-1)
+    close(sigchldfd);
+
+  return rval;
 }
 
 int main(int argc, char **argv)
@@ -1006,6 +2320,9 @@ int main(int argc, char **argv)
   if(getuid()!=0 && geteuid()==0)
     {
       clearenv();
+
+      // Don't write files as root into a directory the user controls.
+      HOME=NULL;
     }
   else if(getuid()!=geteuid())
     {
@@ -1015,8 +2332,7 @@ int main(int argc, char **argv)
   else
     {
       // "dummy" authentication OK. (? -- just get rid of this here now?)
-      unsigned char msg=APPLET_REPLY_AUTH_OK;
-      write(1, &msg, sizeof(msg));
+      write_msgid(outfd, APPLET_REPLY_AUTH_OK);
 
       if(HOME)
 	{
@@ -1031,6 +2347,16 @@ int main(int argc, char **argv)
   if(pkgInitConfig(*_config))
     pkgInitSystem(*_config, _system);
 
+  // Our own settings, including the origin rules.
+  string conffile=_config->Find("APT-Watch::Config-File", "/etc/apt-watch.conf");
+  if(!_error->PendingError() && access(conffile.c_str(), F_OK)==0)
+    ReadConfigFile(*_config, conffile);
+
+  if(!_error->PendingError())
+    upgrade_rules.load(*_config, "APT-Watch::Rules");
+
+  set_copy_threads(_config->FindI("APT-Watch::Copy-Threads", 0));
+
   if(_error->PendingError())
     {
       dump_errors(APPLET_REPLY_INIT_FAILED, outfd);
@@ -1038,45 +2364,43 @@ int main(int argc, char **argv)
     }
 
   setup_list_dir(outfd);
+  setup_cache_dir(outfd);
   setup_archive_dir(outfd);
 
   cache=new pkgCacheFile;
   SlaveProgress progress(outfd);
 
-  if(!cache->Open(&progress, false) || _error->PendingError())
+  cache_fingerprint fp;
+  fingerprint_inputs(fp);
+
+  write_provisional_reply(outfd, fp);
+
+  if(!open_cache(progress) || _error->PendingError())
     {
       dump_errors(APPLET_REPLY_INIT_FAILED, outfd);
       return -1;
     }
 
+  cache_inputs=fp;
+
   write_init_reply(outfd);
 
-#ifdef HAVE_LIBFAM
-  // If opening the FAM connection fails, just don't bother.
+  // If the watcher can't be set up, just don't bother.
   // TODO/FIXME: periodically reload the cache in that case.
-  if(FAMOpen(&famconn)==0)
-    {
-      FAMRequest fr;
+  if(!watcher.open(syslistdir))
+    fprintf(stderr, "Unable to watch for package changes: %s\n", strerror(errno));
 
-      FAMMonitorDirectory(&famconn, syslistdir.c_str(), &fr, NULL);
-      FAMMonitorDirectory(&famconn, (syslistdir+"/partial").c_str(),
-			  &fr, NULL);
-      FAMMonitorDirectory(&famconn, _config->FindDir("Dir::Etc").c_str(),
-			  &fr, NULL);
-      FAMMonitorFile(&famconn, _config->FindFile("Dir::State::status").c_str(),
-		     &fr, NULL);
+  sysarchive_index=archives.add_dir(sysarchivedir);
+  watcher.watch_dir(sysarchivedir, CHANGE_ARCHIVES);
 
-      fam_available=true;
+  string myarchivedir=_config->FindDir("Dir::Cache::archives");
+  if(myarchivedir!=sysarchivedir)
+    {
+      privatearchive_index=archives.add_dir(myarchivedir);
+      watcher.watch_dir(myarchivedir, CHANGE_ARCHIVES);
     }
   else
-    fprintf(stderr, "Unable to initialize FAM.\n");
-#endif
-
-  int rval=slave_main(cmdfd, outfd);
+    privatearchive_index=sysarchive_index;
 
-#ifdef HAVE_LIBFAM
-  FAMClose(&famconn);
-#endif
-
-  return rval;
+  return slave_main(cmdfd, outfd);
 }
@@ -0,0 +1,66 @@
+// archive-index.cc
+
+#include "archive-index.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+unsigned int archive_index::add_dir(const string &dir)
+{
+  dirs.push_back(dir);
+  files.push_back(map<string, off_t>());
+
+  stale=true;
+
+  return dirs.size()-1;
+}
+
+void archive_index::rescan()
+{
+  for(vector<string>::size_type i=0; i<dirs.size(); ++i)
+    {
+      files[i].clear();
+
+      DIR *d=opendir(dirs[i].c_str());
+
+      if(!d)
+	continue;
+
+      struct dirent *ent;
+
+      while((ent=readdir(d))!=NULL)
+	{
+	  size_t len=strlen(ent->d_name);
+
+	  if(len<4 || strcmp(ent->d_name+len-4, ".deb")!=0)
+	    continue;
+
+	  struct stat buf;
+
+	  if(fstatat(dirfd(d), ent->d_name, &buf, 0)==0 &&
+	     S_ISREG(buf.st_mode))
+	    files[i][ent->d_name]=buf.st_size;
+	}
+
+      closedir(d);
+    }
+
+  stale=false;
+}
+
+bool archive_index::find(unsigned int dir, const string &fn, off_t size)
+{
+  if(stale)
+    rescan();
+
+  if(dir>=files.size())
+    return false;
+
+  map<string, off_t>::const_iterator found=files[dir].find(fn);
+
+  return found!=files[dir].end() && found->second==size;
+}
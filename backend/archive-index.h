@@ -0,0 +1,46 @@
+// archive-index.h -- what's in the archive directories.     -*-c++-*-
+//
+//  Remembers the name and size of every .deb in a set of directories,
+//  so checking whether a package was already downloaded doesn't cost
+//  a system call.
+
+#ifndef ARCHIVE_INDEX_H
+#define ARCHIVE_INDEX_H
+
+#include <sys/types.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+class archive_index
+{
+  std::vector<std::string> dirs;
+
+  /** For each directory in dirs, the size of each .deb by name. */
+  std::vector<std::map<std::string, off_t> > files;
+
+  bool stale;
+
+  void rescan();
+public:
+  archive_index():stale(true) {}
+
+  /** Index the given directory too; returns its number, for
+   *  find().
+   */
+  unsigned int add_dir(const std::string &dir);
+
+  /** Note that the directories changed; they'll be scanned again
+   *  on the next lookup.
+   */
+  void invalidate() {stale=true;}
+
+  /** \return \b true if the given directory holds a file named fn
+   *  with the given size.  A file of the wrong size (say, an
+   *  interrupted download) doesn't count.
+   */
+  bool find(unsigned int dir, const std::string &fn, off_t size);
+};
+
+#endif // ARCHIVE_INDEX_H
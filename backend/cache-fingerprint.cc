@@ -0,0 +1,159 @@
+// cache-fingerprint.cc
+
+#include "cache-fingerprint.h"
+
+#include <apt-pkg/configuration.h>
+
+#include <algorithm>
+
+#include <dirent.h>
+#include <string.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+/** The FNV-1a offset basis. */
+const uint64_t hash_basis=14695981039346656037ULL;
+
+cache_fingerprint::cache_fingerprint():hash(hash_basis)
+{
+}
+
+/** FNV-1a, folded over arbitrary bytes. */
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t len)
+{
+  const unsigned char *p=(const unsigned char *) data;
+
+  for(size_t i=0; i<len; ++i)
+    {
+      h^=p[i];
+      h*=1099511628211ULL;
+    }
+
+  return h;
+}
+
+bool cache_fingerprint::entry::operator==(const entry &other) const
+{
+  return dev==other.dev && ino==other.ino && size==other.size &&
+    mtime==other.mtime && mtime_nsec==other.mtime_nsec &&
+    path==other.path;
+}
+
+void cache_fingerprint::add_file(const string &path)
+{
+  struct stat buf;
+  entry e;
+
+  e.path=path;
+
+  if(stat(path.c_str(), &buf)==0)
+    {
+      e.dev=buf.st_dev;
+      e.ino=buf.st_ino;
+      e.size=buf.st_size;
+      e.mtime=buf.st_mtim.tv_sec;
+      e.mtime_nsec=buf.st_mtim.tv_nsec;
+    }
+  else
+    {
+      e.dev=0;
+      e.ino=0;
+      e.size=0;
+      e.mtime=0;
+      e.mtime_nsec=0;
+    }
+
+  hash=hash_bytes(hash, e.path.data(), e.path.size()+1);
+  hash=hash_bytes(hash, &e.dev, sizeof(e.dev));
+  hash=hash_bytes(hash, &e.ino, sizeof(e.ino));
+  hash=hash_bytes(hash, &e.size, sizeof(e.size));
+  hash=hash_bytes(hash, &e.mtime, sizeof(e.mtime));
+  hash=hash_bytes(hash, &e.mtime_nsec, sizeof(e.mtime_nsec));
+
+  entries.push_back(e);
+}
+
+void cache_fingerprint::add_dir(const string &dir)
+{
+  DIR *d=opendir(dir.c_str());
+
+  if(!d)
+    {
+      // Record the absence, so that creating it counts as a change.
+      add_file(dir);
+      return;
+    }
+
+  vector<string> names;
+  struct dirent *ent;
+
+  while((ent=readdir(d))!=NULL)
+    {
+      if(strcmp(ent->d_name, ".")==0 || strcmp(ent->d_name, "..")==0 ||
+	 strcmp(ent->d_name, "lock")==0)
+	continue;
+
+      // Skip subdirectories (partial/ in particular) when the type
+      // is known without a stat.
+      if(ent->d_type==DT_DIR)
+	continue;
+
+      names.push_back(ent->d_name);
+    }
+
+  closedir(d);
+
+  sort(names.begin(), names.end());
+
+  string prefix=dir;
+  if(prefix.empty() || prefix[prefix.size()-1]!='/')
+    prefix+='/';
+
+  for(vector<string>::const_iterator i=names.begin(); i!=names.end(); ++i)
+    add_file(prefix+*i);
+}
+
+void cache_fingerprint::clear()
+{
+  entries.clear();
+  hash=hash_basis;
+}
+
+bool cache_fingerprint::operator==(const cache_fingerprint &other) const
+{
+  return hash==other.hash && entries==other.entries;
+}
+
+bool cache_fingerprint::same_except(const cache_fingerprint &other,
+				    const string &path) const
+{
+  if(entries.size()!=other.entries.size())
+    return false;
+
+  for(vector<entry>::size_type i=0; i<entries.size(); ++i)
+    if(!(entries[i]==other.entries[i]) &&
+       (entries[i].path!=path || other.entries[i].path!=path))
+      return false;
+
+  return true;
+}
+
+void fingerprint_cache_inputs(cache_fingerprint &fp,
+			      const vector<string> &listdirs)
+{
+  fp.clear();
+
+  for(vector<string>::const_iterator i=listdirs.begin();
+      i!=listdirs.end(); ++i)
+    fp.add_dir(*i);
+
+  fp.add_file(_config->FindFile("Dir::State::status"));
+
+  fp.add_file(_config->FindFile("Dir::Etc::sourcelist"));
+  fp.add_dir(_config->FindDir("Dir::Etc::sourceparts"));
+  fp.add_file(_config->FindFile("Dir::Etc::preferences"));
+  fp.add_dir(_config->FindDir("Dir::Etc::preferencesparts"));
+  fp.add_file(_config->FindFile("Dir::Etc::main"));
+  fp.add_dir(_config->FindDir("Dir::Etc::parts"));
+}
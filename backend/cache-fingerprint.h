@@ -0,0 +1,79 @@
+// cache-fingerprint.h -- detect whether the cache inputs changed. -*-c++-*-
+//
+//  A fingerprint records the identity (device, inode, size and
+//  modification time) of every file the package cache is built from.
+//  If two fingerprints compare equal, reopening the cache would
+//  produce the same result.
+
+#ifndef CACHE_FINGERPRINT_H
+#define CACHE_FINGERPRINT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+class cache_fingerprint
+{
+  struct entry
+  {
+    std::string path;
+
+    /** All zero if the file doesn't exist. */
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;
+
+    bool operator==(const entry &other) const;
+    bool operator<(const entry &other) const {return path<other.path;}
+  };
+
+  std::vector<entry> entries;
+
+  uint64_t hash;
+public:
+  cache_fingerprint();
+
+  /** Record the given file; a missing file is recorded as such. */
+  void add_file(const std::string &path);
+
+  /** Record every regular file directly inside dir (in name order),
+   *  skipping the lock file.
+   */
+  void add_dir(const std::string &dir);
+
+  /** Forget everything. */
+  void clear();
+
+  bool empty() const {return entries.empty();}
+
+  /** A 64-bit digest of the recorded entries, for storing the
+   *  fingerprint somewhere compact.  Equal fingerprints have equal
+   *  digests.
+   */
+  uint64_t digest() const {return hash;}
+
+  /** \return \b true if this and other record the same files, and
+   *  differ at most in the entry for path.
+   */
+  bool same_except(const cache_fingerprint &other,
+		   const std::string &path) const;
+
+  bool operator==(const cache_fingerprint &other) const;
+  bool operator!=(const cache_fingerprint &other) const
+  {
+    return !(*this==other);
+  }
+};
+
+/** Fingerprint the inputs of the system package cache: the given
+ *  list directories, the dpkg status file, sources.list,
+ *  preferences, apt.conf and their .d directories.
+ */
+void fingerprint_cache_inputs(cache_fingerprint &fp,
+			      const std::vector<std::string> &listdirs);
+
+#endif // CACHE_FINGERPRINT_H
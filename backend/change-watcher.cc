@@ -0,0 +1,178 @@
+// change-watcher.cc
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "change-watcher.h"
+
+#include <apt-pkg/configuration.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+using namespace std;
+
+/** Split a path into its directory and its final component. */
+static void split_path(const string &path, string &dir, string &name)
+{
+  string::size_type slash=path.rfind('/');
+
+  if(slash==string::npos)
+    {
+      dir=".";
+      name=path;
+    }
+  else
+    {
+      dir=path.substr(0, slash+1);
+      name=path.substr(slash+1);
+    }
+}
+
+change_watcher::change_watcher():fd(-1)
+{
+}
+
+change_watcher::~change_watcher()
+{
+  if(fd!=-1)
+    close(fd);
+}
+
+bool change_watcher::add(const string &dir, const string &name, int kind)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+  // Note that IN_MODIFY and IN_ATTRIB are deliberately left out:
+  // apt and dpkg always finish an update with a close or a rename.
+  int wd=inotify_add_watch(fd, dir.c_str(),
+			   IN_CLOSE_WRITE|IN_MOVED_TO|IN_DELETE|IN_ONLYDIR);
+
+  if(wd<0)
+    return false;
+
+  rule r;
+  r.name=name;
+  r.kind=kind;
+
+  // Several rules can share a directory; inotify hands back the same
+  // watch descriptor.
+  rules[wd].push_back(r);
+
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool change_watcher::open(const string &listdir)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+  fd=inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+
+  if(fd==-1)
+    return false;
+
+  // partial/ is a subdirectory and inotify isn't recursive, so
+  // in-flight downloads never show up here.
+  add(listdir, "", CHANGE_LISTS);
+
+  string dir, name;
+
+  split_path(_config->FindFile("Dir::State::status"), dir, name);
+  add(dir, name, CHANGE_STATUS);
+
+  split_path(_config->FindFile("Dir::Etc::sourcelist"), dir, name);
+  add(dir, name, CHANGE_CONFIG);
+  split_path(_config->FindFile("Dir::Etc::preferences"), dir, name);
+  add(dir, name, CHANGE_CONFIG);
+
+  add(_config->FindDir("Dir::Etc::sourceparts"), "", CHANGE_CONFIG);
+  add(_config->FindDir("Dir::Etc::preferencesparts"), "", CHANGE_CONFIG);
+
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool change_watcher::watch_dir(const string &dir, int kind)
+{
+  if(fd==-1)
+    return false;
+
+  return add(dir, "", kind);
+}
+
+int change_watcher::classify(int wd, const char *name) const
+{
+  map<int, vector<rule> >::const_iterator found=rules.find(wd);
+
+  if(found==rules.end())
+    return 0;
+
+  int rval=0;
+
+  for(vector<rule>::const_iterator i=found->second.begin();
+      i!=found->second.end(); ++i)
+    {
+      if(i->name.empty())
+	{
+	  // Ignore lockfiles, and the partial directory itself.
+	  if(strcmp(name, "lock")==0 || strcmp(name, "partial")==0)
+	    continue;
+
+	  rval|=i->kind;
+	}
+      else if(i->name==name)
+	rval|=i->kind;
+    }
+
+  return rval;
+}
+
+int change_watcher::read_changes()
+{
+#ifdef HAVE_SYS_INOTIFY_H
+  int rval=0;
+  char buf[4096]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+  while(1)
+    {
+      ssize_t len=read(fd, buf, sizeof(buf));
+
+      if(len<0)
+	{
+	  if(errno==EINTR)
+	    continue;
+
+	  // EAGAIN: drained.
+	  return rval;
+	}
+
+      if(len==0)
+	return rval;
+
+      for(char *p=buf; p<buf+len; )
+	{
+	  struct inotify_event *ev=(struct inotify_event *) p;
+
+	  if(ev->mask&IN_Q_OVERFLOW)
+	    // We lost track; assume the worst.
+	    rval|=CHANGE_ALL|CHANGE_ARCHIVES;
+	  else if(ev->len>0)
+	    rval|=classify(ev->wd, ev->name);
+
+	  p+=sizeof(struct inotify_event)+ev->len;
+	}
+    }
+#else
+  return 0;
+#endif
+}
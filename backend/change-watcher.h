@@ -0,0 +1,79 @@
+// change-watcher.h -- notice changes to the system package state. -*-c++-*-
+//
+//  An inotify watcher that only listens for files being written,
+//  moved into place or deleted (so reading the lists, which touches
+//  their atime, is never mistaken for a change), and that reports
+//  which kind of input changed.
+
+#ifndef CHANGE_WATCHER_H
+#define CHANGE_WATCHER_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+/** The kinds of input a change can affect; used as a bitmask. */
+enum change_kind
+  {
+    /** The dpkg status file. */
+    CHANGE_STATUS=1,
+    /** A package or source index in the lists directory. */
+    CHANGE_LISTS=2,
+    /** sources.list, preferences, or their .d directories. */
+    CHANGE_CONFIG=4,
+
+    /** Every input of the package cache. */
+    CHANGE_ALL=CHANGE_STATUS|CHANGE_LISTS|CHANGE_CONFIG,
+
+    /** A downloaded package; not an input of the cache. */
+    CHANGE_ARCHIVES=8
+  };
+
+class change_watcher
+{
+  /** How to classify an event in a watched directory. */
+  struct rule
+  {
+    /** Only events on this entry match; an empty name matches
+     *  everything except the ignored names.
+     */
+    std::string name;
+    int kind;
+  };
+
+  int fd;
+
+  std::map<int, std::vector<rule> > rules;
+
+  /** Start watching dir, classifying matching events as kind. */
+  bool add(const std::string &dir, const std::string &name, int kind);
+
+  int classify(int wd, const char *name) const;
+public:
+  change_watcher();
+  ~change_watcher();
+
+  /** Watch the system lists directory (but not partial/), the dpkg
+   *  status file, and the sources and preferences files.  Returns
+   *  \b false if inotify is unavailable; individual paths that can't
+   *  be watched are skipped.
+   */
+  bool open(const std::string &listdir);
+
+  /** Also watch the files directly inside dir (except the lock file
+   *  and partial/), reporting changes as kind.  Call after open().
+   */
+  bool watch_dir(const std::string &dir, int kind);
+
+  /** The inotify fd to wait on, or -1 if open() failed. */
+  int get_fd() const {return fd;}
+
+  /** Read all pending events.
+   *
+   *  \return a mask of change_kind values; 0 if nothing relevant
+   *  happened.
+   */
+  int read_changes();
+};
+
+#endif // CHANGE_WATCHER_H
@@ -0,0 +1,197 @@
+// download-journal.cc
+//
+//  The file is plain text, one record per line, later records
+//  overriding earlier ones for the same file:
+//
+//    APT-Watch-Journal 1
+//    P <file> <size> <hash>      queued
+//    D <file> <size> <hash>      fetched
+//    F <file> 0 -                removed again
+//
+//  Records are only ever appended, so a slave killed in the middle
+//  of one leaves at worst a partial last line, which is ignored.
+
+#include "download-journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const char journal_magic[]="APT-Watch-Journal 1";
+
+bool download_journal::open(const string &_fn)
+{
+  close();
+
+  fn=_fn;
+  entries.clear();
+  records=0;
+
+  FILE *f=fopen(fn.c_str(), "r");
+  bool valid=false;
+  bool torn=false;
+
+  if(f)
+    {
+      char buf[1024];
+
+      valid=fgets(buf, sizeof(buf), f) &&
+	string(buf)==string(journal_magic)+"\n";
+
+      while(valid && fgets(buf, sizeof(buf), f))
+	{
+	  size_t len=strlen(buf);
+
+	  if(len==0 || buf[len-1]!='\n')
+	    {
+	      torn=true;
+	      break;
+	    }
+
+	  char state;
+	  char file[1024];
+	  long long size;
+	  char hash[1024];
+
+	  if(sscanf(buf, "%c %1023s %lld %1023s", &state, file, &size, hash)!=4)
+	    continue;
+
+	  ++records;
+
+	  if(state=='F')
+	    entries.erase(file);
+	  else if(state=='P' || state=='D')
+	    {
+	      entry &e=entries[file];
+
+	      e.size=size;
+	      e.hash=hash;
+	      e.done=(state=='D');
+	    }
+	}
+
+      fclose(f);
+    }
+
+  // Superseded records pile up; write out just the live ones now and
+  // then.  A partial last record has to go before anything is
+  // appended after it.
+  if(!valid || torn || records>2*entries.size()+64)
+    {
+      if(!rewrite())
+	return false;
+    }
+
+  fd=::open(fn.c_str(), O_WRONLY|O_APPEND|O_CREAT, 0644);
+
+  return fd!=-1;
+}
+
+bool download_journal::rewrite()
+{
+  string tmp=fn+".new";
+  FILE *f=fopen(tmp.c_str(), "w");
+
+  if(!f)
+    return false;
+
+  fprintf(f, "%s\n", journal_magic);
+
+  for(map<string, entry>::const_iterator i=entries.begin();
+      i!=entries.end(); ++i)
+    fprintf(f, "%c %s %lld %s\n", i->second.done?'D':'P', i->first.c_str(),
+	    (long long) i->second.size, i->second.hash.c_str());
+
+  bool ok=!ferror(f);
+
+  if(fclose(f)!=0 || !ok || rename(tmp.c_str(), fn.c_str())!=0)
+    {
+      int err=errno;
+      unlink(tmp.c_str());
+      errno=err;
+      return false;
+    }
+
+  records=entries.size();
+
+  return true;
+}
+
+void download_journal::close()
+{
+  if(fd!=-1)
+    {
+      ::close(fd);
+      fd=-1;
+    }
+}
+
+bool download_journal::append(char state, const string &file, const entry &e)
+{
+  if(fd==-1)
+    return false;
+
+  char buf[64];
+  snprintf(buf, sizeof(buf), " %lld ", (long long) e.size);
+
+  // One write per record, so records never interleave.
+  string line=string(1, state)+' '+file+buf+e.hash+'\n';
+
+  ++records;
+
+  return write(fd, line.data(), line.size())==(ssize_t) line.size();
+}
+
+bool download_journal::is_done(const string &file, off_t size,
+			       const string &hash) const
+{
+  map<string, entry>::const_iterator found=entries.find(file);
+
+  return found!=entries.end() && found->second.done &&
+    found->second.size==size &&
+    found->second.hash==(hash.empty()?"-":hash);
+}
+
+void download_journal::planned(const string &file, off_t size,
+			       const string &hash)
+{
+  entry &e=entries[file];
+
+  e.size=size;
+  e.hash=hash.empty()?"-":hash;
+  e.done=false;
+
+  append('P', file, e);
+}
+
+void download_journal::done(const string &file)
+{
+  map<string, entry>::iterator found=entries.find(file);
+
+  if(found==entries.end() || found->second.done)
+    return;
+
+  found->second.done=true;
+
+  append('D', file, found->second);
+}
+
+void download_journal::forget(const string &file)
+{
+  map<string, entry>::iterator found=entries.find(file);
+
+  if(found==entries.end())
+    return;
+
+  entry e;
+  e.size=0;
+  e.hash="-";
+
+  entries.erase(found);
+
+  append('F', file, e);
+}
@@ -0,0 +1,71 @@
+// download-journal.h -- what a download set out to fetch.  -*-c++-*-
+//
+//  The journal sits in the partial/ directory of the archives and
+//  outlives the slave: each package is recorded when it is queued and
+//  again when it arrives, so a download that was cancelled or killed
+//  picks up where it left off.  The files themselves are resumed by
+//  apt from partial/.  A finished file's record is only as good as the
+//  file: the caller drops it if the file has gone from the archives.
+
+#ifndef DOWNLOAD_JOURNAL_H
+#define DOWNLOAD_JOURNAL_H
+
+#include <sys/types.h>
+
+#include <map>
+#include <string>
+
+class download_journal
+{
+  struct entry
+  {
+    off_t size;
+    std::string hash;
+    bool done;
+  };
+
+  /** Entries by the file name of the package in the archives. */
+  std::map<std::string, entry> entries;
+
+  std::string fn;
+
+  /** Open for appending, or -1. */
+  int fd;
+
+  /** How many records the file holds; more than there are entries
+   *  means some are superseded.
+   */
+  unsigned long records;
+
+  bool append(char state, const std::string &file, const entry &e);
+  bool rewrite();
+public:
+  download_journal():fd(-1), records(0) {}
+  ~download_journal() {close();}
+
+  /** Load the journal from the given file (starting afresh if there
+   *  isn't one) and open it for recording.  Returns \b false and
+   *  sets errno if it can't be written.
+   */
+  bool open(const std::string &_fn);
+
+  void close();
+
+  /** \return \b true if the given file was fetched with this size
+   *  and hash.
+   */
+  bool is_done(const std::string &file, off_t size,
+	       const std::string &hash) const;
+
+  /** Note that the given file is about to be fetched. */
+  void planned(const std::string &file, off_t size,
+	       const std::string &hash);
+
+  /** Note that the given file arrived. */
+  void done(const std::string &file);
+
+  /** Note that the given file was removed from the archives. */
+  void forget(const std::string &file);
+};
+
+#endif // DOWNLOAD_JOURNAL_H
@@ -0,0 +1,137 @@
+// dpkg-status.cc
+
+#include "dpkg-status.h"
+
+#include <apt-pkg/fileutl.h>
+#include <apt-pkg/tagfile.h>
+
+#include <unistd.h>
+
+#include <algorithm>
+
+using namespace std;
+
+/** FNV-1a, continuing from h. */
+static unsigned long long hash_string(const string &s,
+				      unsigned long long h=14695981039346656037ULL)
+{
+  for(string::const_iterator i=s.begin(); i!=s.end(); ++i)
+    {
+      h^=(unsigned char) *i;
+      h*=1099511628211ULL;
+    }
+
+  return h;
+}
+
+/** Orders entries by name and, within a name, newest read last. */
+struct entry_before
+{
+  const dpkg_status &status;
+
+  entry_before(const dpkg_status &_status):status(_status) {}
+
+  bool operator()(unsigned int a, unsigned int b) const
+  {
+    return status[a].package<status[b].package ||
+      (status[a].package==status[b].package && a<b);
+  }
+};
+
+bool read_dpkg_status(const string &fn, dpkg_status &status)
+{
+  free_dpkg_status(status);
+
+  // Don't leave an error behind for a missing file; the caller just
+  // falls back to looking at everything.
+  if(access(fn.c_str(), R_OK)!=0)
+    return false;
+
+  FileFd f(fn, FileFd::ReadOnly);
+  if(!f.IsOpen())
+    return false;
+
+  pkgTagFile tags(&f);
+  pkgTagSection section;
+
+  while(tags.Step(section))
+    {
+      string name=section.FindS("Package");
+
+      if(name.empty())
+	continue;
+
+      dpkg_status_entry entry;
+
+      entry.package=name+":"+section.FindS("Architecture");
+      entry.hash=hash_string(section.FindS("Status"),
+			     hash_string(section.FindS("Version")+" "));
+
+      status.push_back(entry);
+    }
+
+  // dpkg keeps the file sorted, so this is normally a formality.
+  bool sorted_already=true;
+
+  for(dpkg_status::size_type i=1; i<status.size() && sorted_already; ++i)
+    sorted_already=(status[i-1]<status[i]);
+
+  if(!sorted_already)
+    {
+      vector<unsigned int> order(status.size());
+
+      for(unsigned int i=0; i<order.size(); ++i)
+	order[i]=i;
+
+      sort(order.begin(), order.end(), entry_before(status));
+
+      dpkg_status sorted;
+      sorted.reserve(status.size());
+
+      // A package listed twice counts as its last entry.
+      for(unsigned int i=0; i<order.size(); ++i)
+	if(i+1==order.size() ||
+	   status[order[i]].package!=status[order[i+1]].package)
+	  sorted.push_back(status[order[i]]);
+
+      status.swap(sorted);
+    }
+
+  return true;
+}
+
+void diff_dpkg_status(const dpkg_status &old_status,
+		      const dpkg_status &new_status,
+		      vector<string> &changed)
+{
+  // Both are sorted, so walk them side by side.
+  dpkg_status::const_iterator o=old_status.begin(), n=new_status.begin();
+
+  while(o!=old_status.end() || n!=new_status.end())
+    {
+      if(n==new_status.end() ||
+	 (o!=old_status.end() && o->package<n->package))
+	{
+	  changed.push_back(o->package);
+	  ++o;
+	}
+      else if(o==old_status.end() || n->package<o->package)
+	{
+	  changed.push_back(n->package);
+	  ++n;
+	}
+      else
+	{
+	  if(o->hash!=n->hash)
+	    changed.push_back(o->package);
+
+	  ++o;
+	  ++n;
+	}
+    }
+}
+
+void free_dpkg_status(dpkg_status &status)
+{
+  dpkg_status().swap(status);
+}
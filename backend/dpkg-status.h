@@ -0,0 +1,47 @@
+// dpkg-status.h -- what the dpkg status file says, for diffing. -*-c++-*-
+//
+//  Used to find out which packages a change to the status file
+//  touched, so that only those need to be looked at again.  Only a
+//  hash of each package's entry is kept, not the entry itself.
+
+#ifndef DPKG_STATUS_H
+#define DPKG_STATUS_H
+
+#include <string>
+#include <vector>
+
+/** One package in the status file. */
+struct dpkg_status_entry
+{
+  /** "name:arch" */
+  std::string package;
+
+  /** A hash of the package's version and status line. */
+  unsigned long long hash;
+
+  bool operator<(const dpkg_status_entry &other) const
+  {
+    return package<other.package;
+  }
+};
+
+/** The packages of a status file, sorted by name. */
+typedef std::vector<dpkg_status_entry> dpkg_status;
+
+/** Read the given status file.  Returns \b false if it can't be
+ *  read.
+ */
+bool read_dpkg_status(const std::string &fn, dpkg_status &status);
+
+/** Find the packages whose entries differ between two reads of the
+ *  status file, including packages that appear in only one of them.
+ *  Keys are appended to changed in sorted order.
+ */
+void diff_dpkg_status(const dpkg_status &old_status,
+		      const dpkg_status &new_status,
+		      std::vector<std::string> &changed);
+
+/** Throw away a status read, giving back its memory. */
+void free_dpkg_status(dpkg_status &status);
+
+#endif // DPKG_STATUS_H
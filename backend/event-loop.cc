@@ -0,0 +1,160 @@
+// event-loop.cc
+
+#include "event-loop.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+using namespace std;
+
+event_loop::event_loop():running(false), rval(0)
+{
+  epfd=epoll_create1(EPOLL_CLOEXEC);
+}
+
+event_loop::~event_loop()
+{
+  if(epfd!=-1)
+    close(epfd);
+}
+
+bool event_loop::add_fd(int fd, event_callback callback, void *data)
+{
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events=EPOLLIN;
+  ev.data.fd=fd;
+
+  if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)!=0)
+    return false;
+
+  watch w;
+  w.callback=callback;
+  w.data=data;
+
+  watches[fd]=w;
+
+  return true;
+}
+
+void event_loop::remove_fd(int fd)
+{
+  // The fd may already be closed, in which case the kernel dropped
+  // it for us.
+  epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+
+  watches.erase(fd);
+}
+
+int event_loop::run()
+{
+  const int max_events=16;
+  struct epoll_event events[max_events];
+
+  running=true;
+
+  while(running)
+    {
+      int n=epoll_wait(epfd, events, max_events, -1);
+
+      if(n<0)
+	{
+	  if(errno==EINTR)
+	    continue;
+
+	  return -1;
+	}
+
+      for(int i=0; i<n && running; ++i)
+	{
+	  // Look the fd up again each time: an earlier callback in
+	  // this batch may have removed it.
+	  map<int, watch>::iterator found=watches.find(events[i].data.fd);
+
+	  if(found!=watches.end())
+	    found->second.callback(found->first, found->second.data);
+	}
+    }
+
+  return rval;
+}
+
+void event_loop::quit(int _rval)
+{
+  rval=_rval;
+  running=false;
+}
+
+event_timer::event_timer():is_armed(false)
+{
+  fd=timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC|TFD_NONBLOCK);
+}
+
+event_timer::~event_timer()
+{
+  if(fd!=-1)
+    close(fd);
+}
+
+void event_timer::arm(unsigned int seconds)
+{
+  struct itimerspec spec;
+
+  memset(&spec, 0, sizeof(spec));
+  spec.it_value.tv_sec=seconds;
+  // A zero it_value would disarm the timer instead.
+  if(seconds==0)
+    spec.it_value.tv_nsec=1;
+
+  timerfd_settime(fd, 0, &spec, NULL);
+  is_armed=true;
+}
+
+void event_timer::disarm()
+{
+  struct itimerspec spec;
+
+  memset(&spec, 0, sizeof(spec));
+
+  timerfd_settime(fd, 0, &spec, NULL);
+  is_armed=false;
+
+  // Throw away an expiration that fired but wasn't handled yet.
+  acknowledge();
+}
+
+void event_timer::acknowledge()
+{
+  uint64_t expirations;
+
+  if(read(fd, &expirations, sizeof(expirations))==sizeof(expirations))
+    is_armed=false;
+}
+
+int open_signal_fd(int signum)
+{
+  sigset_t mask;
+
+  sigemptyset(&mask);
+  sigaddset(&mask, signum);
+
+  if(sigprocmask(SIG_BLOCK, &mask, NULL)!=0)
+    return -1;
+
+  return signalfd(-1, &mask, SFD_CLOEXEC|SFD_NONBLOCK);
+}
+
+void drain_signal_fd(int fd)
+{
+  struct signalfd_siginfo info;
+
+  while(read(fd, &info, sizeof(info))==sizeof(info))
+    ;
+}
@@ -0,0 +1,79 @@
+// event-loop.h -- the slave's main loop.                    -*-c++-*-
+//
+//  A small epoll-based dispatcher.  Everything the slave waits for --
+//  commands from the applet, the auth helper, the change watcher,
+//  timers and signals -- is a file descriptor registered here.
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <map>
+
+/** Called when the given fd becomes readable (or hangs up). */
+typedef void (*event_callback)(int fd, void *data);
+
+class event_loop
+{
+  struct watch
+  {
+    event_callback callback;
+    void *data;
+  };
+
+  int epfd;
+
+  std::map<int, watch> watches;
+
+  bool running;
+  int rval;
+public:
+  event_loop();
+  ~event_loop();
+
+  /** Start calling callback whenever fd is readable.  Returns \b false
+   *  and sets errno on failure.
+   */
+  bool add_fd(int fd, event_callback callback, void *data);
+
+  /** Stop watching fd.  Safe to call from inside a callback. */
+  void remove_fd(int fd);
+
+  /** Dispatch events until quit() is called; returns its argument,
+   *  or -1 if waiting for events failed.
+   */
+  int run();
+
+  void quit(int _rval);
+};
+
+/** A one-shot timer on the monotonic clock, backed by a timerfd. */
+class event_timer
+{
+  int fd;
+  bool is_armed;
+public:
+  event_timer();
+  ~event_timer();
+
+  int get_fd() const {return fd;}
+
+  /** (Re)start the timer; any earlier deadline is forgotten. */
+  void arm(unsigned int seconds);
+
+  void disarm();
+
+  bool armed() const {return is_armed;}
+
+  /** Call from the callback to consume the expiration. */
+  void acknowledge();
+};
+
+/** Block the given signal and return a signalfd that becomes
+ *  readable when it arrives, or -1 on failure.
+ */
+int open_signal_fd(int signum);
+
+/** Consume all pending notifications on a signalfd. */
+void drain_signal_fd(int fd);
+
+#endif // EVENT_LOOP_H
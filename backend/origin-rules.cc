@@ -0,0 +1,167 @@
+// origin-rules.cc
+
+#include "origin-rules.h"
+
+#include "apt-watch-common.h"
+
+#include <apt-pkg/configuration.h>
+#include <apt-pkg/error.h>
+
+#include <fnmatch.h>
+#include <string.h>
+
+using namespace std;
+
+bool origin_rules::matches(const pattern &p, const release_fields &fields)
+{
+  const char *value=NULL;
+
+  switch(p.which)
+    {
+    case FIELD_ORIGIN:    value=fields.origin; break;
+    case FIELD_LABEL:     value=fields.label; break;
+    case FIELD_SUITE:     value=fields.suite; break;
+    case FIELD_CODENAME:  value=fields.codename; break;
+    case FIELD_SITE:      value=fields.site; break;
+    case FIELD_COMPONENT: value=fields.component; break;
+    }
+
+  if(value==NULL)
+    value="";
+
+  return fnmatch(p.glob.c_str(), value, 0)==0;
+}
+
+static bool parse_class(const string &name, unsigned char &upgrade_class)
+{
+  if(strcasecmp(name.c_str(), "none")==0)
+    upgrade_class=UPGRADE_CLASS_NONE;
+  else if(strcasecmp(name.c_str(), "normal")==0)
+    upgrade_class=UPGRADE_CLASS_NORMAL;
+  else if(strcasecmp(name.c_str(), "security")==0)
+    upgrade_class=UPGRADE_CLASS_SECURITY;
+  else if(strcasecmp(name.c_str(), "critical")==0)
+    upgrade_class=UPGRADE_CLASS_CRITICAL;
+  else
+    return false;
+
+  return true;
+}
+
+bool origin_rules::load(const Configuration &conf, const char *section)
+{
+  static const struct
+  {
+    const char *tag;
+    field which;
+  } fields[]=
+      {
+	{"Origin", FIELD_ORIGIN},
+	{"Label", FIELD_LABEL},
+	{"Suite", FIELD_SUITE},
+	{"Codename", FIELD_CODENAME},
+	{"Site", FIELD_SITE},
+	{"Component", FIELD_COMPONENT}
+      };
+
+  rules.clear();
+
+  const Configuration::Item *top=conf.Tree(section);
+
+  if(top!=NULL)
+    for(const Configuration::Item *item=top->Child; item!=NULL; item=item->Next)
+      {
+	rule r;
+	bool have_class=false;
+
+	for(const Configuration::Item *f=item->Child; f!=NULL; f=f->Next)
+	  {
+	    if(strcasecmp(f->Tag.c_str(), "Class")==0)
+	      {
+		if(!parse_class(f->Value, r.upgrade_class))
+		  return _error->Error("Unknown upgrade class \"%s\" in %s",
+				       f->Value.c_str(),
+				       item->FullTag().c_str());
+
+		have_class=true;
+		continue;
+	      }
+
+	    unsigned int i;
+	    for(i=0; i<sizeof(fields)/sizeof(fields[0]); ++i)
+	      if(strcasecmp(f->Tag.c_str(), fields[i].tag)==0)
+		break;
+
+	    if(i==sizeof(fields)/sizeof(fields[0]))
+	      return _error->Error("Unknown field \"%s\" in %s",
+				   f->Tag.c_str(), item->FullTag().c_str());
+
+	    pattern p;
+	    p.which=fields[i].which;
+	    p.glob=f->Value;
+
+	    r.patterns.push_back(p);
+	  }
+
+	if(!have_class)
+	  return _error->Error("No Class given in %s",
+			       item->FullTag().c_str());
+
+	rules.push_back(r);
+      }
+
+  if(rules.empty())
+    {
+      // The historical behavior.
+      rule r;
+      pattern p;
+
+      p.which=FIELD_SITE;
+      p.glob="security.debian.org";
+
+      r.patterns.push_back(p);
+      r.upgrade_class=UPGRADE_CLASS_SECURITY;
+
+      rules.push_back(r);
+    }
+
+  return true;
+}
+
+unsigned char origin_rules::classify(pkgCache::PkgFileIterator file) const
+{
+  release_fields fields;
+
+  fields.origin=file.Origin();
+  fields.label=file.Label();
+  fields.suite=file.Archive();
+  fields.codename=file.Codename();
+  fields.site=file.Site();
+  fields.component=file.Component();
+
+  return classify(fields);
+}
+
+unsigned char origin_rules::classify(const release_fields &fields) const
+{
+  bool matched=false;
+  unsigned char rval=UPGRADE_CLASS_NONE;
+
+  for(vector<rule>::const_iterator r=rules.begin(); r!=rules.end(); ++r)
+    {
+      vector<pattern>::const_iterator p;
+
+      for(p=r->patterns.begin(); p!=r->patterns.end(); ++p)
+	if(!matches(*p, fields))
+	  break;
+
+      if(p==r->patterns.end() &&
+	 (!matched || r->upgrade_class>rval))
+	{
+	  matched=true;
+	  rval=r->upgrade_class;
+	}
+    }
+
+  return matched?rval:UPGRADE_CLASS_NORMAL;
+}
@@ -0,0 +1,71 @@
+// origin-rules.h -- classify package files by where they come from. -*-c++-*-
+//
+//  Rules are read from the APT-Watch::Rules section of the apt
+//  configuration (normally from /etc/apt-watch.conf).  Each rule
+//  lists glob patterns for Release fields and the upgrade class it
+//  assigns; see README.
+
+#ifndef ORIGIN_RULES_H
+#define ORIGIN_RULES_H
+
+#include <apt-pkg/pkgcache.h>
+
+#include <string>
+#include <vector>
+
+class Configuration;
+
+class origin_rules
+{
+public:
+  /** The Release fields of a package file that rules can test; NULL
+   *  counts as empty.
+   */
+  struct release_fields
+  {
+    const char *origin, *label, *suite, *codename, *site, *component;
+  };
+private:
+  enum field
+    {
+      FIELD_ORIGIN,
+      FIELD_LABEL,
+      FIELD_SUITE,
+      FIELD_CODENAME,
+      FIELD_SITE,
+      FIELD_COMPONENT
+    };
+
+  struct pattern
+  {
+    field which;
+    std::string glob;
+  };
+
+  struct rule
+  {
+    std::vector<pattern> patterns;
+    unsigned char upgrade_class;
+  };
+
+  std::vector<rule> rules;
+
+  static bool matches(const pattern &p, const release_fields &fields);
+public:
+  /** Compile the rules under the given configuration section.  If
+   *  there are none, files from security.debian.org are security
+   *  upgrades.  Returns \b false (with the reason on _error) if a
+   *  rule is malformed.
+   */
+  bool load(const Configuration &conf, const char *section);
+
+  /** The highest class assigned by a matching rule, or
+   *  UPGRADE_CLASS_NORMAL if no rule matches.
+   */
+  unsigned char classify(pkgCache::PkgFileIterator file) const;
+
+  /** As above, for the given fields. */
+  unsigned char classify(const release_fields &fields) const;
+};
+
+#endif // ORIGIN_RULES_H
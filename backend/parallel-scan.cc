@@ -0,0 +1,93 @@
+// parallel-scan.cc
+
+#include "parallel-scan.h"
+
+#include <apt-pkg/configuration.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <vector>
+
+using namespace std;
+
+/** Fewer items than this per thread isn't worth the overhead. */
+static const size_t min_items_per_thread=4096;
+
+namespace
+{
+  struct slice
+  {
+    size_t begin, end;
+    unsigned int worker;
+
+    scan_callback fn;
+    void *data;
+  };
+}
+
+static void *run_slice(void *arg)
+{
+  slice *s=(slice *) arg;
+
+  s->fn(s->begin, s->end, s->worker, s->data);
+
+  return NULL;
+}
+
+unsigned int scan_threads(size_t n)
+{
+  int configured=_config->FindI("APT-Watch::Scan-Threads", 0);
+  long threads=configured;
+
+  if(threads<=0)
+    threads=sysconf(_SC_NPROCESSORS_ONLN);
+
+  if(threads<1)
+    threads=1;
+
+  size_t useful=n/min_items_per_thread;
+
+  if(useful<1)
+    useful=1;
+
+  if((size_t) threads>useful)
+    threads=useful;
+
+  return threads;
+}
+
+void parallel_scan(size_t n, unsigned int threads,
+		   scan_callback fn, void *data)
+{
+  if(threads<=1 || n==0)
+    {
+      fn(0, n, 0, data);
+      return;
+    }
+
+  vector<slice> slices(threads);
+  vector<pthread_t> ids(threads);
+  vector<bool> started(threads, false);
+
+  for(unsigned int i=0; i<threads; ++i)
+    {
+      slices[i].begin=n*i/threads;
+      slices[i].end=n*(i+1)/threads;
+      slices[i].worker=i;
+      slices[i].fn=fn;
+      slices[i].data=data;
+    }
+
+  // Slice 0 runs here.
+  for(unsigned int i=1; i<threads; ++i)
+    started[i]=(pthread_create(&ids[i], NULL, run_slice, &slices[i])==0);
+
+  run_slice(&slices[0]);
+
+  for(unsigned int i=1; i<threads; ++i)
+    if(started[i])
+      pthread_join(ids[i], NULL);
+    else
+      run_slice(&slices[i]);
+}
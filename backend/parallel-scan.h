@@ -0,0 +1,31 @@
+// parallel-scan.h -- split read-only work over the package cache
+//                    across threads.                          -*-c++-*-
+
+#ifndef PARALLEL_SCAN_H
+#define PARALLEL_SCAN_H
+
+#include <stddef.h>
+
+/** Processes items [begin, end); worker is a number in [0, threads)
+ *  that the callback can use to pick its own output buffer.
+ */
+typedef void (*scan_callback)(size_t begin, size_t end,
+			      unsigned int worker, void *data);
+
+/** How many threads a scan of n items should use, given the
+ *  APT-Watch::Scan-Threads setting (0 means one per CPU).  Small
+ *  scans aren't worth starting threads for.
+ */
+unsigned int scan_threads(size_t n);
+
+/** Call fn on contiguous slices of [0, n), using the given number of
+ *  threads (the calling thread is one of them).  Returns once every
+ *  slice is done.  If threads can't be started, the remaining slices
+ *  run in the calling thread.
+ *
+ *  The callback must only read shared state.
+ */
+void parallel_scan(size_t n, unsigned int threads,
+		   scan_callback fn, void *data);
+
+#endif // PARALLEL_SCAN_H
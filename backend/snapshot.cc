@@ -0,0 +1,96 @@
+// snapshot.cc
+//
+//  The file is plain text:
+//
+//    APT-Watch-Snapshot 1
+//    <status> <time> <fingerprint in hex>
+//    <package>
+//    ...
+
+#include "snapshot.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const char snapshot_magic[]="APT-Watch-Snapshot 1";
+
+bool read_snapshot(const string &fn, upgrade_snapshot &snap)
+{
+  FILE *f=fopen(fn.c_str(), "r");
+
+  if(!f)
+    return false;
+
+  char buf[1024];
+  unsigned int status;
+  long long when;
+  unsigned long long fingerprint;
+
+  if(!fgets(buf, sizeof(buf), f) ||
+     string(buf)!=string(snapshot_magic)+"\n" ||
+     fscanf(f, "%u %lld %llx\n", &status, &when, &fingerprint)!=3 ||
+     status>3)
+    {
+      fclose(f);
+      return false;
+    }
+
+  snap.status=status;
+  snap.when=when;
+  snap.fingerprint=fingerprint;
+  snap.packages.clear();
+
+  while(fgets(buf, sizeof(buf), f))
+    {
+      string name(buf);
+
+      if(!name.empty() && name[name.size()-1]=='\n')
+	name.erase(name.size()-1);
+
+      if(!name.empty())
+	snap.packages.push_back(name);
+    }
+
+  fclose(f);
+
+  return true;
+}
+
+bool write_snapshot(const string &fn, const upgrade_snapshot &snap)
+{
+  string tmp=fn+".new";
+  FILE *f=fopen(tmp.c_str(), "w");
+
+  if(!f)
+    return false;
+
+  fprintf(f, "%s\n%u %lld %llx\n", snapshot_magic, snap.status,
+	  (long long) snap.when, (unsigned long long) snap.fingerprint);
+
+  for(vector<string>::const_iterator i=snap.packages.begin();
+      i!=snap.packages.end(); ++i)
+    fprintf(f, "%s\n", i->c_str());
+
+  bool ok=!ferror(f);
+
+  if(fclose(f)!=0 || !ok)
+    {
+      int err=errno;
+      unlink(tmp.c_str());
+      errno=err;
+      return false;
+    }
+
+  if(rename(tmp.c_str(), fn.c_str())!=0)
+    {
+      int err=errno;
+      unlink(tmp.c_str());
+      errno=err;
+      return false;
+    }
+
+  return true;
+}
@@ -0,0 +1,43 @@
+// snapshot.h -- the last known upgrade state, saved between runs. -*-c++-*-
+//
+//  Opening the package cache takes a while; the snapshot lets the
+//  slave tell the applet what the state was last time before the
+//  cache is open.
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+struct upgrade_snapshot
+{
+  /** The most urgent upgrade class, as returned by upgrade_status(). */
+  unsigned int status;
+
+  /** When the status was computed. */
+  time_t when;
+
+  /** The digest of the cache inputs the status was computed from. */
+  uint64_t fingerprint;
+
+  /** The names of the upgradable packages. */
+  std::vector<std::string> packages;
+
+  upgrade_snapshot():status(0), when(0), fingerprint(0) {}
+};
+
+/** Load a snapshot; returns \b false if the file is missing or was
+ *  not written by this version.
+ */
+bool read_snapshot(const std::string &fn, upgrade_snapshot &snap);
+
+/** Atomically replace the snapshot file.  Returns \b false and sets
+ *  errno on failure.
+ */
+bool write_snapshot(const std::string &fn, const upgrade_snapshot &snap);
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,150 @@
+// test_cache_fingerprint.cc
+//
+//  A fingerprint has to change whenever a file it covers does, and
+//  only then.
+
+#include "cache-fingerprint.h"
+#include "test-check.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <string>
+
+using namespace std;
+
+static void write_file(const string &fn, const string &contents)
+{
+  ofstream out(fn.c_str());
+  out << contents;
+}
+
+/** Give fn the given modification time. */
+static void set_mtime(const string &fn, time_t sec, long nsec)
+{
+  struct timespec times[2];
+
+  times[0].tv_sec=sec;
+  times[0].tv_nsec=nsec;
+  times[1]=times[0];
+
+  CHECK(utimensat(AT_FDCWD, fn.c_str(), times, 0)==0);
+}
+
+static void fingerprint(cache_fingerprint &fp, const string &dir)
+{
+  fp.clear();
+  fp.add_dir(dir+"/lists");
+  fp.add_file(dir+"/status");
+}
+
+/** Any change to a recorded file shows, down to the nanosecond. */
+static void test_changes(const string &dir)
+{
+  write_file(dir+"/status", "Package: a\n");
+  set_mtime(dir+"/status", 1000000000, 0);
+
+  cache_fingerprint a, b;
+
+  fingerprint(a, dir);
+  fingerprint(b, dir);
+
+  CHECK(!a.empty());
+  CHECK(a==b);
+  CHECK(a.digest()==b.digest());
+
+  // Same size, a hair newer.
+  write_file(dir+"/status", "Package: b\n");
+  set_mtime(dir+"/status", 1000000000, 1);
+
+  fingerprint(b, dir);
+  CHECK(a!=b);
+  CHECK(a.digest()!=b.digest());
+  CHECK(a.same_except(b, dir+"/status"));
+  CHECK(!a.same_except(b, dir+"/lists/one_Packages"));
+
+  // A new list isn't just a status change.
+  write_file(dir+"/lists/two_Packages", "x");
+  fingerprint(b, dir);
+  CHECK(a!=b);
+  CHECK(!a.same_except(b, dir+"/status"));
+
+  unlink((dir+"/lists/two_Packages").c_str());
+}
+
+/** The lock file and subdirectories don't count, and the order the
+ *  files were made in doesn't matter.
+ */
+static void test_dir(const string &dir)
+{
+  cache_fingerprint a, b;
+
+  fingerprint(a, dir);
+
+  write_file(dir+"/lists/lock", "");
+  write_file(dir+"/lists/partial/half_Packages", "half");
+
+  fingerprint(b, dir);
+  CHECK(a==b);
+
+  // The same files listed one by one, in name order.
+  b.clear();
+  b.add_file(dir+"/lists/one_Packages");
+  b.add_file(dir+"/lists/three_Packages");
+  b.add_file(dir+"/status");
+
+  CHECK(a==b);
+}
+
+/** A missing file is recorded as missing, so creating it shows. */
+static void test_missing(const string &dir)
+{
+  cache_fingerprint a, b;
+
+  a.add_file(dir+"/preferences");
+  a.add_dir(dir+"/preferences.d");
+
+  write_file(dir+"/preferences", "");
+  mkdir((dir+"/preferences.d").c_str(), 0755);
+
+  b.add_file(dir+"/preferences");
+  b.add_dir(dir+"/preferences.d");
+
+  CHECK(a!=b);
+
+  a.clear();
+  b.clear();
+
+  CHECK(a.empty());
+  CHECK(a==b);
+  CHECK(a.digest()==b.digest());
+}
+
+int main()
+{
+  char dir[]="/tmp/test_cache_fingerprint.XXXXXX";
+
+  if(mkdtemp(dir)==NULL)
+    {
+      perror("mkdtemp");
+      return 1;
+    }
+
+  string base=dir;
+
+  mkdir((base+"/lists").c_str(), 0755);
+  mkdir((base+"/lists/partial").c_str(), 0755);
+  write_file(base+"/lists/three_Packages", "3");
+  write_file(base+"/lists/one_Packages", "1");
+
+  test_changes(base);
+  test_dir(base);
+  test_missing(base);
+
+  system(("rm -rf "+base).c_str());
+
+  return check_status();
+}
@@ -0,0 +1,190 @@
+// test_download_journal.cc
+//
+//  The journal has to survive a torn last line and keep itself small.
+
+#include "download-journal.h"
+#include "test-check.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/** \return the lines of the given file; a last line without a
+ *  newline is included as it is.
+ */
+static vector<string> read_lines(const string &fn)
+{
+  ifstream in(fn.c_str());
+  vector<string> rval;
+  string line;
+
+  while(getline(in, line))
+    rval.push_back(line);
+
+  return rval;
+}
+
+static void append_raw(const string &fn, const string &bytes)
+{
+  int fd=open(fn.c_str(), O_WRONLY|O_APPEND);
+
+  CHECK(fd!=-1);
+  CHECK(write(fd, bytes.data(), bytes.size())==(ssize_t) bytes.size());
+  close(fd);
+}
+
+/** Records survive a reopen, and only a done record with the same
+ *  size and hash counts.
+ */
+static void test_records(const string &fn)
+{
+  {
+    download_journal j;
+
+    CHECK(j.open(fn));
+
+    j.planned("a.deb", 100, "SHA256:aaa");
+    j.planned("b.deb", 200, "");
+    j.planned("c.deb", 300, "SHA256:ccc");
+    j.done("a.deb");
+    j.done("b.deb");
+    j.done("c.deb");
+    j.forget("c.deb");
+
+    // Done before it was planned: nothing to record.
+    j.done("d.deb");
+  }
+
+  download_journal j;
+
+  CHECK(j.open(fn));
+  CHECK(j.is_done("a.deb", 100, "SHA256:aaa"));
+  CHECK(!j.is_done("a.deb", 101, "SHA256:aaa"));
+  CHECK(!j.is_done("a.deb", 100, "SHA256:bbb"));
+  CHECK(j.is_done("b.deb", 200, ""));
+  CHECK(!j.is_done("c.deb", 300, "SHA256:ccc"));
+  CHECK(!j.is_done("d.deb", 0, ""));
+
+  // Planned again: no longer done.
+  j.planned("a.deb", 100, "SHA256:aaa");
+  CHECK(!j.is_done("a.deb", 100, "SHA256:aaa"));
+}
+
+/** A record cut off halfway is ignored, and isn't glued onto the
+ *  next one.
+ */
+static void test_torn_line(const string &fn)
+{
+  {
+    download_journal j;
+
+    CHECK(j.open(fn));
+    j.planned("e.deb", 500, "SHA256:eee");
+  }
+
+  append_raw(fn, "D e.deb 5");
+
+  {
+    download_journal j;
+
+    CHECK(j.open(fn));
+    CHECK(!j.is_done("e.deb", 500, "SHA256:eee"));
+
+    j.planned("f.deb", 600, "SHA256:fff");
+    j.done("f.deb");
+  }
+
+  vector<string> lines=read_lines(fn);
+
+  CHECK(!lines.empty() && lines[0]=="APT-Watch-Journal 1");
+
+  for(vector<string>::const_iterator i=lines.begin(); i!=lines.end(); ++i)
+    CHECK(i->find("D e.deb 5 ")!=0 && i->find("D e.deb 5P")!=0);
+
+  download_journal j;
+
+  CHECK(j.open(fn));
+  CHECK(j.is_done("f.deb", 600, "SHA256:fff"));
+  CHECK(!j.is_done("e.deb", 500, "SHA256:eee"));
+}
+
+/** Superseded records are dropped once they pile up. */
+static void test_compaction(const string &fn)
+{
+  {
+    download_journal j;
+
+    CHECK(j.open(fn));
+
+    j.planned("keep.deb", 1, "SHA256:111");
+    j.done("keep.deb");
+
+    for(int i=0; i<100; ++i)
+      {
+	j.planned("churn.deb", 2, "SHA256:222");
+	j.forget("churn.deb");
+      }
+  }
+
+  CHECK(read_lines(fn).size()>200);
+
+  {
+    download_journal j;
+
+    CHECK(j.open(fn));
+    CHECK(j.is_done("keep.deb", 1, "SHA256:111"));
+    CHECK(!j.is_done("churn.deb", 2, "SHA256:222"));
+  }
+
+  // The magic line plus one record per live file.
+  vector<string> lines=read_lines(fn);
+
+  CHECK(lines.size()==2);
+  CHECK(lines.size()==2 && lines[1]=="D keep.deb 1 SHA256:111");
+}
+
+/** Anything that isn't a journal is replaced by an empty one. */
+static void test_bad_magic(const string &fn)
+{
+  {
+    ofstream out(fn.c_str());
+    out << "something else\nD x.deb 1 -\n";
+  }
+
+  download_journal j;
+
+  CHECK(j.open(fn));
+  CHECK(!j.is_done("x.deb", 1, ""));
+
+  vector<string> lines=read_lines(fn);
+
+  CHECK(lines.size()==1 && lines[0]=="APT-Watch-Journal 1");
+}
+
+int main()
+{
+  char dir[]="/tmp/test_download_journal.XXXXXX";
+
+  if(mkdtemp(dir)==NULL)
+    {
+      perror("mkdtemp");
+      return 1;
+    }
+
+  string base=dir;
+
+  test_records(base+"/records");
+  test_torn_line(base+"/torn");
+  test_compaction(base+"/compact");
+  test_bad_magic(base+"/magic");
+
+  system(("rm -rf "+base).c_str());
+
+  return check_status();
+}
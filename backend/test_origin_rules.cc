@@ -0,0 +1,147 @@
+// test_origin_rules.cc
+//
+//  Rules are compiled from a configuration tree and matched against
+//  Release fields; the highest matching class wins.
+
+#include "origin-rules.h"
+#include "apt-watch-common.h"
+#include "test-check.h"
+
+#include <apt-pkg/configuration.h>
+#include <apt-pkg/error.h>
+
+static origin_rules::release_fields fields(const char *origin,
+					   const char *suite,
+					   const char *site)
+{
+  origin_rules::release_fields rval;
+
+  rval.origin=origin;
+  rval.label=origin;
+  rval.suite=suite;
+  rval.codename=NULL;
+  rval.site=site;
+  rval.component="main";
+
+  return rval;
+}
+
+/** Without rules, only security.debian.org is special. */
+static void test_default()
+{
+  Configuration conf;
+  origin_rules rules;
+
+  CHECK(rules.load(conf, "Rules"));
+
+  CHECK(rules.classify(fields("Debian", "stable", "security.debian.org"))==UPGRADE_CLASS_SECURITY);
+  CHECK(rules.classify(fields("Debian", "stable", "deb.debian.org"))==UPGRADE_CLASS_NORMAL);
+  CHECK(rules.classify(fields(NULL, NULL, NULL))==UPGRADE_CLASS_NORMAL);
+
+  // Once there are rules, the default one is gone.
+  conf.Set("Rules::testing::Suite", "testing");
+  conf.Set("Rules::testing::Class", "critical");
+
+  CHECK(rules.load(conf, "Rules"));
+
+  CHECK(rules.classify(fields("Debian", "testing", "deb.debian.org"))==UPGRADE_CLASS_CRITICAL);
+  CHECK(rules.classify(fields("Debian", "stable", "security.debian.org"))==UPGRADE_CLASS_NORMAL);
+}
+
+/** The highest matching class wins, whatever order the rules are in;
+ *  a file that only "none" rules match is ignored.
+ */
+static void test_precedence()
+{
+  Configuration conf;
+  origin_rules rules;
+
+  conf.Set("Rules::backports::Suite", "*-backports");
+  conf.Set("Rules::backports::Class", "none");
+  conf.Set("Rules::security::Suite", "*-security");
+  conf.Set("Rules::security::Class", "security");
+  conf.Set("Rules::anything::Origin", "*");
+  conf.Set("Rules::anything::Class", "none");
+  conf.Set("Rules::kernel::Origin", "Debian");
+  conf.Set("Rules::kernel::Site", "kernel.*");
+  conf.Set("Rules::kernel::Class", "critical");
+
+  CHECK(rules.load(conf, "Rules"));
+
+  CHECK(rules.classify(fields("Debian", "stable-security", "deb.debian.org"))==UPGRADE_CLASS_SECURITY);
+  CHECK(rules.classify(fields("Debian", "stable-backports", "deb.debian.org"))==UPGRADE_CLASS_NONE);
+  CHECK(rules.classify(fields("Debian", "stable", "deb.debian.org"))==UPGRADE_CLASS_NONE);
+
+  // Every pattern of a rule has to match.
+  CHECK(rules.classify(fields("Debian", "stable", "kernel.example.org"))==UPGRADE_CLASS_CRITICAL);
+  CHECK(rules.classify(fields("Other", "stable", "kernel.example.org"))==UPGRADE_CLASS_NONE);
+  CHECK(rules.classify(fields("Debian", "stable-security", "kernel.example.org"))==UPGRADE_CLASS_CRITICAL);
+
+  // A missing field is empty, which "*" matches.
+  CHECK(rules.classify(fields(NULL, "stable", "deb.debian.org"))==UPGRADE_CLASS_NONE);
+}
+
+/** Globs are fnmatch() patterns, matched against the whole field. */
+static void test_globs()
+{
+  Configuration conf;
+  origin_rules rules;
+
+  conf.Set("Rules::a::Site", "security.[du]*.org");
+  conf.Set("Rules::a::Class", "Security");
+
+  CHECK(rules.load(conf, "Rules"));
+
+  CHECK(rules.classify(fields("Debian", "stable", "security.debian.org"))==UPGRADE_CLASS_SECURITY);
+  CHECK(rules.classify(fields("Ubuntu", "stable", "security.ubuntu.org"))==UPGRADE_CLASS_SECURITY);
+  CHECK(rules.classify(fields("Debian", "stable", "xsecurity.debian.org"))==UPGRADE_CLASS_NORMAL);
+  CHECK(rules.classify(fields("Debian", "stable", "security.debian.org.evil"))==UPGRADE_CLASS_NORMAL);
+}
+
+/** A malformed rule is an error, not a silently ignored rule. */
+static void test_errors()
+{
+  origin_rules rules;
+
+  {
+    Configuration conf;
+
+    conf.Set("Rules::a::Site", "*");
+    conf.Set("Rules::a::Class", "urgent");
+
+    CHECK(!rules.load(conf, "Rules"));
+    CHECK(_error->PendingError());
+    _error->Discard();
+  }
+
+  {
+    Configuration conf;
+
+    conf.Set("Rules::a::Host", "*");
+    conf.Set("Rules::a::Class", "security");
+
+    CHECK(!rules.load(conf, "Rules"));
+    CHECK(_error->PendingError());
+    _error->Discard();
+  }
+
+  {
+    Configuration conf;
+
+    conf.Set("Rules::a::Site", "*");
+
+    CHECK(!rules.load(conf, "Rules"));
+    CHECK(_error->PendingError());
+    _error->Discard();
+  }
+}
+
+int main()
+{
+  test_default();
+  test_precedence();
+  test_globs();
+  test_errors();
+
+  return check_status();
+}
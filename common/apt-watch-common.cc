@@ -8,26 +8,280 @@
 #include <cstdlib>
 #include <cstring>
 #include <errno.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 using namespace std;
 
-void write_msgid(int fd, unsigned char msgid)
+msg_builder &msg_builder::begin(unsigned char msgid)
+{
+  payload.erase();
+  header[sizeof(uint32_t)]=msgid;
+
+  return *this;
+}
+
+msg_builder &msg_builder::put_bool(bool b)
+{
+  payload+=(char) (b?1:0);
+  return *this;
+}
+
+msg_builder &msg_builder::put_byte(unsigned char c)
+{
+  payload+=(char) c;
+  return *this;
+}
+
+msg_builder &msg_builder::put_uint32(uint32_t n)
+{
+  payload.append((const char *) &n, sizeof(n));
+  return *this;
+}
+
+msg_builder &msg_builder::put_uint64(uint64_t n)
+{
+  payload.append((const char *) &n, sizeof(n));
+  return *this;
+}
+
+msg_builder &msg_builder::put_float(float f)
+{
+  payload.append((const char *) &f, sizeof(f));
+  return *this;
+}
+
+msg_builder &msg_builder::put_string(const string &str)
+{
+  put_uint32(str.size());
+  payload.append(str);
+  return *this;
+}
+
+void msg_builder::wipe()
+{
+  payload.replace(0, payload.size(), payload.size(), '\0');
+  payload.erase();
+}
+
+bool msg_builder::send(int fd)
+{
+  uint32_t len=payload.size();
+  memcpy(header, &len, sizeof(len));
+
+  struct iovec iov[2];
+  iov[0].iov_base=header;
+  iov[0].iov_len=sizeof(header);
+  iov[1].iov_base=const_cast<char *>(payload.data());
+  iov[1].iov_len=payload.size();
+
+  int iovcnt=payload.empty()?1:2;
+  struct iovec *cur=iov;
+
+  // Frames below PIPE_BUF go out atomically; bigger ones may be
+  // split by the kernel, so pick up where it left off.
+  while(iovcnt>0)
+    {
+      ssize_t amt=writev(fd, cur, iovcnt);
+
+      if(amt<0)
+	{
+	  if(errno==EINTR)
+	    continue;
+	  return false;
+	}
+
+      while(iovcnt>0 && (size_t) amt>=cur->iov_len)
+	{
+	  amt-=cur->iov_len;
+	  ++cur;
+	  --iovcnt;
+	}
+
+      if(iovcnt>0)
+	{
+	  cur->iov_base=(char *) cur->iov_base+amt;
+	  cur->iov_len-=amt;
+	}
+    }
+
+  return true;
+}
+
+bool msg_frame::get_raw(void *out, string::size_type len)
 {
-  write(fd, &msgid, sizeof(msgid));
+  if(payload.size()-pos<len)
+    return false;
+
+  memcpy(out, payload.data()+pos, len);
+  pos+=len;
+
+  return true;
 }
 
-void write_string(int fd, const string &str)
+bool msg_frame::get_bool(bool &b)
 {
-  string::size_type sz=str.size();
+  unsigned char c;
+
+  if(!get_raw(&c, sizeof(c)))
+    return false;
 
-  write(fd, &sz, sizeof(sz));
-  write(fd, str.c_str(), sz);
+  b=(c!=0);
+  return true;
+}
+
+bool msg_frame::get_byte(unsigned char &c)
+{
+  return get_raw(&c, sizeof(c));
+}
+
+bool msg_frame::get_uint32(uint32_t &n)
+{
+  return get_raw(&n, sizeof(n));
+}
+
+bool msg_frame::get_uint64(uint64_t &n)
+{
+  return get_raw(&n, sizeof(n));
+}
+
+bool msg_frame::get_float(float &f)
+{
+  return get_raw(&f, sizeof(f));
+}
+
+bool msg_frame::get_string(string &str)
+{
+  uint32_t len;
+  string::size_type oldpos=pos;
+
+  if(!get_uint32(len))
+    return false;
+
+  if(payload.size()-pos<len)
+    {
+      pos=oldpos;
+      return false;
+    }
+
+  str.assign(payload, pos, len);
+  pos+=len;
+
+  return true;
+}
+
+void msg_frame::wipe()
+{
+  payload.replace(0, payload.size(), payload.size(), '\0');
+  payload.erase();
+  pos=0;
+}
+
+ssize_t msg_reader::fill(int fd)
+{
+  char rdbuf[4096];
+  ssize_t amt;
+
+  do
+    {
+      amt=read(fd, rdbuf, sizeof(rdbuf));
+    } while(amt<0 && errno==EINTR);
+
+  if(amt>0)
+    {
+      // Throw away consumed frames before the buffer grows.
+      if(start>0)
+	{
+	  buf.erase(0, start);
+	  start=0;
+	}
+
+      buf.append(rdbuf, amt);
+    }
+
+  return amt;
+}
+
+bool msg_reader::next(msg_frame &frame)
+{
+  const string::size_type hdrlen=sizeof(uint32_t)+1;
+
+  if(bad || buf.size()-start<hdrlen)
+    return false;
+
+  uint32_t len;
+  memcpy(&len, buf.data()+start, sizeof(len));
+
+  if(len>MAX_FRAME_PAYLOAD)
+    {
+      bad=true;
+      return false;
+    }
+
+  if(buf.size()-start-hdrlen<len)
+    return false;
+
+  frame.msgid=(unsigned char) buf[start+sizeof(uint32_t)];
+  frame.payload.assign(buf, start+hdrlen, len);
+  frame.pos=0;
+
+  start+=hdrlen+len;
+
+  if(start==buf.size())
+    {
+      buf.erase();
+      start=0;
+    }
+
+  return true;
+}
+
+bool msg_reader::read_frame(int fd, msg_frame &frame)
+{
+  while(!next(frame))
+    if(bad || fill(fd)<=0)
+      return false;
+
+  return true;
+}
+
+void msg_reader::clear()
+{
+  buf.erase();
+  start=0;
+  bad=false;
+}
+
+msg_builder &put_fetch_progress(msg_builder &msg, const fetch_progress &p)
+{
+  return msg.put_uint64(p.current_bytes)
+    .put_uint64(p.total_bytes)
+    .put_uint64(p.current_items)
+    .put_uint64(p.total_items)
+    .put_uint64(p.cps)
+    .put_uint64(p.eta)
+    .put_byte(p.phase);
+}
+
+bool get_fetch_progress(msg_frame &frame, fetch_progress &p)
+{
+  return frame.get_uint64(p.current_bytes) &&
+    frame.get_uint64(p.total_bytes) &&
+    frame.get_uint64(p.current_items) &&
+    frame.get_uint64(p.total_items) &&
+    frame.get_uint64(p.cps) &&
+    frame.get_uint64(p.eta) &&
+    frame.get_byte(p.phase);
+}
+
+void write_msgid(int fd, unsigned char msgid)
+{
+  msg_builder(msgid).send(fd);
 }
 
 void write_msg(int fd, unsigned char msgid, const std::string &str)
 {
-  write_msgid(fd, msgid);
-  write_string(fd, str);
+  msg_builder(msgid).put_string(str).send(fd);
 }
 
 // Collect this in one spot so I can do it right with mostly-proper
@@ -71,19 +325,3 @@ void write_errno(int fd, unsigned char msgid, const std::string &str)
 {
   write_errno(fd, msgid, str, errno);
 }
-
-char *read_string(int fd)
-{
-  size_t amt;
-
-  if(read(fd, &amt, sizeof(amt))<(int) sizeof(amt))
-    return NULL;
-
-  char *rval=(char *) malloc(amt+1);
-
-  read(fd, rval, amt);
-
-  rval[amt]=0;
-
-  return rval;
-}
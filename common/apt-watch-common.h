@@ -1,8 +1,19 @@
 // apt-watch-common.h          -*-c++-*-
 
+#ifndef APT_WATCH_COMMON_H
+#define APT_WATCH_COMMON_H
+
 #include <string>
 
-#define PROTOCOL_VERSION 1
+#include <stdint.h>
+#include <sys/types.h>
+
+#define PROTOCOL_VERSION 2
+
+/** The largest payload a single frame may carry.  A length header
+ *  larger than this means the stream is corrupt.
+ */
+#define MAX_FRAME_PAYLOAD (1<<20)
 
 #define APPLET_CMD_UPDATE 0
 #define APPLET_CMD_RELOAD 1
@@ -14,6 +25,12 @@
 // Only valid during an update or a download.
 #define APPLET_CMD_ABORT_DOWNLOAD 6
 
+#define APPLET_CMD_PROGRESS_SHM_REQUEST 7
+// Also valid during an update or a download.
+#define APPLET_CMD_PROGRESS_SHM_ENABLE 8
+
+#define APPLET_CMD_UPDATE_AND_DOWNLOAD 9
+
 #define APPLET_REPLY_AUTH_PROMPT_NOECHO 64
 #define APPLET_REPLY_AUTH_PROMPT_ECHO 65
 #define APPLET_REPLY_AUTH_ERRORMSG 66
@@ -21,6 +38,22 @@
 
 #define APPLET_REPLY_PROGRESS_UPDATE 68
 #define APPLET_REPLY_PROGRESS_DONE 69
+#define APPLET_REPLY_FETCH_PROGRESS 70
+#define APPLET_REPLY_PROGRESS_SHM 71
+#define APPLET_REPLY_INIT_PROVISIONAL 72
+#define APPLET_REPLY_PACKAGE_FETCHED 73
+#define APPLET_REPLY_CLASS_READY 74
+
+// Phases reported in a fetch progress message.
+#define PROGRESS_PHASE_UPDATE 0
+#define PROGRESS_PHASE_DOWNLOAD 1
+
+// Upgrade classes, from least to most urgent.  The init and
+// command-complete replies carry the highest class available.
+#define UPGRADE_CLASS_NONE 0
+#define UPGRADE_CLASS_NORMAL 1
+#define UPGRADE_CLASS_SECURITY 2
+#define UPGRADE_CLASS_CRITICAL 3
 
 #define APPLET_REPLY_AUTH_FAIL 128
 #define APPLET_REPLY_AUTH_OK 129
@@ -42,17 +75,142 @@
 
 #define APPLET_REPLY_AUTH_FINISHED 140
 
-// TODO: protocol marshalling/demarshalling functions.
+/** Builds a single protocol frame in a reusable buffer and sends it
+ *  with one writev().  See protocol.txt for the frame layout.
+ */
+class msg_builder
+{
+  unsigned char header[sizeof(uint32_t)+1];
+  std::string payload;
+public:
+  msg_builder() {begin(0);}
+  explicit msg_builder(unsigned char msgid) {begin(msgid);}
+
+  /** Start a new frame, discarding the previous payload but keeping
+   *  its storage around for reuse.
+   */
+  msg_builder &begin(unsigned char msgid);
+
+  msg_builder &put_bool(bool b);
+  msg_builder &put_byte(unsigned char c);
+  msg_builder &put_uint32(uint32_t n);
+  msg_builder &put_uint64(uint64_t n);
+  msg_builder &put_float(float f);
+  msg_builder &put_string(const std::string &str);
+
+  /** Overwrite the payload with zeroes (for passwords). */
+  void wipe();
+
+  /** Write the frame to fd.  Returns \b false and sets errno if the
+   *  whole frame could not be written.
+   */
+  bool send(int fd);
+};
+
+/** A single message read from the other end.  The get_* accessors
+ *  consume the payload from front to back and return \b false if it
+ *  is too short.
+ */
+class msg_frame
+{
+  friend class msg_reader;
+
+  unsigned char msgid;
+  std::string payload;
+  std::string::size_type pos;
+
+  bool get_raw(void *out, std::string::size_type len);
+public:
+  msg_frame():msgid(0), pos(0) {}
+
+  unsigned char id() const {return msgid;}
 
-/** Write a string to the given fd */
-void write_string(int fd, const std::string &str);
+  /** \return \b true if there is unread payload left. */
+  bool more() const {return pos<payload.size();}
 
-/** Convenience for messages that have a single string; writes the
- *  message header and then the string.
+  bool get_bool(bool &b);
+  bool get_byte(unsigned char &c);
+  bool get_uint32(uint32_t &n);
+  bool get_uint64(uint64_t &n);
+  bool get_float(float &f);
+  bool get_string(std::string &str);
+
+  /** Overwrite the payload with zeroes (for passwords). */
+  void wipe();
+};
+
+/** Buffers bytes read from a stream and splits them into frames, so
+ *  that one read() can yield many messages and a partial read never
+ *  desynchronizes the stream.
+ */
+class msg_reader
+{
+  std::string buf;
+  std::string::size_type start;
+  bool bad;
+public:
+  msg_reader():start(0), bad(false) {}
+
+  /** Perform a single read() on fd and buffer the result.
+   *
+   *  \return the number of bytes read, 0 on EOF or -1 on error.
+   */
+  ssize_t fill(int fd);
+
+  /** Remove the next complete frame from the buffer.
+   *
+   *  \return \b false if no complete frame is buffered.
+   */
+  bool next(msg_frame &frame);
+
+  /** Block until a whole frame has arrived on fd.
+   *
+   *  \return \b false on EOF, on a read error or if the stream is
+   *  corrupt.
+   */
+  bool read_frame(int fd, msg_frame &frame);
+
+  /** \return \b true if a bogus length header was seen; nothing
+   *  more can be parsed from the stream.
+   */
+  bool corrupt() const {return bad;}
+
+  /** Drop all buffered data (eg, when the other end goes away). */
+  void clear();
+};
+
+/** The raw numbers sent with APPLET_REPLY_FETCH_PROGRESS; the applet
+ *  does all the formatting.
  */
+struct fetch_progress
+{
+  uint64_t current_bytes, total_bytes;
+  uint64_t current_items, total_items;
+
+  /** Bytes per second, or 0 if unknown. */
+  uint64_t cps;
+
+  /** Seconds remaining, or 0 if unknown. */
+  uint64_t eta;
+
+  /** One of the PROGRESS_PHASE_* values. */
+  unsigned char phase;
+
+  fetch_progress():current_bytes(0), total_bytes(0),
+		   current_items(0), total_items(0),
+		   cps(0), eta(0), phase(PROGRESS_PHASE_UPDATE) {}
+};
+
+/** Append the fields of a fetch progress message to msg. */
+msg_builder &put_fetch_progress(msg_builder &msg, const fetch_progress &p);
+
+/** Read the fields of a fetch progress message from frame. */
+bool get_fetch_progress(msg_frame &frame, fetch_progress &p);
+
+/** Convenience for messages that have a single string. */
 void write_msg(int fd, unsigned char msgid, const std::string &str);
 
-/** Write a message header to the given fd.  (could be inline/a macro?) */
+/** Write a message with no payload to the given fd. */
 void write_msgid(int fd, unsigned char msgid);
 
 /** Format and write a message based on the given error code to the
@@ -63,7 +221,4 @@ void write_errno(int fd, unsigned char msgid, const std::string &str, int nr);
 /** As above, but uses the current value of errno. */
 void write_errno(int fd, unsigned char msgid, const std::string &str);
 
-/** Reads a string from a file descriptor, returning the \b newly
- *  \b allocated string or NULL if one could not be read.
- */
-char* read_string(int fd);
+#endif // APT_WATCH_COMMON_H
@@ -2,19 +2,41 @@
 //
 //  Copyright 2004 Daniel Burrows
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include "fileutl.h"
+#include "io-batch.h"
 
+#include <cassert>
 #include <cstdio>
 #include <cstring>
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <sys/fcntl.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <utime.h>
 
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
+
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <vector>
+
 using namespace std;
 
 bool in_path(const string &PATH, const string &fn)
@@ -55,7 +77,201 @@ bool in_path(const string &fn)
   return in_path(PATH, fn);
 }
 
-bool copy_temp(const string &src, const string &dst, string &name)
+const char *copy_method_name(copy_method method)
+{
+  switch(method)
+    {
+    case COPY_METHOD_CLONE: return "reflink";
+    case COPY_METHOD_COPY_FILE_RANGE: return "copy_file_range";
+    case COPY_METHOD_SENDFILE: return "sendfile";
+    case COPY_METHOD_READ_WRITE: return "read/write";
+    default: return "none";
+    }
+}
+
+#if defined(FICLONE) || defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SENDFILE)
+/** \return \b true if errno says that a copy method isn't available
+ *  for these files, rather than that something went wrong.
+ */
+static bool method_unsupported(int err)
+{
+  return err==ENOSYS || err==EOPNOTSUPP || err==ENOTSUP ||
+    err==EXDEV || err==EINVAL || err==ENOTTY || err==EBADF;
+}
+#endif
+
+/** Write all of buf, retrying short writes. */
+static bool write_all(int fd, const char *buf, size_t len)
+{
+  while(len>0)
+    {
+      ssize_t amt=write(fd, buf, len);
+
+      if(amt<0)
+	{
+	  if(errno==EINTR)
+	    continue;
+
+	  return false;
+	}
+
+      buf+=amt;
+      len-=amt;
+    }
+
+  return true;
+}
+
+// The most each kernel call is asked to move at once.
+#define COPY_CHUNK (1<<30)
+
+// The buffer for the last resort.
+#define COPY_BUFFER_SIZE (256*1024)
+
+bool copy_data(int infd, int outfd, copy_method *method)
+{
+  copy_method used=COPY_METHOD_NONE;
+
+  // How much has been copied so far, by whatever means.
+  off_t done=0;
+
+  bool more=true;
+
+#ifdef FICLONE
+  if(ioctl(outfd, FICLONE, infd)==0)
+    {
+      if(method)
+	*method=COPY_METHOD_CLONE;
+      return true;
+    }
+  else if(!method_unsupported(errno))
+    return false;
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+  while(more)
+    {
+      off_t inoff=done, outoff=done;
+      ssize_t amt=copy_file_range(infd, &inoff, outfd, &outoff, COPY_CHUNK, 0);
+
+      if(amt<0)
+	{
+	  if(errno==EINTR)
+	    continue;
+
+	  // Some file systems refuse even after a partial copy; the
+	  // next method picks up from there.
+	  if(!method_unsupported(errno))
+	    return false;
+
+	  break;
+	}
+
+      used=COPY_METHOD_COPY_FILE_RANGE;
+      done+=amt;
+      more=(amt>0);
+    }
+#endif
+
+  // The methods below write at the file position.
+  if(more && lseek(outfd, done, SEEK_SET)<0)
+    return false;
+
+#ifdef HAVE_SENDFILE
+  while(more)
+    {
+      off_t inoff=done;
+      ssize_t amt=sendfile(outfd, infd, &inoff, COPY_CHUNK);
+
+      if(amt<0)
+	{
+	  if(errno==EINTR)
+	    continue;
+
+	  if(!method_unsupported(errno))
+	    return false;
+
+	  break;
+	}
+
+      used=COPY_METHOD_SENDFILE;
+      done+=amt;
+      more=(amt>0);
+    }
+#endif
+
+  if(more)
+    {
+      vector<char> buf(COPY_BUFFER_SIZE);
+
+      while(more)
+	{
+	  ssize_t amt=pread(infd, &buf[0], buf.size(), done);
+
+	  if(amt<0)
+	    {
+	      if(errno==EINTR)
+		continue;
+
+	      return false;
+	    }
+
+	  if(amt>0 && !write_all(outfd, &buf[0], amt))
+	    return false;
+
+	  used=COPY_METHOD_READ_WRITE;
+	  done+=amt;
+	  more=(amt>0);
+	}
+    }
+
+  if(method)
+    *method=done>0?used:COPY_METHOD_NONE;
+
+  return true;
+}
+
+static commit_policy policy=COMMIT_FAST;
+
+void set_commit_policy(commit_policy _policy)
+{
+  policy=_policy;
+}
+
+/** \return the directory holding name (which may be a path). */
+static string parent_dir(const string &name)
+{
+  string::size_type slash=name.rfind('/');
+
+  if(slash==string::npos)
+    return ".";
+  else if(slash==0)
+    return "/";
+  else
+    return name.substr(0, slash);
+}
+
+/** Flush the directory holding dst, so that its new entry survives a
+ *  crash.
+ */
+static bool sync_parent(const string &dst)
+{
+  int fd=open(parent_dir(dst).c_str(), O_RDONLY|O_DIRECTORY);
+
+  if(fd==-1)
+    return false;
+
+  bool ok=(fsync(fd)==0);
+  int err=errno;
+
+  close(fd);
+  errno=err;
+
+  return ok;
+}
+
+bool copy_temp(const string &src, const string &dst, string &name,
+	       copy_method *method)
 {
   struct stat buf;
 
@@ -110,23 +326,25 @@ bool copy_temp(const string &src, const string &dst, string &name)
       return false;
     }
 
-  char rdbuf[8192];
+  bool ok=copy_data(infd, outfd, method);
 
-  int amt;
+  if(ok && policy==COMMIT_DURABLE && fdatasync(outfd)!=0)
+    ok=false;
 
-  do
-    {
-      amt=read(infd, rdbuf, sizeof(rdbuf));
-      if(amt>0)
-	write(outfd, rdbuf, amt);
-    } while(amt>0);
+  int err=errno;
 
   close(infd);
-  close(outfd);
 
-  if(amt<0)
+  if(close(outfd)!=0 && ok)
+    {
+      ok=false;
+      err=errno;
+    }
+
+  if(!ok)
     {
       unlink(namebuf);
+      errno=err;
       return false;
     }
 
@@ -142,15 +360,28 @@ bool copy_temp(const string &src, const string &dst, string &name)
 }
 
 bool copy(const string &src, const string &dst)
+{
+  // Typed, so that this isn't taken for std::copy().
+  copy_method *method=NULL;
+
+  return copy(src, dst, method);
+}
+
+bool copy(const string &src, const string &dst, copy_method *method)
 {
   string tmpnam;
+  copy_method used;
+
+  if(!copy_temp(src, dst, tmpnam, &used))
+    return false;
 
 #ifdef DEBUG
-  fprintf(stderr, "COPY %s -> %s\n", src.c_str(), dst.c_str());
+  fprintf(stderr, "COPY %s -> %s (%s)\n", src.c_str(), dst.c_str(),
+	  copy_method_name(used));
 #endif
 
-  if(!copy_temp(src, dst, tmpnam))
-    return false;
+  if(method)
+    *method=used;
 
   if(rename(tmpnam.c_str(), dst.c_str())<0)
     {
@@ -159,6 +390,10 @@ bool copy(const string &src, const string &dst)
     }
   
   chown(dst.c_str(), geteuid(), getegid());
+
+  if(policy==COMMIT_DURABLE)
+    return sync_parent(dst);
+
   return true;
 }
 
@@ -182,240 +417,1289 @@ bool move(const string &src, const string &dst)
   return true;
 }
 
-// These templates turned out to be overkill, I think.
+/** Flush the file system holding fd to disk. */
+static int flush_fs(int fd)
+{
+#ifdef HAVE_SYNCFS
+  return syncfs(fd);
+#else
+  sync();
+  return 0;
+#endif
+}
 
-/** Tries to apply the given action to each element of a directory; aborts
- *  if any subaction aborts.
+/** The steps that make a durable tree transfer visible, put off
+ *  until all of its data is written: the temporary files are renamed
+ *  into place only after one syncfs(), the directories they went into
+ *  are then fsync()ed, and only after that are sources removed.
+ *
+ *  Steps are recorded by path, so that the transfer can close each
+ *  directory as usual when it's done with it; the log is told the
+ *  path of every directory descriptor that steps are given against.
  */
-template<class actionT>
-bool for_each_dir(const string &src, const string &dst,
-		  actionT action)
+class commit_log
 {
-  DIR *dir=opendir(src.c_str());
-  struct stat buf;
+  enum step_type {STEP_RENAME, STEP_UNLINK, STEP_RMDIR, STEP_DIR_CHANGED};
 
-  if(!dir)
-    {
-      perror(("Can't read entries of "+src).c_str());
-      return false;
-    }
+  struct step
+  {
+    step_type type;
+    string name, tmp;
+  };
 
-  for(dirent *d=readdir(dir); d; d=readdir(dir))
-    {
-      if(!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
-	continue;
+  pthread_mutex_t lock;
 
-      string srcname=src+"/"+d->d_name;
-      string dstname=dst+"/"+d->d_name;
+  /** The paths of the directories open in the transfer. */
+  map<int, string> dirs;
 
-      if(lstat(srcname.c_str(), &buf)!=0)
-	{
-	  closedir(dir);
-	  return false;
-	}
+  /** In the order they were added: a directory's removal comes after
+   *  its entries'.
+   */
+  vector<step> steps;
 
-      // descend.
-      if(!action(srcname, dstname))
-	{
-	  closedir(dir);
-	  return false;
-	}
-    }
+  void add(step_type type, int dirfd, const string &name,
+	   const string &tmp=string());
+  string resolve(int dirfd, const string &name) const;
+public:
+  commit_log() {pthread_mutex_init(&lock, NULL);}
+  ~commit_log() {pthread_mutex_destroy(&lock);}
 
-  closedir(dir);
+  /** Note that fd is now the directory at path. */
+  void name_dir(int fd, const string &path);
 
-  return true;
-}
+  /** Rename tmp in dirfd to name at commit time. */
+  void rename(int dirfd, const string &tmp, const string &name)
+  {
+    add(STEP_RENAME, dirfd, name, tmp);
+  }
 
-/** Apply the given actions to all pairs of non-directories in the
- *  directory src, and corresponding names in dst.  Abort if action
- *  returns \b false.  eg, act_recursive(src, dst, copy) does what you
- *  expect.
- *
- *  Directories in "src" are descended into using diraction if they do
- *  not exist.  Errors cause the whole process to abort. (not terribly
- *  graceful)
- */
-template<class fileactionT, class diractionT>
-bool act_recursive(const string &src, const string &dst,
-		   const fileactionT &fileaction,
-		   const diractionT &diraction)
-{
-  struct stat buf;
+  /** Remove a source file once the destination is safe. */
+  void unlink(int dirfd, const string &name)
+  {
+    add(STEP_UNLINK, dirfd, name);
+  }
 
-  if(lstat(src.c_str(), &buf)!=0)
-    {
-      perror(("Can't stat "+src).c_str());
-      return false;
-    }
+  /** Remove a source directory once the destination is safe. */
+  void rmdir(int dirfd, const string &name)
+  {
+    add(STEP_RMDIR, dirfd, name);
+  }
 
-  if(S_ISDIR(buf.st_mode))
-    return diraction(src, dst);
-  else
+  /** Note that an entry was made in the directory holding name. */
+  void dir_changed(int dirfd, const string &name)
+  {
+    add(STEP_DIR_CHANGED, dirfd, name);
+  }
 
-    // Perform the specified action.
-    if(!fileaction(src, dst))
-      {
-	perror((src+" -> "+dst).c_str());
-	return false;
-      }
+  /** Make everything durable and visible.  Returns \b false and sets
+   *  errno if something couldn't be; \b failed is the path involved.
+   */
+  bool commit(string &failed);
 
-  return true;
+  /** Throw away the temporary files of a transfer that failed. */
+  void discard();
+};
+
+void commit_log::name_dir(int fd, const string &path)
+{
+  pthread_mutex_lock(&lock);
+  dirs[fd]=path;
+  pthread_mutex_unlock(&lock);
 }
 
-struct wrap_fn_action
+/** \return the path of name in dirfd; the lock must be held. */
+string commit_log::resolve(int dirfd, const string &name) const
 {
-  wrap_fn_action(bool (*action)(const string &, const string &)):myaction(action) {}
+  if(dirfd==AT_FDCWD)
+    return name;
 
-  bool operator()(const string &src, const string &dst) const
-  {
-    return myaction(src, dst);
-  }
+  map<int, string>::const_iterator found=dirs.find(dirfd);
 
-  bool (*myaction)(const string &, const string &);
-};
+  // Every directory is named as soon as it's opened.
+  assert(found!=dirs.end());
 
-template<class fileactionT, class diractionT>
-struct curry_act_recursiveCLS
+  return found->second+"/"+name;
+}
+
+void commit_log::add(step_type type, int dirfd, const string &name,
+		     const string &tmp)
 {
-  curry_act_recursiveCLS(fileactionT faction, diractionT daction)
-    :fileaction(faction), diraction(daction) {}
+  step st;
 
-  bool operator()(const string &src, const string &dst) const
-  {
-    return act_recursive(src, dst, fileaction, diraction);
-  }
+  st.type=type;
 
-  fileactionT fileaction;
-  diractionT diraction;
-};
+  pthread_mutex_lock(&lock);
+
+  st.name=resolve(dirfd, name);
+  if(!tmp.empty())
+    st.tmp=resolve(dirfd, tmp);
 
-// ow ow ow ow
-template<class fileactionT, class diractionT>
-inline curry_act_recursiveCLS<fileactionT, diractionT> curry_act_recursive(fileactionT faction, diractionT daction) {return curry_act_recursiveCLS<fileactionT, diractionT>(faction, daction);}
+  steps.push_back(st);
+
+  pthread_mutex_unlock(&lock);
+}
 
-template<class recurT>
-struct cp_dir_action
+bool commit_log::commit(string &failed)
 {
-  cp_dir_action(recurT _recur):recur(_recur) {}
+  // Every directory that is about to change, and one open directory
+  // on each device.
+  vector<string> changed;
+  vector<dev_t> devices;
+  vector<int> device_fds;
 
-  bool operator()(const string &src, const string &dst) const
-  {
-    struct stat buf;
+  bool ok=true;
+  int err=0;
 
-    if(stat(src.c_str(), &buf)!=0)
+  for(vector<step>::const_iterator i=steps.begin(); ok && i!=steps.end(); ++i)
+    if(i->type==STEP_RENAME || i->type==STEP_DIR_CHANGED)
       {
-	perror(("Can't stat "+src).c_str());
-	return false;
-      }
+	string dir=parent_dir(i->name);
 
-    // Blindly try to create a destination directory.
-    if(mkdir(dst.c_str(), buf.st_mode)!=0 && errno!=EEXIST)
-      {
-	perror(("Can't create destination directory "+dst).c_str());
-	return false;
-      }
+	if(find(changed.begin(), changed.end(), dir)!=changed.end())
+	  continue;
 
-    return for_each_dir(src, dst,
-			curry_act_recursive(recur, *this));
-  }
+	changed.push_back(dir);
 
-  recurT recur;
-};
+	int fd=open(dir.c_str(), O_RDONLY|O_DIRECTORY);
+	struct stat buf;
 
-bool copy_recursive(const string &src, const string &dst)
-{
-  return act_recursive(src, dst, wrap_fn_action(copy),
-		       cp_dir_action<wrap_fn_action>(wrap_fn_action(copy)));
-}
+	if(fd==-1 || fstat(fd, &buf)!=0)
+	  {
+	    ok=false;
+	    err=errno;
+	    failed=dir;
 
-// tries to just immediately perform a rename; if that fails, it descends.
-struct mv_dir_action
-{
-  mv_dir_action() {}
+	    if(fd!=-1)
+	      ::close(fd);
+	  }
+	else if(find(devices.begin(), devices.end(), buf.st_dev)==devices.end())
+	  {
+	    devices.push_back(buf.st_dev);
+	    device_fds.push_back(fd);
+	  }
+	else
+	  ::close(fd);
+      }
 
-  bool operator()(const string &src, const string &dst) const
-  {
-    if(rename(src.c_str(), dst.c_str())==0) {
-      chown(dst.c_str(), geteuid(), getegid());
-      return true;
+  // One flush per file system gets every temporary file's data
+  // down...
+  for(vector<int>::iterator i=device_fds.begin(); i!=device_fds.end(); ++i)
+    {
+      if(ok && flush_fs(*i)!=0)
+	{
+	  ok=false;
+	  err=errno;
+	  failed=steps.front().name;
+	}
+
+      ::close(*i);
     }
 
-    struct stat buf;
+  if(!ok)
+    {
+      discard();
+      errno=err;
+      return false;
+    }
 
-    if(stat(src.c_str(), &buf)!=0)
-      {
-	perror(("Can't stat "+src).c_str());
-	return false;
-      }
+  // ...before any of them replaces a real one.
+  vector<int> renamed(steps.size());
+  io_batch batch;
 
-    // Blindly try to create a destination directory.
-    if(mkdir(dst.c_str(), buf.st_mode)!=0 && errno!=EEXIST)
-      {
-	perror(("Can't create destination directory "+dst).c_str());
-	return false;
-      }
+  for(vector<step>::size_type i=0; i<steps.size(); ++i)
+    if(steps[i].type==STEP_RENAME)
+      batch.rename(AT_FDCWD, steps[i].tmp.c_str(),
+		   AT_FDCWD, steps[i].name.c_str(), &renamed[i]);
 
-    if(!for_each_dir(src, dst,
-		     curry_act_recursive(wrap_fn_action(move), mv_dir_action())))
-      return false;
+  batch.run();
 
-    if(rmdir(src.c_str())!=0)
+  for(vector<step>::size_type i=0; i<steps.size(); ++i)
+    if(steps[i].type==STEP_RENAME && renamed[i]!=0)
       {
-	perror(("Can't remove "+src).c_str());
-	return false;
+	::unlink(steps[i].tmp.c_str());
+
+	if(ok)
+	  {
+	    ok=false;
+	    err=renamed[i];
+	    failed=steps[i].name;
+	  }
       }
 
-    return true;
-  }
-};
+  // Make the new names stick.
+  for(vector<string>::const_iterator i=changed.begin(); i!=changed.end(); ++i)
+    {
+      int fd=open(i->c_str(), O_RDONLY|O_DIRECTORY);
 
-bool move_recursive(const string &src, const string &dst)
+      if((fd==-1 || fsync(fd)!=0) && ok)
+	{
+	  ok=false;
+	  err=errno;
+	  failed=*i;
+	}
+
+      if(fd!=-1)
+	::close(fd);
+    }
+
+  // Only now can the sources go.
+  for(vector<step>::const_iterator i=steps.begin(); ok && i!=steps.end(); ++i)
+    {
+      int rval=0;
+
+      if(i->type==STEP_UNLINK)
+	rval=::unlink(i->name.c_str());
+      else if(i->type==STEP_RMDIR)
+	rval=::rmdir(i->name.c_str());
+
+      if(rval!=0)
+	{
+	  ok=false;
+	  err=errno;
+	  failed=i->name;
+	}
+    }
+
+  steps.clear();
+
+  if(!ok)
+    errno=err;
+
+  return ok;
+}
+
+void commit_log::discard()
 {
-  return act_recursive(src, dst, wrap_fn_action(move), mv_dir_action());
+  for(vector<step>::const_iterator i=steps.begin(); i!=steps.end(); ++i)
+    if(i->type==STEP_RENAME)
+      ::unlink(i->tmp.c_str());
+
+  steps.clear();
 }
 
-struct copy_newer_action
+/** Copy the file "src" in the directory srcdir to "dst" in dstdir,
+ *  by way of a temporary file.  Neither name may be a path, and
+ *  neither is followed if it is a symlink: a symlink is copied as a
+ *  symlink.
+ */
+static bool copy_at(int srcdir, const string &src, int dstdir,
+		    const string &dst, commit_log *log)
 {
-  bool operator()(const string &src, const string &dst) const
-  {
-    struct stat srcbuf, dstbuf;
+  char namebuf[512];
+
+  if(snprintf(namebuf, 512, "%s.apt-watch-%u:%u", dst.c_str(), getpid(), rand())<0)
+    return false;
 
-    bool do_copy=true;
+  int infd=openat(srcdir, src.c_str(), O_RDONLY|O_NOFOLLOW);
 
-    if(lstat(src.c_str(), &srcbuf)!=0)
-      {
-	perror(("Can't stat "+src).c_str());
+  if(infd==-1)
+    {
+      if(errno!=ELOOP)
 	return false;
-      }
 
-    if(lstat(dst.c_str(), &dstbuf)!=0)
-      {
-	if(errno!=ENOENT)
-	  {
-	    perror(("Can't stat "+dst).c_str());
-	    return false;
-	  }
-      }
-    else if(dstbuf.st_mtime>srcbuf.st_mtime)
-      do_copy=false;
+      char target[PATH_MAX];
+      ssize_t len=readlinkat(srcdir, src.c_str(), target, sizeof(target)-1);
 
-    if(do_copy)
-      {
-	if(!copy(src, dst))
-	  {
-	    perror(("Can't copy "+src+" to "+dst).c_str());
-	    return false;
-	  }
-      }
+      if(len<0)
+	return false;
 
-    return true;
-  }
+      target[len]='\0';
+
+      if(symlinkat(target, dstdir, namebuf)!=0)
+	return false;
+    }
+  else
+    {
+      struct stat buf;
+
+      if(fstat(infd, &buf)!=0)
+	{
+	  int err=errno;
+	  close(infd);
+	  errno=err;
+	  return false;
+	}
+
+      int outfd=openat(dstdir, namebuf, O_WRONLY|O_CREAT|O_EXCL, buf.st_mode);
+
+      if(outfd==-1)
+	{
+	  int err=errno;
+	  close(infd);
+	  errno=err;
+	  return false;
+	}
+
+      bool ok=copy_data(infd, outfd);
+      int err=errno;
+
+      // As copy() does after the rename, but on the file we made.
+      if(ok)
+	fchown(outfd, geteuid(), getegid());
+
+      close(infd);
+
+      if(close(outfd)!=0 && ok)
+	{
+	  ok=false;
+	  err=errno;
+	}
+
+      if(!ok)
+	{
+	  unlinkat(dstdir, namebuf, 0);
+	  errno=err;
+	  return false;
+	}
+    }
+
+  if(log!=NULL)
+    log->rename(dstdir, namebuf, dst);
+  else if(renameat(dstdir, namebuf, dstdir, dst.c_str())!=0)
+    {
+      int err=errno;
+      unlinkat(dstdir, namebuf, 0);
+      errno=err;
+      return false;
+    }
+
+  return true;
+}
+
+/** Remove a source file after it was copied, or have log do it once
+ *  the copy is safe.
+ */
+static bool remove_source(int srcdir, const string &src, commit_log *log)
+{
+  if(log==NULL)
+    return unlinkat(srcdir, src.c_str(), 0)==0;
+
+  log->unlink(srcdir, src);
+  return true;
+}
+
+/** As move(), relative to directories; see copy_at(). */
+static bool move_at(int srcdir, const string &src, int dstdir,
+		    const string &dst, commit_log *log)
+{
+  if(renameat(srcdir, src.c_str(), dstdir, dst.c_str())==0)
+    {
+      fchownat(dstdir, dst.c_str(), geteuid(), getegid(), AT_SYMLINK_NOFOLLOW);
+
+      if(log!=NULL)
+	log->dir_changed(dstdir, dst);
+
+      return true;
+    }
+
+  return copy_at(srcdir, src, dstdir, dst, log) &&
+    remove_source(srcdir, src, log);
+}
+
+/** As copy_at() for each of the given files, which have the same
+ *  names on both sides; the closes and the renames into place go
+ *  through one batch.  Sets \b failed to the name of a file that
+ *  couldn't be copied.
+ */
+static bool copy_batch_at(int srcdir, int dstdir, const vector<string> &names,
+			  string &failed, commit_log *log)
+{
+  vector<string>::size_type n=names.size();
+
+  // The batch refers to these until it runs.
+  vector<string> tmpnames(n);
+  vector<int> closed_in(n), closed_out(n), renamed(n);
+  vector<bool> queued(n, false);
+
+  io_batch batch;
+
+  bool ok=true;
+  int err=0;
+
+  for(vector<string>::size_type i=0; i<n && ok; ++i)
+    {
+      const string &name=names[i];
+      char namebuf[512];
+
+      if(snprintf(namebuf, 512, "%s.apt-watch-%u:%u", name.c_str(), getpid(), rand())<0)
+	{
+	  ok=false;
+	  err=errno;
+	  failed=name;
+	  break;
+	}
+
+      tmpnames[i]=namebuf;
+
+      int infd=openat(srcdir, name.c_str(), O_RDONLY|O_NOFOLLOW);
+
+      if(infd==-1)
+	{
+	  // A symlink; not worth batching.
+	  if(errno==ELOOP && copy_at(srcdir, name, dstdir, name, log))
+	    continue;
+
+	  ok=false;
+	  err=errno;
+	  failed=name;
+	  break;
+	}
+
+      struct stat buf;
+      int outfd=-1;
+
+      if(fstat(infd, &buf)!=0 ||
+	 (outfd=openat(dstdir, namebuf, O_WRONLY|O_CREAT|O_EXCL, buf.st_mode))==-1 ||
+	 !copy_data(infd, outfd))
+	{
+	  ok=false;
+	  err=errno;
+	  failed=name;
+
+	  ::close(infd);
+	  if(outfd!=-1)
+	    {
+	      ::close(outfd);
+	      unlinkat(dstdir, namebuf, 0);
+	    }
+
+	  break;
+	}
+
+      fchown(outfd, geteuid(), getegid());
+
+      // A file is only renamed into place if it was closed without
+      // error.  A durable transfer renames them all at the end.
+      batch.close(infd, &closed_in[i]);
+      batch.close(outfd, &closed_out[i]);
+
+      if(log==NULL)
+	{
+	  batch.link();
+	  batch.rename(dstdir, tmpnames[i].c_str(), dstdir, name.c_str(),
+		       &renamed[i]);
+	}
+
+      queued[i]=true;
+    }
+
+  // Even after an error: it closes the files that are still open.
+  batch.run();
+
+  for(vector<string>::size_type i=0; i<n; ++i)
+    if(queued[i] && log!=NULL && closed_out[i]==0)
+      log->rename(dstdir, tmpnames[i], names[i]);
+    else if(queued[i] && (renamed[i]!=0 || closed_out[i]!=0))
+      {
+	unlinkat(dstdir, tmpnames[i].c_str(), 0);
+
+	if(ok)
+	  {
+	    ok=false;
+	    err=closed_out[i]!=0?closed_out[i]:renamed[i];
+	    failed=names[i];
+	  }
+      }
+
+  if(!ok)
+    errno=err;
+
+  return ok;
+}
+
+/** What to do with the files and directories of a tree.  Every name
+ *  is relative to the directory fd passed along with it; the walker
+ *  opens each directory once and never follows a symlink, so nothing
+ *  can be swapped in underneath a transfer.
+ */
+struct tree_action
+{
+  /** Where to put off the steps of a durable transfer; NULL to take
+   *  them straight away.
+   */
+  commit_log *log;
+
+  tree_action():log(NULL) {}
+  virtual ~tree_action() {}
+
+  /** Transfer a single non-directory. */
+  virtual bool file(int srcdir, const string &src,
+		    int dstdir, const string &dst) const=0;
+
+  /** Transfer several non-directories, which have the same names on
+   *  both sides.  Sets \b failed to the name of one that went wrong.
+   */
+  virtual bool files(int srcdir, int dstdir, const vector<string> &names,
+		     string &failed) const
+  {
+    for(vector<string>::const_iterator i=names.begin(); i!=names.end(); ++i)
+      if(!file(srcdir, *i, dstdir, *i))
+	{
+	  failed=*i;
+	  return false;
+	}
+
+    return true;
+  }
+
+  /** Get ready to transfer the entries of a directory.  Sets \b done
+   *  if the whole directory was dealt with at once.
+   */
+  virtual bool enter_dir(int srcdir, const string &src,
+			 int dstdir, const string &dst,
+			 mode_t mode, bool &done) const
+  {
+    done=false;
+
+    // Blindly try to create a destination directory.
+    if(mkdirat(dstdir, dst.c_str(), mode)==0)
+      {
+	if(log!=NULL)
+	  log->dir_changed(dstdir, dst);
+
+	return true;
+      }
+
+    return errno==EEXIST;
+  }
+
+  /** Called once every entry of a directory has been transferred. */
+  virtual bool leave_dir(int srcdir, const string &src) const
+  {
+    return true;
+  }
+};
+
+/** The number of threads a tree transfer uses; 0 means one per CPU. */
+static unsigned int copy_threads=0;
+
+void set_copy_threads(unsigned int n)
+{
+  copy_threads=n;
+}
+
+// Transfers are mostly waiting on the disk; past this many threads
+// they just get in each other's way.
+#define MAX_COPY_THREADS 8
+
+// The most files handed to an action at once.  Each may hold two
+// descriptors until its batch runs.
+#define FILE_BATCH 16
+
+/** Transfers a directory tree with a pool of threads.  Each thread
+ *  keeps a deque of jobs: it pushes the entries of the directories it
+ *  reads onto the back of its own deque and works from there, and
+ *  when that runs dry it steals from the front of another thread's.
+ *  A directory is finished (for instance, removed after a move) once
+ *  all of its entries are.
+ *
+ *  Each directory on both sides stays open while its entries are
+ *  transferred, and they are named relative to it; full paths are
+ *  only put together for error messages.
+ *
+ *  The first error stops the transfer; jobs that haven't started are
+ *  dropped.
+ *
+ *  Under COMMIT_DURABLE the action's steps go into a commit_log that
+ *  is committed once every thread is done.
+ */
+class tree_transfer
+{
+  /** A directory whose entries are being transferred. */
+  struct node
+  {
+    /** The names of the directory in its parents; for the top of the
+     *  tree, the paths the transfer was given.
+     */
+    string src, dst;
+    node *parent;
+
+    /** The source, open for reading, and the destination. */
+    DIR *srcdir;
+    int dstfd;
+
+    /** The entries not yet finished, plus one while the directory
+     *  is still being read.
+     */
+    unsigned long pending;
+
+    int srcfd() const {return parent==NULL?AT_FDCWD:dirfd(parent->srcdir);}
+    int dstparent() const {return parent==NULL?AT_FDCWD:parent->dstfd;}
+
+    void close_dirs()
+    {
+      if(srcdir!=NULL)
+	closedir(srcdir);
+      if(dstfd!=-1)
+	close(dstfd);
+
+      srcdir=NULL;
+      dstfd=-1;
+    }
+  };
+
+  struct job
+  {
+    /** The name within parent, or the whole path at the top. */
+    string src, dst;
+    node *parent;
+
+    /** From the directory entry; DT_UNKNOWN if it didn't say. */
+    unsigned char type;
+
+    /** If not empty, this job is these non-directories in parent
+     *  instead.
+     */
+    vector<string> batch;
+  };
+
+  struct worker
+  {
+    pthread_mutex_t lock;
+    deque<job *> jobs;
+    tree_transfer *owner;
+    unsigned int index;
+  };
+
+  tree_action &action;
+
+  /** NULL unless the transfer is durable. */
+  commit_log *log;
+
+  vector<worker *> workers;
+
+  /** Protects everything below. */
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+
+  /** Jobs sitting in a deque. */
+  unsigned long queued;
+
+  /** Jobs that are queued or running. */
+  unsigned long outstanding;
+
+  bool failed;
+  int first_errno;
+
+  /** Every node, so that they can be freed after an abort. */
+  vector<node *> nodes;
+
+  static string path(const node *n, const string &name, bool dst);
+
+  void push(worker &w, job *j);
+  void push(worker &w, const string &src, const string &dst,
+	    node *parent, unsigned char type);
+  void push(worker &w, vector<string> &batch, node *parent);
+  job *take(worker &w);
+  void run(worker &w, job *j);
+  void finish(node *n);
+  void fail(int err);
+  void fail(const string &msg);
+  bool aborted();
+
+  static void *thread_main(void *data);
+  void work(worker &w);
+public:
+  tree_transfer(tree_action &_action);
+  ~tree_transfer();
+
+  /** Transfer the tree at src to dst.  Returns \b false and sets
+   *  errno to the first error if anything went wrong.
+   */
+  bool go(const string &src, const string &dst);
+};
+
+tree_transfer::tree_transfer(tree_action &_action)
+  :action(_action), log(NULL), queued(0), outstanding(0), failed(false),
+   first_errno(0)
+{
+  if(policy==COMMIT_DURABLE)
+    {
+      log=new commit_log;
+      action.log=log;
+    }
+
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&wake, NULL);
+
+  unsigned int n=copy_threads;
+
+  if(n==0)
+    {
+      long cpus=sysconf(_SC_NPROCESSORS_ONLN);
+
+      n=cpus>0?cpus:1;
+    }
+
+  if(n>MAX_COPY_THREADS)
+    n=MAX_COPY_THREADS;
+
+  for(unsigned int i=0; i<n; ++i)
+    {
+      worker *w=new worker;
+
+      pthread_mutex_init(&w->lock, NULL);
+      w->owner=this;
+      w->index=i;
+
+      workers.push_back(w);
+    }
+}
+
+tree_transfer::~tree_transfer()
+{
+  for(vector<worker *>::iterator i=workers.begin(); i!=workers.end(); ++i)
+    {
+      while(!(*i)->jobs.empty())
+	{
+	  delete (*i)->jobs.back();
+	  (*i)->jobs.pop_back();
+	}
+
+      pthread_mutex_destroy(&(*i)->lock);
+      delete *i;
+    }
+
+  for(vector<node *>::iterator i=nodes.begin(); i!=nodes.end(); ++i)
+    {
+      (*i)->close_dirs();
+      delete *i;
+    }
+
+  action.log=NULL;
+  delete log;
+
+  pthread_cond_destroy(&wake);
+  pthread_mutex_destroy(&lock);
+}
+
+/** \return the full path of the given entry of n, on the source or
+ *  the destination side.
+ */
+string tree_transfer::path(const node *n, const string &name, bool dst)
+{
+  if(n==NULL)
+    return name;
+
+  return path(n->parent, dst?n->dst:n->src, dst)+"/"+name;
+}
+
+/** Give up, with err as the reason. */
+void tree_transfer::fail(int err)
+{
+  pthread_mutex_lock(&lock);
+
+  if(!failed)
+    {
+      failed=true;
+      first_errno=err;
+    }
+
+  pthread_cond_broadcast(&wake);
+  pthread_mutex_unlock(&lock);
+}
+
+/** Report the error in errno and give up. */
+void tree_transfer::fail(const string &msg)
+{
+  int err=errno;
+
+  perror(msg.c_str());
+  fail(err);
+}
+
+bool tree_transfer::aborted()
+{
+  pthread_mutex_lock(&lock);
+  bool rval=failed;
+  pthread_mutex_unlock(&lock);
+
+  return rval;
+}
+
+void tree_transfer::push(worker &w, const string &src, const string &dst,
+			 node *parent, unsigned char type)
+{
+  job *j=new job;
+
+  j->src=src;
+  j->dst=dst;
+  j->parent=parent;
+  j->type=type;
+
+  push(w, j);
+}
+
+/** Queue a batch of non-directories in parent, emptying \b batch. */
+void tree_transfer::push(worker &w, vector<string> &batch, node *parent)
+{
+  job *j=new job;
+
+  j->parent=parent;
+  j->type=DT_REG;
+  j->batch.swap(batch);
+
+  push(w, j);
+}
+
+void tree_transfer::push(worker &w, job *j)
+{
+  node *parent=j->parent;
+
+  // Count the job before anyone can see it: a thief could otherwise
+  // finish it, and with it the parent, before the parent knew of it.
+  pthread_mutex_lock(&lock);
+  ++queued;
+  ++outstanding;
+  if(parent!=NULL)
+    ++parent->pending;
+  pthread_mutex_unlock(&lock);
+
+  pthread_mutex_lock(&w.lock);
+  w.jobs.push_back(j);
+  pthread_mutex_unlock(&w.lock);
+
+  pthread_mutex_lock(&lock);
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+}
+
+tree_transfer::job *tree_transfer::take(worker &w)
+{
+  job *rval=NULL;
+
+  // Newest first from our own deque: that keeps to one part of the
+  // tree at a time.
+  pthread_mutex_lock(&w.lock);
+  if(!w.jobs.empty())
+    {
+      rval=w.jobs.back();
+      w.jobs.pop_back();
+    }
+  pthread_mutex_unlock(&w.lock);
+
+  // Oldest first from everyone else's: those are the likeliest to be
+  // whole directories.
+  for(unsigned int i=1; rval==NULL && i<workers.size(); ++i)
+    {
+      worker &victim=*workers[(w.index+i)%workers.size()];
+
+      pthread_mutex_lock(&victim.lock);
+      if(!victim.jobs.empty())
+	{
+	  rval=victim.jobs.front();
+	  victim.jobs.pop_front();
+	}
+      pthread_mutex_unlock(&victim.lock);
+    }
+
+  if(rval!=NULL)
+    {
+      pthread_mutex_lock(&lock);
+      --queued;
+      pthread_mutex_unlock(&lock);
+    }
+
+  return rval;
+}
+
+void tree_transfer::finish(node *n)
+{
+  while(n!=NULL)
+    {
+      pthread_mutex_lock(&lock);
+      bool last=(--n->pending==0 && !failed);
+      pthread_mutex_unlock(&lock);
+
+      if(!last)
+	return;
+
+      // Nothing refers to these any more.
+      n->close_dirs();
+
+      if(!action.leave_dir(n->srcfd(), n->src))
+	{
+	  fail("Can't remove "+path(n->parent, n->src, false));
+	  return;
+	}
+
+      n=n->parent;
+    }
+}
+
+void tree_transfer::run(worker &w, job *j)
+{
+  int srcfd=j->parent==NULL?AT_FDCWD:dirfd(j->parent->srcdir);
+  int dstfd=j->parent==NULL?AT_FDCWD:j->parent->dstfd;
+
+  if(!j->batch.empty())
+    {
+      string failed;
+
+      if(!action.files(srcfd, dstfd, j->batch, failed))
+	{
+	  fail(path(j->parent, failed, false)+" -> "+path(j->parent, failed, true));
+	  return;
+	}
+
+      finish(j->parent);
+      return;
+    }
+
+  // Directories need their mode; anything else is only stat()ed if
+  // the directory entry didn't say what it is.
+  struct stat buf;
+
+  if(j->type==DT_UNKNOWN || j->type==DT_DIR)
+    {
+      if(fstatat(srcfd, j->src.c_str(), &buf, AT_SYMLINK_NOFOLLOW)!=0)
+	{
+	  fail("Can't stat "+path(j->parent, j->src, false));
+	  return;
+	}
+
+      j->type=S_ISDIR(buf.st_mode)?DT_DIR:DT_REG;
+    }
+
+  if(j->type!=DT_DIR)
+    {
+      if(!action.file(srcfd, j->src, dstfd, j->dst))
+	{
+	  fail(path(j->parent, j->src, false)+" -> "+path(j->parent, j->dst, true));
+	  return;
+	}
+
+      finish(j->parent);
+      return;
+    }
+
+  bool done;
+
+  if(!action.enter_dir(srcfd, j->src, dstfd, j->dst, buf.st_mode, done))
+    {
+      fail("Can't create destination directory "+path(j->parent, j->dst, true));
+      return;
+    }
+
+  if(done)
+    {
+      finish(j->parent);
+      return;
+    }
+
+  node *n=new node;
+
+  n->src=j->src;
+  n->dst=j->dst;
+  n->parent=j->parent;
+  n->srcdir=NULL;
+  n->dstfd=-1;
+  n->pending=1;
+
+  pthread_mutex_lock(&lock);
+  nodes.push_back(n);
+  pthread_mutex_unlock(&lock);
+
+  int fd=openat(srcfd, j->src.c_str(), O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+
+  if(fd==-1 || (n->srcdir=fdopendir(fd))==NULL)
+    {
+      int err=errno;
+      if(fd!=-1)
+	close(fd);
+      errno=err;
+
+      fail("Can't read entries of "+path(j->parent, j->src, false));
+      return;
+    }
+
+  n->dstfd=openat(dstfd, j->dst.c_str(), O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+
+  if(n->dstfd==-1)
+    {
+      fail("Can't open destination directory "+path(j->parent, j->dst, true));
+      return;
+    }
+
+  if(log!=NULL)
+    {
+      log->name_dir(dirfd(n->srcdir), path(j->parent, j->src, false));
+      log->name_dir(n->dstfd, path(j->parent, j->dst, true));
+    }
+
+  // Entries known not to be directories go out in batches.
+  vector<string> batch;
+
+  for(dirent *d=readdir(n->srcdir); d && !aborted(); d=readdir(n->srcdir))
+    {
+      if(!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+	continue;
+
+      if(d->d_type==DT_DIR || d->d_type==DT_UNKNOWN)
+	push(w, d->d_name, d->d_name, n, d->d_type);
+      else
+	{
+	  batch.push_back(d->d_name);
+
+	  if(batch.size()>=FILE_BATCH)
+	    push(w, batch, n);
+	}
+    }
+
+  if(!batch.empty())
+    push(w, batch, n);
+
+  // Done reading; the directory is finished when its entries are.
+  finish(n);
+}
+
+void tree_transfer::work(worker &w)
+{
+  while(true)
+    {
+      job *j=take(w);
+
+      if(j!=NULL)
+	{
+	  if(!aborted())
+	    run(w, j);
+
+	  delete j;
+
+	  pthread_mutex_lock(&lock);
+	  if(--outstanding==0)
+	    pthread_cond_broadcast(&wake);
+	  pthread_mutex_unlock(&lock);
+
+	  continue;
+	}
+
+      pthread_mutex_lock(&lock);
+
+      while(queued==0 && outstanding>0 && !failed)
+	pthread_cond_wait(&wake, &lock);
+
+      bool stop=(outstanding==0 || failed);
+
+      pthread_mutex_unlock(&lock);
+
+      if(stop)
+	return;
+    }
+}
+
+void *tree_transfer::thread_main(void *data)
+{
+  worker *w=(worker *) data;
+
+  w->owner->work(*w);
+
+  return NULL;
+}
+
+bool tree_transfer::go(const string &src, const string &dst)
+{
+  push(*workers[0], src, dst, NULL, DT_UNKNOWN);
+
+  // The calling thread is the first worker.
+  vector<pthread_t> threads;
+
+  for(unsigned int i=1; i<workers.size(); ++i)
+    {
+      pthread_t thread;
+
+      // Fewer threads is slower, not wrong.
+      if(pthread_create(&thread, NULL, &thread_main, workers[i])==0)
+	threads.push_back(thread);
+    }
+
+  work(*workers[0]);
+
+  for(vector<pthread_t>::iterator i=threads.begin(); i!=threads.end(); ++i)
+    pthread_join(*i, NULL);
+
+  if(log!=NULL)
+    {
+      string name;
+
+      if(failed)
+	log->discard();
+      else if(!log->commit(name))
+	fail("Can't commit "+name);
+    }
+
+  if(failed)
+    {
+      errno=first_errno;
+      return false;
+    }
+
+  return true;
+}
+
+struct cp_action:public tree_action
+{
+  bool file(int srcdir, const string &src, int dstdir, const string &dst) const
+  {
+    return copy_at(srcdir, src, dstdir, dst, log);
+  }
+
+  bool files(int srcdir, int dstdir, const vector<string> &names,
+	     string &failed) const
+  {
+    return copy_batch_at(srcdir, dstdir, names, failed, log);
+  }
+};
+
+bool copy_recursive(const string &src, const string &dst)
+{
+  cp_action action;
+
+  return tree_transfer(action).go(src, dst);
+}
+
+// tries to just immediately perform a rename; if that fails, it descends.
+struct mv_action:public tree_action
+{
+  bool file(int srcdir, const string &src, int dstdir, const string &dst) const
+  {
+    return move_at(srcdir, src, dstdir, dst, log);
+  }
+
+  bool files(int srcdir, int dstdir, const vector<string> &names,
+	     string &failed) const
+  {
+    vector<int> renamed(names.size());
+    io_batch batch;
+
+    for(vector<string>::size_type i=0; i<names.size(); ++i)
+      batch.rename(srcdir, names[i].c_str(), dstdir, names[i].c_str(),
+		   &renamed[i]);
+
+    batch.run();
+
+    for(vector<string>::size_type i=0; i<names.size(); ++i)
+      {
+	const char *name=names[i].c_str();
+
+	if(renamed[i]==0)
+	  {
+	    fchownat(dstdir, name, geteuid(), getegid(), AT_SYMLINK_NOFOLLOW);
+
+	    if(log!=NULL)
+	      log->dir_changed(dstdir, names[i]);
+	  }
+	else if(!copy_at(srcdir, names[i], dstdir, names[i], log) ||
+		!remove_source(srcdir, names[i], log))
+	  {
+	    failed=names[i];
+	    return false;
+	  }
+      }
+
+    return true;
+  }
+
+  bool enter_dir(int srcdir, const string &src,
+		 int dstdir, const string &dst,
+		 mode_t mode, bool &done) const
+  {
+    if(renameat(srcdir, src.c_str(), dstdir, dst.c_str())==0) {
+      fchownat(dstdir, dst.c_str(), geteuid(), getegid(), AT_SYMLINK_NOFOLLOW);
+      if(log!=NULL)
+	log->dir_changed(dstdir, dst);
+      done=true;
+      return true;
+    }
+
+    return tree_action::enter_dir(srcdir, src, dstdir, dst, mode, done);
+  }
+
+  bool leave_dir(int srcdir, const string &src) const
+  {
+    if(log!=NULL)
+      {
+	log->rmdir(srcdir, src);
+	return true;
+      }
+
+    return unlinkat(srcdir, src.c_str(), AT_REMOVEDIR)==0;
+  }
+};
+
+bool move_recursive(const string &src, const string &dst)
+{
+  mv_action action;
+
+  return tree_transfer(action).go(src, dst);
+}
+
+struct copy_newer_action:public tree_action
+{
+  bool file(int srcdir, const string &src, int dstdir, const string &dst) const
+  {
+    struct stat srcbuf, dstbuf;
+
+    if(fstatat(srcdir, src.c_str(), &srcbuf, AT_SYMLINK_NOFOLLOW)!=0)
+      return false;
+
+    if(fstatat(dstdir, dst.c_str(), &dstbuf, AT_SYMLINK_NOFOLLOW)!=0)
+      {
+	if(errno!=ENOENT)
+	  return false;
+      }
+    else if(dstbuf.st_mtime>srcbuf.st_mtime)
+      return true;
+
+    return copy_at(srcdir, src, dstdir, dst, log);
+  }
+
+  bool files(int srcdir, int dstdir, const vector<string> &names,
+	     string &failed) const
+  {
+    vector<string>::size_type n=names.size();
+    vector<struct stat> srcbufs(n), dstbufs(n);
+    vector<int> srcstat(n), dststat(n);
+
+    io_batch batch;
+
+    for(vector<string>::size_type i=0; i<n; ++i)
+      {
+	batch.stat(srcdir, names[i].c_str(), &srcbufs[i], &srcstat[i]);
+	batch.stat(dstdir, names[i].c_str(), &dstbufs[i], &dststat[i]);
+      }
+
+    batch.run();
+
+    vector<string> wanted;
+
+    for(vector<string>::size_type i=0; i<n; ++i)
+      {
+	int err=srcstat[i];
+
+	if(err==0 && dststat[i]!=0 && dststat[i]!=ENOENT)
+	  err=dststat[i];
+
+	if(err!=0)
+	  {
+	    failed=names[i];
+	    errno=err;
+	    return false;
+	  }
+
+	if(dststat[i]==0 && dstbufs[i].st_mtime>srcbufs[i].st_mtime)
+	  continue;
+
+	wanted.push_back(names[i]);
+      }
+
+    return copy_batch_at(srcdir, dstdir, wanted, failed, log);
+  }
 };
 
 bool copy_newer_recursive(const string &src, const string &dst)
 {
-  return act_recursive(src, dst,
-		       copy_newer_action(),
-		       cp_dir_action<copy_newer_action>(copy_newer_action()));
+  copy_newer_action action;
+
+  return tree_transfer(action).go(src, dst);
 }
@@ -7,23 +7,77 @@
 
 #include <string>
 
+/** How copy_data() moved a file's contents, fastest first. */
+enum copy_method
+  {
+    /** Nothing was copied (an empty file, or an error). */
+    COPY_METHOD_NONE,
+    /** The destination shares the source's blocks (FICLONE). */
+    COPY_METHOD_CLONE,
+    /** The kernel copied the data (copy_file_range). */
+    COPY_METHOD_COPY_FILE_RANGE,
+    /** The kernel copied the data through the page cache (sendfile). */
+    COPY_METHOD_SENDFILE,
+    /** read() and write() through a buffer. */
+    COPY_METHOD_READ_WRITE
+  };
+
+/** \return a short name for the given method, for log messages. */
+const char *copy_method_name(copy_method method);
+
+/** Copy the contents of infd to outfd, which must be a new, empty
+ *  file; the fastest method that works is used, falling back to the
+ *  next one (from where the last left off) if the kernel or file
+ *  system doesn't support it.  Returns \b false and sets errno on
+ *  failure.  If method is not NULL, the method that finished the copy
+ *  is stored there.
+ */
+bool copy_data(int infd, int outfd, copy_method *method=NULL);
+
 /** Copy the file "src" to a temporary file whose name is based on "dst" and
  *  which resides in the same directory.  The name is placed into the third
  *  argument of this function.
  */
 bool copy_temp(const std::string &src, const std::string &dst,
-	       std::string &name);
+	       std::string &name, copy_method *method=NULL);
 
 /** Copy the file "src" to "dst".  Behaves like "cp".  Returns \b true if
  *  the operation succeeded; otherwise sets errno.
  */
 bool copy(const std::string &src, const std::string &dst);
 
+/** As above, storing the method that was used in *method. */
+bool copy(const std::string &src, const std::string &dst,
+	  copy_method *method);
+
 /** Move the file "src" to "dst".  Tries to perform the move atomically,
  *  but that may not be possible.
  */
 bool move(const std::string &src, const std::string &dst);
 
+/** How much a copy or move promises once it returns. */
+enum commit_policy
+  {
+    /** The new files are in place, but a crash may lose them. */
+    COMMIT_FAST,
+    /** The new files are on disk, and so are the directory entries
+     *  naming them; a source is only removed after its copy is.
+     */
+    COMMIT_DURABLE
+  };
+
+/** Set the policy of the operations in this file; the default is
+ *  COMMIT_FAST.  A durable tree operation writes every file first,
+ *  flushes each file system once, and only then renames them all
+ *  into place.
+ */
+void set_commit_policy(commit_policy policy);
+
+/** Set how many threads the tree operations below use; 0 (the
+ *  default) means one per CPU, up to a small limit.
+ */
+void set_copy_threads(unsigned int n);
+
 /** Copy a directory hierarchy, aborting and returning \b false if an
  *  error occurs.
  */
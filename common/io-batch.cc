@@ -0,0 +1,403 @@
+// io-batch.cc
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "io-batch.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+using namespace std;
+
+struct io_batch::op
+{
+  op_type type;
+
+  int fd, newfd;
+  const char *name, *newname;
+
+  struct stat *buf;
+  int *result;
+
+  /** Where the operation is: not yet handed to the kernel, handed
+   *  over, finished, or handed over and never heard from again.
+   */
+  enum {STATE_NEW, STATE_SUBMITTED, STATE_DONE, STATE_LOST} state;
+
+  /** If set, the next operation waits for this one. */
+  bool linked;
+
+#ifdef HAVE_LIBURING
+  struct statx sx;
+#endif
+};
+
+#ifdef HAVE_LIBURING
+
+// Enough for a directory's worth of files at a time without tying up
+// much memory per thread.
+#define RING_ENTRIES 64
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once=PTHREAD_ONCE_INIT;
+
+static void free_ring(void *data)
+{
+  io_uring *ring=(io_uring *) data;
+
+  if(ring!=NULL)
+    {
+      io_uring_queue_exit(ring);
+      delete ring;
+    }
+}
+
+static void make_ring_key()
+{
+  pthread_key_create(&ring_key, free_ring);
+}
+
+// Marks a thread that already found io_uring unusable.
+static char no_ring;
+
+/** \return this thread's ring, setting it up the first time; NULL if
+ *  io_uring is unavailable or lacks an operation we need.
+ */
+static io_uring *thread_ring()
+{
+  pthread_once(&ring_key_once, make_ring_key);
+
+  void *data=pthread_getspecific(ring_key);
+
+  if(data==&no_ring)
+    return NULL;
+  else if(data!=NULL)
+    return (io_uring *) data;
+
+  io_uring *ring=new io_uring;
+
+  if(io_uring_queue_init(RING_ENTRIES, ring, 0)!=0)
+    {
+      delete ring;
+      pthread_setspecific(ring_key, &no_ring);
+      return NULL;
+    }
+
+  io_uring_probe *probe=io_uring_get_probe_ring(ring);
+
+  bool usable=probe!=NULL &&
+    io_uring_opcode_supported(probe, IORING_OP_STATX) &&
+    io_uring_opcode_supported(probe, IORING_OP_CLOSE) &&
+    io_uring_opcode_supported(probe, IORING_OP_RENAMEAT);
+
+  if(probe!=NULL)
+    io_uring_free_probe(probe);
+
+  if(!usable)
+    {
+      io_uring_queue_exit(ring);
+      delete ring;
+      pthread_setspecific(ring_key, &no_ring);
+      return NULL;
+    }
+
+  pthread_setspecific(ring_key, ring);
+
+  return ring;
+}
+
+#endif // HAVE_LIBURING
+
+io_batch::io_batch()
+  :ring(NULL)
+{
+#ifdef HAVE_LIBURING
+  ring=thread_ring();
+#endif
+}
+
+io_batch::~io_batch()
+{
+  for(vector<op *>::iterator i=ops.begin(); i!=ops.end(); ++i)
+    delete *i;
+}
+
+void io_batch::add(op *o)
+{
+  o->linked=false;
+  o->state=op::STATE_NEW;
+  *o->result=0;
+
+  ops.push_back(o);
+}
+
+void io_batch::stat(int dirfd, const char *name, struct stat *buf,
+		    int *result)
+{
+  op *o=new op;
+
+  o->type=OP_STAT;
+  o->fd=dirfd;
+  o->name=name;
+  o->buf=buf;
+  o->result=result;
+
+  add(o);
+}
+
+void io_batch::close(int fd, int *result)
+{
+  op *o=new op;
+
+  o->type=OP_CLOSE;
+  o->fd=fd;
+  o->result=result;
+
+  add(o);
+}
+
+void io_batch::rename(int olddir, const char *oldname,
+		      int newdir, const char *newname, int *result)
+{
+  op *o=new op;
+
+  o->type=OP_RENAME;
+  o->fd=olddir;
+  o->name=oldname;
+  o->newfd=newdir;
+  o->newname=newname;
+  o->result=result;
+
+  add(o);
+}
+
+void io_batch::link()
+{
+  if(!ops.empty())
+    ops.back()->linked=true;
+}
+
+/** Make the calls the ring didn't (all of them, without one). */
+void io_batch::run_sync()
+{
+  bool cancel=false;
+
+  for(vector<op *>::iterator i=ops.begin(); i!=ops.end(); ++i)
+    {
+      op &o=**i;
+      int rval=0;
+
+      if(o.state!=op::STATE_NEW)
+	{
+	  cancel=(o.linked && *o.result!=0);
+	  continue;
+	}
+
+      o.state=op::STATE_DONE;
+
+      if(cancel)
+	{
+	  *o.result=ECANCELED;
+	  cancel=o.linked;
+	  continue;
+	}
+
+      switch(o.type)
+	{
+	case OP_STAT:
+	  rval=fstatat(o.fd, o.name, o.buf, AT_SYMLINK_NOFOLLOW);
+	  break;
+	case OP_CLOSE:
+	  rval=::close(o.fd);
+	  break;
+	case OP_RENAME:
+	  rval=renameat(o.fd, o.name, o.newfd, o.newname);
+	  break;
+	}
+
+      *o.result=(rval==0?0:errno);
+      cancel=(o.linked && rval!=0);
+    }
+}
+
+#ifdef HAVE_LIBURING
+
+/** Wait for n completions and store their results.  Returns \b false
+ *  if the ring stopped answering.
+ */
+bool io_batch::reap(unsigned int n)
+{
+  while(n>0)
+    {
+      io_uring_cqe *cqe;
+
+      int rval=io_uring_wait_cqe(ring, &cqe);
+
+      if(rval==-EINTR)
+	continue;
+      else if(rval<0)
+	return false;
+
+      op *o=(op *) io_uring_cqe_get_data(cqe);
+      int res=cqe->res;
+
+      io_uring_cqe_seen(ring, cqe);
+      --n;
+
+      if(o==NULL)
+	continue;
+
+      o->state=op::STATE_DONE;
+      *o->result=(res<0?-res:0);
+
+      if(o->type==OP_STAT && res==0)
+	{
+	  struct stat &buf=*o->buf;
+
+	  buf.st_mode=o->sx.stx_mode;
+	  buf.st_ino=o->sx.stx_ino;
+	  buf.st_nlink=o->sx.stx_nlink;
+	  buf.st_uid=o->sx.stx_uid;
+	  buf.st_gid=o->sx.stx_gid;
+	  buf.st_size=o->sx.stx_size;
+	  buf.st_atime=o->sx.stx_atime.tv_sec;
+	  buf.st_mtime=o->sx.stx_mtime.tv_sec;
+	  buf.st_ctime=o->sx.stx_ctime.tv_sec;
+	}
+    }
+
+  return true;
+}
+
+/** Stop using this thread's ring; run() makes the remaining calls
+ *  itself.
+ */
+void io_batch::drop_ring()
+{
+  io_uring_queue_exit(ring);
+  delete ring;
+  pthread_setspecific(ring_key, &no_ring);
+
+  ring=NULL;
+}
+
+/** Submit the operations [begin, end), which are in the ring, and
+ *  wait for them.  If that fails, the ring is dropped: operations the
+ *  kernel never took stay new, and those it took but never finished
+ *  fail with EIO.
+ */
+bool io_batch::flush(vector<op *>::size_type begin,
+		     vector<op *>::size_type end)
+{
+  unsigned int queued=end-begin, submitted=0;
+
+  while(submitted<queued)
+    {
+      int rval=io_uring_submit(ring);
+
+      if(rval==-EINTR)
+	continue;
+      else if(rval<=0)
+	break;
+
+      submitted+=rval;
+    }
+
+  // The kernel takes entries in order.
+  for(vector<op *>::size_type i=begin; i<begin+submitted; ++i)
+    ops[i]->state=op::STATE_SUBMITTED;
+
+  bool ok=reap(submitted) && submitted==queued;
+
+  if(!ok)
+    {
+      for(vector<op *>::size_type i=begin; i<end; ++i)
+	if(ops[i]->state==op::STATE_SUBMITTED)
+	  {
+	    ops[i]->state=op::STATE_LOST;
+	    *ops[i]->result=EIO;
+	  }
+
+      drop_ring();
+    }
+
+  return ok;
+}
+
+void io_batch::run_ring()
+{
+  vector<op *>::size_type first=0;
+
+  for(vector<op *>::size_type i=0; i<ops.size(); ++i)
+    {
+      op &o=*ops[i];
+
+      // A chain has to go in with a single submission.
+      unsigned int chain=1;
+      if(i==0 || !ops[i-1]->linked)
+	for(vector<op *>::size_type j=i; j<ops.size() && ops[j]->linked; ++j)
+	  ++chain;
+
+      if(io_uring_sq_space_left(ring)<chain)
+	{
+	  if(!flush(first, i))
+	    return;
+
+	  first=i;
+	}
+
+      io_uring_sqe *sqe=io_uring_get_sqe(ring);
+
+      switch(o.type)
+	{
+	case OP_STAT:
+	  io_uring_prep_statx(sqe, o.fd, o.name, AT_SYMLINK_NOFOLLOW,
+			      STATX_BASIC_STATS, &o.sx);
+	  break;
+	case OP_CLOSE:
+	  io_uring_prep_close(sqe, o.fd);
+	  break;
+	case OP_RENAME:
+	  io_uring_prep_renameat(sqe, o.fd, o.name, o.newfd, o.newname, 0);
+	  break;
+	}
+
+      if(o.linked)
+	sqe->flags|=IOSQE_IO_LINK;
+
+      io_uring_sqe_set_data(sqe, &o);
+    }
+
+  if(first<ops.size())
+    flush(first, ops.size());
+}
+
+#endif // HAVE_LIBURING
+
+void io_batch::run()
+{
+#ifdef HAVE_LIBURING
+  if(ring!=NULL)
+    run_ring();
+#endif
+
+  // Everything, or whatever the ring didn't get to if it had to be
+  // given up.
+  run_sync();
+
+  for(vector<op *>::iterator i=ops.begin(); i!=ops.end(); ++i)
+    // The kernel may yet write to a lost operation: better to leak it.
+    if((*i)->state!=op::STATE_LOST)
+      delete *i;
+
+  ops.clear();
+}
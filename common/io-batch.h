@@ -0,0 +1,67 @@
+// io-batch.h -- file system calls made a batch at a time.  -*-c++-*-
+//
+//  When apt-watch is built with liburing and the kernel supports the
+//  operations used here, a batch goes to the kernel through io_uring
+//  in as few system calls as possible; otherwise each call is simply
+//  made in turn.  Either way, every result is in place once run()
+//  returns.
+
+#ifndef IO_BATCH_H
+#define IO_BATCH_H
+
+#include <sys/stat.h>
+
+#include <vector>
+
+struct io_uring;
+
+class io_batch
+{
+  enum op_type {OP_STAT, OP_CLOSE, OP_RENAME};
+
+  struct op;
+
+  std::vector<op *> ops;
+
+  /** This thread's ring, or NULL if we're making the calls
+   *  ourselves.
+   */
+  io_uring *ring;
+
+  void add(op *o);
+  void run_sync();
+  void run_ring();
+  bool flush(std::vector<op *>::size_type begin,
+	     std::vector<op *>::size_type end);
+  bool reap(unsigned int n);
+  void drop_ring();
+public:
+  io_batch();
+  ~io_batch();
+
+  /** \return \b true if the batch goes through io_uring. */
+  bool async() const {return ring!=0;}
+
+  /** Queue an lstat() of name in dirfd.  Each *result is set to 0 or
+   *  an errno value by run(); names and buffers must stay valid until
+   *  then.
+   */
+  void stat(int dirfd, const char *name, struct stat *buf, int *result);
+
+  /** Queue a close(). */
+  void close(int fd, int *result);
+
+  /** Queue a renameat(). */
+  void rename(int olddir, const char *oldname,
+	      int newdir, const char *newname, int *result);
+
+  /** Make the next operation wait for the last one queued, and skip
+   *  it (with ECANCELED) if that one failed.
+   */
+  void link();
+
+  /** Carry out everything queued so far. */
+  void run();
+};
+
+#endif // IO_BATCH_H
@@ -0,0 +1,132 @@
+// progress-block.cc
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "progress-block.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+int progress_block_create(progress_block **block)
+{
+#ifdef HAVE_MEMFD_CREATE
+  int fd=memfd_create("apt-watch-progress", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+
+  if(fd==-1)
+    return -1;
+
+  if(ftruncate(fd, sizeof(progress_block))!=0)
+    {
+      close(fd);
+      return -1;
+    }
+
+  // The applet maps this too; make sure nobody can shrink it under
+  // either of us.
+  fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_SEAL);
+
+  void *mem=mmap(NULL, sizeof(progress_block), PROT_READ|PROT_WRITE,
+		 MAP_SHARED, fd, 0);
+
+  if(mem==MAP_FAILED)
+    {
+      close(fd);
+      return -1;
+    }
+
+  progress_block *rval=(progress_block *) mem;
+  rval->magic=PROGRESS_BLOCK_MAGIC;
+  // Readers use 0 to mean "no snapshot", so the counter starts above it.
+  rval->seq=2;
+
+  *block=rval;
+  return fd;
+#else
+  errno=ENOSYS;
+  return -1;
+#endif
+}
+
+const progress_block *progress_block_map(int fd)
+{
+  void *mem=mmap(NULL, sizeof(progress_block), PROT_READ, MAP_SHARED, fd, 0);
+
+  if(mem==MAP_FAILED)
+    return NULL;
+
+  const progress_block *rval=(const progress_block *) mem;
+
+  if(rval->magic!=PROGRESS_BLOCK_MAGIC)
+    {
+      munmap(mem, sizeof(progress_block));
+      return NULL;
+    }
+
+  return rval;
+}
+
+void progress_block_unmap(const progress_block *block)
+{
+  if(block!=NULL)
+    munmap(const_cast<progress_block *>(block), sizeof(progress_block));
+}
+
+void progress_block_publish(progress_block *block,
+			    const fetch_progress &p,
+			    bool active)
+{
+  uint32_t seq=__atomic_load_n(&block->seq, __ATOMIC_RELAXED);
+  uint32_t next=seq+2;
+
+  if(next==0)
+    next=2;
+
+  __atomic_store_n(&block->seq, seq+1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  block->active=active?1:0;
+  block->current_bytes=p.current_bytes;
+  block->total_bytes=p.total_bytes;
+  block->current_items=p.current_items;
+  block->total_items=p.total_items;
+  block->cps=p.cps;
+  block->eta=p.eta;
+  block->phase=p.phase;
+
+  __atomic_store_n(&block->seq, next, __ATOMIC_RELEASE);
+}
+
+uint32_t progress_block_sample(const progress_block *block,
+			       fetch_progress &p,
+			       bool &active)
+{
+  // The writer only holds the block for a few stores, so a handful
+  // of retries is plenty; give up rather than spin in the UI.
+  for(int tries=0; tries<100; ++tries)
+    {
+      uint32_t seq=__atomic_load_n(&block->seq, __ATOMIC_ACQUIRE);
+
+      if(seq&1)
+	continue;
+
+      active=block->active!=0;
+      p.current_bytes=block->current_bytes;
+      p.total_bytes=block->total_bytes;
+      p.current_items=block->current_items;
+      p.total_items=block->total_items;
+      p.cps=block->cps;
+      p.eta=block->eta;
+      p.phase=block->phase;
+
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+      if(__atomic_load_n(&block->seq, __ATOMIC_RELAXED)==seq)
+	return seq;
+    }
+
+  return 0;
+}
@@ -0,0 +1,61 @@
+// progress-block.h -- fetch progress shared through memory.   -*-c++-*-
+//
+//  The slave publishes fetch progress into a small memfd-backed block
+//  instead of sending a message for every change; the applet samples
+//  it whenever it redraws.  A sequence counter (a "seqlock") lets the
+//  reader detect and retry torn reads without any locking.
+
+#ifndef PROGRESS_BLOCK_H
+#define PROGRESS_BLOCK_H
+
+#include "apt-watch-common.h"
+
+#include <stdint.h>
+
+#define PROGRESS_BLOCK_MAGIC 0x61707770
+
+struct progress_block
+{
+  uint32_t magic;
+
+  /** Odd while the slave is in the middle of an update. */
+  uint32_t seq;
+
+  /** Nonzero while a fetch is running. */
+  uint32_t active;
+
+  uint64_t current_bytes, total_bytes;
+  uint64_t current_items, total_items;
+  uint64_t cps, eta;
+  uint32_t phase;
+};
+
+/** Create and map a new block.  Returns the memfd (close-on-exec) or
+ *  -1 if shared memory is not available, in which case *block is
+ *  untouched.
+ */
+int progress_block_create(progress_block **block);
+
+/** Map a block read-only from a file descriptor.  Returns NULL on
+ *  failure.
+ */
+const progress_block *progress_block_map(int fd);
+
+void progress_block_unmap(const progress_block *block);
+
+/** Store new numbers in the block (writer side). */
+void progress_block_publish(progress_block *block,
+			    const fetch_progress &p,
+			    bool active);
+
+/** Take a consistent snapshot of the block (reader side).
+ *
+ *  \return the sequence number of the snapshot, which only changes
+ *  when the slave publishes something new, or 0 if no consistent
+ *  snapshot could be taken.
+ */
+uint32_t progress_block_sample(const progress_block *block,
+			       fetch_progress &p,
+			       bool &active);
+
+#endif // PROGRESS_BLOCK_H
@@ -0,0 +1,33 @@
+// test-check.h -- the bare minimum for the test programs.  -*-c++-*-
+//
+//  A test program runs its checks and exits with the number that
+//  failed (capped, so it stays a valid exit status); "make check"
+//  counts anything but 0 as a failure.
+
+#ifndef TEST_CHECK_H
+#define TEST_CHECK_H
+
+#include <cstdio>
+
+/** How many checks have failed so far. */
+static int check_failures=0;
+
+/** Report cond if it doesn't hold, and carry on. */
+#define CHECK(cond)							\
+  do									\
+    {									\
+      if(!(cond))							\
+	{								\
+	  fprintf(stderr, "%s:%d: check failed: %s\n",			\
+		  __FILE__, __LINE__, #cond);				\
+	  ++check_failures;						\
+	}								\
+    } while(0)
+
+/** The exit status for main(). */
+static inline int check_status()
+{
+  return check_failures>100?100:check_failures;
+}
+
+#endif // TEST_CHECK_H
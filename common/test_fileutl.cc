@@ -1,25 +1,810 @@
 // test_fileutl.cc
+//
+//  Run with no arguments, checks the copy and move operations; the
+//  kernel calls they make are wrapped below so that each copy method
+//  can be made to stop partway, write short or fail.  Run with two
+//  arguments, moves the first tree to the second.
+
+// Fortified headers define some of the wrapped calls inline.
+#undef _FORTIFY_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 
 #include "fileutl.h"
+#include "io-batch.h"
+#include "test-check.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
+
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 
-#include <cstdio>
+#include <algorithm>
 #include <string>
+#include <vector>
 
 using namespace std;
 
-int main(int argc, char **argv)
+/** What the wrapped calls should do.  Set only while no tree
+ *  transfer is running.
+ */
+static struct
+{
+  /** Refuse FICLONE. */
+  bool no_clone;
+
+  /** copy_file_range() and sendfile() refuse to read past these
+   *  offsets (-1 for no limit)...
+   */
+  off_t copy_file_range_stop, sendfile_stop;
+
+  /** ...and sendfile() moves at most this much at once (0 for no
+   *  limit).
+   */
+  size_t sendfile_chunk;
+
+  /** write() to this descriptor writes at most 7 bytes at a time. */
+  int short_write_fd;
+
+  /** Reading a file of this size fails with EIO (-1 for none). */
+  off_t poison_size;
+
+  /** rename() and renameat() fail with EXDEV, except for the
+   *  temporary files of a copy: the sources are on another file
+   *  system.
+   */
+  bool rename_exdev;
+} knobs;
+
+/** How much each wrapped call moved since reset_knobs(); tree
+ *  transfers make the calls from several threads.
+ */
+static size_t copy_file_range_bytes, sendfile_bytes, short_write_bytes;
+
+static void tally(size_t &counter, ssize_t amt)
+{
+  if(amt>0)
+    __sync_fetch_and_add(&counter, amt);
+}
+
+static void reset_knobs()
+{
+  knobs.no_clone=true;
+  knobs.copy_file_range_stop=-1;
+  knobs.sendfile_stop=-1;
+  knobs.sendfile_chunk=0;
+  knobs.short_write_fd=-1;
+  knobs.poison_size=-1;
+  knobs.rename_exdev=false;
+
+  copy_file_range_bytes=sendfile_bytes=short_write_bytes=0;
+}
+
+/** \return \b true if reading fd should fail. */
+static bool poisoned(int fd)
+{
+  struct stat buf;
+
+  return knobs.poison_size>=0 && fstat(fd, &buf)==0 &&
+    buf.st_size==knobs.poison_size;
+}
+
+/** \return how much of len a call starting at off may move, or -1
+ *  (with errno set) if it may not move anything.
+ */
+static ssize_t allowed(off_t off, size_t len, off_t stop, int err)
+{
+  if(stop>=0 && off>=stop)
+    {
+      errno=err;
+      return -1;
+    }
+
+  if(stop>=0 && len>(size_t) (stop-off))
+    len=stop-off;
+
+  return len;
+}
+
+extern "C" int ioctl(int fd, unsigned long request, ...) __THROW
+{
+  va_list args;
+
+  va_start(args, request);
+  void *arg=va_arg(args, void *);
+  va_end(args);
+
+#ifdef FICLONE
+  if(request==FICLONE)
+    {
+      if(poisoned((int) (long) arg))
+	{
+	  errno=EIO;
+	  return -1;
+	}
+
+      if(knobs.no_clone)
+	{
+	  errno=EOPNOTSUPP;
+	  return -1;
+	}
+    }
+#endif
+
+  return syscall(SYS_ioctl, fd, request, arg);
+}
+
+#ifdef HAVE_COPY_FILE_RANGE
+extern "C" ssize_t copy_file_range(int infd, off64_t *inoff,
+				   int outfd, off64_t *outoff,
+				   size_t len, unsigned int flags)
+{
+  if(poisoned(infd))
+    {
+      errno=EIO;
+      return -1;
+    }
+
+  // Like a file system that gives up partway.
+  ssize_t n=allowed(inoff?*inoff:lseek(infd, 0, SEEK_CUR), len,
+		    knobs.copy_file_range_stop, EXDEV);
+
+  if(n<0)
+    return -1;
+
+  ssize_t rval=syscall(SYS_copy_file_range, infd, inoff, outfd, outoff, n, flags);
+
+  tally(copy_file_range_bytes, rval);
+
+  return rval;
+}
+#endif
+
+#ifdef HAVE_SENDFILE
+extern "C" ssize_t sendfile(int outfd, int infd, off_t *offset, size_t count) __THROW
 {
-  if(argc<3)
+  if(poisoned(infd))
     {
-      fprintf(stderr, "Sorry, not enough arguments\n");
+      errno=EIO;
       return -1;
     }
 
-  if(!move_recursive(argv[1], argv[2]))
+  ssize_t n=allowed(offset?*offset:lseek(infd, 0, SEEK_CUR), count,
+		    knobs.sendfile_stop, EINVAL);
+
+  if(n<0)
+    return -1;
+
+  if(knobs.sendfile_chunk>0 && (size_t) n>knobs.sendfile_chunk)
+    n=knobs.sendfile_chunk;
+
+  ssize_t rval=syscall(SYS_sendfile, outfd, infd, offset, n);
+
+  tally(sendfile_bytes, rval);
+
+  return rval;
+}
+#endif
+
+extern "C" ssize_t pread(int fd, void *buf, size_t len, off_t offset)
+{
+  if(poisoned(fd))
+    {
+      errno=EIO;
+      return -1;
+    }
+
+  return syscall(SYS_pread64, fd, buf, len, offset);
+}
+
+extern "C" ssize_t write(int fd, const void *buf, size_t len)
+{
+  if(fd==knobs.short_write_fd)
+    {
+      if(len>7)
+	len=7;
+
+      ssize_t rval=syscall(SYS_write, fd, buf, len);
+
+      tally(short_write_bytes, rval);
+      return rval;
+    }
+
+  return syscall(SYS_write, fd, buf, len);
+}
+
+extern "C" int renameat(int olddir, const char *oldname,
+			int newdir, const char *newname) __THROW
+{
+  if(knobs.rename_exdev && strstr(oldname, ".apt-watch-")==NULL)
     {
-      fprintf(stderr, "Move failed.\n");
+      errno=EXDEV;
       return -1;
     }
-  else
-    return 0;
+
+  return syscall(SYS_renameat2, olddir, oldname, newdir, newname, 0);
+}
+
+extern "C" int rename(const char *oldname, const char *newname) __THROW
+{
+  return renameat(AT_FDCWD, oldname, AT_FDCWD, newname);
+}
+
+/** \return size bytes that depend on seed. */
+static string contents(unsigned int seed, size_t size)
+{
+  string rval(size, '\0');
+
+  for(size_t i=0; i<size; ++i)
+    rval[i]=(char) ((i*7+seed*13+i/251)&0xff);
+
+  return rval;
+}
+
+static void write_file(const string &fn, const string &data)
+{
+  int fd=open(fn.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+
+  CHECK(fd!=-1);
+  CHECK(syscall(SYS_write, fd, data.data(), data.size())==(ssize_t) data.size());
+  close(fd);
+}
+
+static string read_file(const string &fn)
+{
+  string rval;
+  char buf[4096];
+  int fd=open(fn.c_str(), O_RDONLY);
+
+  if(fd==-1)
+    return "<missing>";
+
+  ssize_t amt;
+
+  while((amt=read(fd, buf, sizeof(buf)))>0)
+    rval.append(buf, amt);
+
+  close(fd);
+
+  return rval;
+}
+
+static bool exists(const string &fn)
+{
+  struct stat buf;
+
+  return lstat(fn.c_str(), &buf)==0;
+}
+
+/** \return the entries of dir, in name order. */
+static vector<string> entries(const string &dir)
+{
+  vector<string> rval;
+  DIR *d=opendir(dir.c_str());
+
+  if(d==NULL)
+    return rval;
+
+  for(dirent *e=readdir(d); e!=NULL; e=readdir(d))
+    if(strcmp(e->d_name, ".") && strcmp(e->d_name, ".."))
+      rval.push_back(e->d_name);
+
+  closedir(d);
+
+  sort(rval.begin(), rval.end());
+
+  return rval;
+}
+
+/** \return \b true if the trees at a and b hold the same names,
+ *  contents and symlink targets.
+ */
+static bool same_tree(const string &a, const string &b)
+{
+  vector<string> names=entries(a);
+
+  if(names!=entries(b))
+    return false;
+
+  for(vector<string>::const_iterator i=names.begin(); i!=names.end(); ++i)
+    {
+      string x=a+"/"+*i, y=b+"/"+*i;
+      struct stat xbuf, ybuf;
+
+      if(lstat(x.c_str(), &xbuf)!=0 || lstat(y.c_str(), &ybuf)!=0 ||
+	 (xbuf.st_mode&S_IFMT)!=(ybuf.st_mode&S_IFMT))
+	return false;
+
+      if(S_ISDIR(xbuf.st_mode))
+	{
+	  if(!same_tree(x, y))
+	    return false;
+	}
+      else if(S_ISLNK(xbuf.st_mode))
+	{
+	  char xtarget[1024], ytarget[1024];
+	  ssize_t xlen=readlink(x.c_str(), xtarget, sizeof(xtarget));
+	  ssize_t ylen=readlink(y.c_str(), ytarget, sizeof(ytarget));
+
+	  if(xlen<0 || xlen!=ylen || memcmp(xtarget, ytarget, xlen))
+	    return false;
+	}
+      else if(read_file(x)!=read_file(y))
+	return false;
+    }
+
+  return true;
+}
+
+/** \return how many non-directories are under dir; temporary files
+ *  left by a copy are counted separately.
+ */
+static unsigned int count_files(const string &dir, unsigned int *temps=NULL)
+{
+  unsigned int rval=0;
+  vector<string> names=entries(dir);
+
+  for(vector<string>::const_iterator i=names.begin(); i!=names.end(); ++i)
+    {
+      string fn=dir+"/"+*i;
+      struct stat buf;
+
+      if(lstat(fn.c_str(), &buf)==0 && S_ISDIR(buf.st_mode))
+	rval+=count_files(fn, temps);
+      else if(i->find(".apt-watch-")!=string::npos)
+	{
+	  if(temps)
+	    ++*temps;
+	}
+      else
+	++rval;
+    }
+
+  return rval;
+}
+
+/** Fill dir with a tree holding more files than go in one batch, a
+ *  few levels of directories and some symlinks.
+ */
+static void make_tree(const string &dir, unsigned int seed)
+{
+  mkdir(dir.c_str(), 0755);
+  mkdir((dir+"/many").c_str(), 0755);
+  mkdir((dir+"/deep").c_str(), 0755);
+  mkdir((dir+"/deep/er").c_str(), 0755);
+  mkdir((dir+"/deep/er/est").c_str(), 0755);
+  mkdir((dir+"/empty").c_str(), 0700);
+
+  for(unsigned int i=0; i<40; ++i)
+    {
+      char name[32];
+
+      snprintf(name, sizeof(name), "/many/f%02u", i);
+      write_file(dir+name, contents(seed+i, 100+i*97));
+    }
+
+  write_file(dir+"/top", contents(seed, 5000));
+  write_file(dir+"/deep/er/est/bottom", contents(seed+1, 70000));
+  write_file(dir+"/deep/zero", "");
+
+  symlink("many/f00", (dir+"/link").c_str());
+  symlink("../../nowhere", (dir+"/deep/er/dangling").c_str());
+}
+
+/** Compare the file at fn with the file open for writing in fd. */
+static bool same_file(const string &fn, int fd)
+{
+  char path[64];
+
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+  return read_file(fn)==read_file(path);
+}
+
+/** Each copy method hands on to the next at the offset where it
+ *  stopped, and short writes are finished.
+ */
+static void test_copy_chain(const string &dir)
+{
+  string src=dir+"/chain", dst=dir+"/chain.out";
+
+  write_file(src, contents(1, 100000));
+
+  reset_knobs();
+  knobs.copy_file_range_stop=30000;
+  knobs.sendfile_stop=70000;
+  knobs.sendfile_chunk=4096;
+
+  int infd=open(src.c_str(), O_RDONLY);
+  int outfd=open(dst.c_str(), O_WRONLY|O_CREAT|O_EXCL, 0644);
+
+  knobs.short_write_fd=outfd;
+
+  copy_method method=COPY_METHOD_NONE;
+
+  CHECK(copy_data(infd, outfd, &method));
+  CHECK(method==COPY_METHOD_READ_WRITE);
+  CHECK(same_file(src, outfd));
+
+  size_t expect_range=0, expect_sendfile=0;
+
+#ifdef HAVE_COPY_FILE_RANGE
+  expect_range=30000;
+#endif
+#ifdef HAVE_SENDFILE
+  expect_sendfile=70000-expect_range;
+#endif
+
+  CHECK(copy_file_range_bytes==expect_range);
+  CHECK(sendfile_bytes==expect_sendfile);
+  CHECK(short_write_bytes==100000-expect_range-expect_sendfile);
+
+  close(infd);
+  close(outfd);
+  unlink(dst.c_str());
+  unlink(src.c_str());
+}
+
+/** Copy src to a new file the way copy_data() is used; \return the
+ *  method, or COPY_METHOD_NONE and errno if it failed.
+ */
+static copy_method copy_with(const string &src, const string &dst, bool &ok)
+{
+  int infd=open(src.c_str(), O_RDONLY);
+  int outfd=open(dst.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  copy_method method=COPY_METHOD_NONE;
+
+  ok=copy_data(infd, outfd, &method);
+  int err=errno;
+
+  if(ok)
+    CHECK(same_file(src, outfd));
+
+  close(infd);
+  close(outfd);
+  unlink(dst.c_str());
+
+  errno=err;
+  return method;
+}
+
+/** The fastest method that works finishes the copy on its own. */
+static void test_copy_methods(const string &dir)
+{
+  string src=dir+"/methods", dst=dir+"/methods.out";
+  bool ok;
+
+  write_file(src, contents(2, 12345));
+
+  reset_knobs();
+#ifdef HAVE_COPY_FILE_RANGE
+  CHECK(copy_with(src, dst, ok)==COPY_METHOD_COPY_FILE_RANGE && ok);
+  CHECK(copy_file_range_bytes==12345);
+#endif
+
+  reset_knobs();
+  knobs.copy_file_range_stop=0;
+#ifdef HAVE_SENDFILE
+  CHECK(copy_with(src, dst, ok)==COPY_METHOD_SENDFILE && ok);
+  CHECK(sendfile_bytes==12345);
+#endif
+
+  knobs.sendfile_stop=0;
+  CHECK(copy_with(src, dst, ok)==COPY_METHOD_READ_WRITE && ok);
+
+  reset_knobs();
+  write_file(src, "");
+  CHECK(copy_with(src, dst, ok)==COPY_METHOD_NONE && ok);
+
+  unlink(src.c_str());
+}
+
+/** A read error ends the copy, whichever method hits it. */
+static void test_copy_errors(const string &dir)
+{
+  string src=dir+"/bad", dst=dir+"/bad.out";
+  bool ok;
+
+  write_file(src, contents(3, 777));
+
+  reset_knobs();
+  knobs.poison_size=777;
+
+  copy_with(src, dst, ok);
+  CHECK(!ok && errno==EIO);
+
+  knobs.copy_file_range_stop=0;
+  knobs.sendfile_stop=0;
+
+  copy_with(src, dst, ok);
+  CHECK(!ok && errno==EIO);
+
+  // copy() and move() leave nothing behind, and move() keeps the
+  // source.
+  knobs.rename_exdev=true;
+
+  CHECK(!copy(src, dst));
+  CHECK(errno==EIO);
+  CHECK(!move(src, dst));
+  CHECK(!exists(dst));
+  CHECK(read_file(src)==contents(3, 777));
+
+  unsigned int temps=0;
+  CHECK(count_files(dir, &temps)==1);
+  CHECK(temps==0);
+
+  reset_knobs();
+  unlink(src.c_str());
+}
+
+static void test_copy_move(const string &dir)
+{
+  string a=dir+"/a", b=dir+"/b", c=dir+"/c";
+  copy_method method;
+
+  reset_knobs();
+
+  write_file(a, contents(4, 3000));
+  write_file(b, "old");
+
+  CHECK(copy(a, b, &method));
+  CHECK(method!=COPY_METHOD_NONE);
+  CHECK(read_file(b)==contents(4, 3000));
+  CHECK(read_file(a)==contents(4, 3000));
+
+  // Across file systems, a move is a copy and an unlink.
+  knobs.rename_exdev=true;
+
+  CHECK(move(a, c));
+  CHECK(!exists(a));
+  CHECK(read_file(c)==contents(4, 3000));
+
+  reset_knobs();
+
+  CHECK(move(c, a));
+  CHECK(!exists(c));
+  CHECK(read_file(a)==contents(4, 3000));
+
+  unlink(a.c_str());
+  unlink(b.c_str());
+}
+
+static void test_copy_tree(const string &dir)
+{
+  string src=dir+"/tree", dst=dir+"/tree.copy";
+
+  reset_knobs();
+  make_tree(src, 5);
+
+  CHECK(copy_recursive(src, dst));
+  CHECK(same_tree(src, dst));
+
+  struct stat buf;
+  CHECK(lstat((dst+"/link").c_str(), &buf)==0 && S_ISLNK(buf.st_mode));
+  CHECK(stat((dst+"/empty").c_str(), &buf)==0 && (buf.st_mode&07777)==0700);
+
+  // Into an existing tree, replacing what's there.
+  write_file(dst+"/many/f07", "stale");
+  write_file(dst+"/extra", "kept");
+
+  CHECK(copy_recursive(src, dst));
+  CHECK(read_file(dst+"/many/f07")==read_file(src+"/many/f07"));
+  CHECK(read_file(dst+"/extra")=="kept");
+
+  unsigned int temps=0;
+  CHECK(count_files(dst, &temps)==count_files(src)+1);
+  CHECK(temps==0);
+
+  system(("rm -rf "+src+" "+dst).c_str());
+}
+
+static void test_move_tree(const string &dir)
+{
+  string src=dir+"/tree", ref=dir+"/tree.ref", dst=dir+"/tree.moved";
+
+  for(int exdev=0; exdev<2; ++exdev)
+    {
+      reset_knobs();
+      make_tree(src, 6);
+      make_tree(ref, 6);
+
+      // Where the whole tree can't be renamed at once.
+      mkdir(dst.c_str(), 0755);
+      write_file(dst+"/extra", "kept");
+
+      knobs.rename_exdev=exdev;
+
+      CHECK(move_recursive(src, dst));
+      CHECK(!exists(src));
+
+      unlink((dst+"/extra").c_str());
+      CHECK(same_tree(ref, dst));
+
+      system(("rm -rf "+ref+" "+dst).c_str());
+    }
+}
+
+static void test_copy_newer(const string &dir)
+{
+  string src=dir+"/tree", dst=dir+"/tree.newer";
+
+  reset_knobs();
+  make_tree(src, 7);
+  mkdir(dst.c_str(), 0755);
+  mkdir((dst+"/many").c_str(), 0755);
+
+  write_file(dst+"/many/f01", "newer");
+  write_file(dst+"/many/f02", "older");
+
+  struct timeval times[2];
+
+  times[0].tv_sec=times[1].tv_sec=time(NULL)+3600;
+  times[0].tv_usec=times[1].tv_usec=0;
+  CHECK(utimes((dst+"/many/f01").c_str(), times)==0);
+
+  times[0].tv_sec=times[1].tv_sec=1;
+  CHECK(utimes((dst+"/many/f02").c_str(), times)==0);
+
+  CHECK(copy_newer_recursive(src, dst));
+  CHECK(read_file(dst+"/many/f01")=="newer");
+  CHECK(read_file(dst+"/many/f02")==read_file(src+"/many/f02"));
+
+  write_file(dst+"/many/f01", read_file(src+"/many/f01"));
+  CHECK(same_tree(src, dst));
+
+  system(("rm -rf "+src+" "+dst).c_str());
+}
+
+/** A durable transfer that fails puts nothing in place and removes
+ *  no source.
+ */
+static void test_durable(const string &dir)
+{
+  string src=dir+"/tree", ref=dir+"/tree.ref", dst=dir+"/tree.durable";
+
+  set_commit_policy(COMMIT_DURABLE);
+
+  reset_knobs();
+  make_tree(src, 8);
+  make_tree(ref, 8);
+
+  CHECK(copy_recursive(src, dst));
+  CHECK(same_tree(src, dst));
+
+  system(("rm -rf "+dst).c_str());
+
+  // f13 is the only file of its size.
+  knobs.poison_size=100+13*97;
+
+  unsigned int temps=0;
+
+  CHECK(!copy_recursive(src, dst));
+  CHECK(count_files(dst, &temps)==0);
+  CHECK(temps==0);
+  CHECK(same_tree(ref, src));
+
+  system(("rm -rf "+dst).c_str());
+
+  // A move that has to copy leaves every source in place; a file
+  // that could be renamed is only ever in one place.
+  mkdir(dst.c_str(), 0755);
+  write_file(dst+"/extra", "kept");
+  knobs.rename_exdev=true;
+
+  CHECK(!move_recursive(src, dst));
+  CHECK(read_file(src+"/many/f13")==read_file(ref+"/many/f13"));
+  CHECK(count_files(src)+count_files(dst, &temps)==count_files(ref)+1);
+  CHECK(temps==0);
+
+  // Renames through io_uring don't see the wrapper.
+  if(!io_batch().async())
+    CHECK(same_tree(ref, src));
+
+  knobs.poison_size=-1;
+
+  CHECK(move_recursive(src, dst));
+  CHECK(!exists(src));
+  CHECK(read_file(dst+"/extra")=="kept");
+
+  unlink((dst+"/extra").c_str());
+  CHECK(same_tree(ref, dst));
+
+  set_commit_policy(COMMIT_FAST);
+  system(("rm -rf "+ref+" "+dst).c_str());
+}
+
+/** A linked operation is skipped if the one before it failed. */
+static void test_io_batch(const string &dir)
+{
+  string a=dir+"/batch.a", b=dir+"/batch.b", c=dir+"/batch.c";
+  string missing=dir+"/batch.missing";
+  int first=-1, second=-1, third=-1;
+
+  reset_knobs();
+  write_file(a, "a");
+
+  {
+    io_batch batch;
+
+    batch.rename(AT_FDCWD, missing.c_str(), AT_FDCWD, c.c_str(), &first);
+    batch.link();
+    batch.rename(AT_FDCWD, a.c_str(), AT_FDCWD, c.c_str(), &second);
+    batch.rename(AT_FDCWD, a.c_str(), AT_FDCWD, b.c_str(), &third);
+    batch.run();
+  }
+
+  CHECK(first==ENOENT);
+  CHECK(second==ECANCELED);
+  CHECK(third==0);
+  CHECK(!exists(a) && !exists(c));
+  CHECK(read_file(b)=="a");
+
+  unlink(b.c_str());
+}
+
+int main(int argc, char **argv)
+{
+  reset_knobs();
+
+  if(argc==3)
+    {
+      if(!move_recursive(argv[1], argv[2]))
+	{
+	  fprintf(stderr, "Move failed.\n");
+	  return -1;
+	}
+      else
+	return 0;
+    }
+  else if(argc!=1)
+    {
+      fprintf(stderr, "Usage: %s [src dst]\n", argv[0]);
+      return -1;
+    }
+
+  char dir[]="/tmp/test_fileutl.XXXXXX";
+
+  if(mkdtemp(dir)==NULL)
+    {
+      perror("mkdtemp");
+      return 1;
+    }
+
+  string base=dir;
+
+  // Enough threads to steal from each other, even on one CPU.
+  set_copy_threads(4);
+
+  test_copy_chain(base);
+  test_copy_methods(base);
+  test_copy_errors(base);
+  test_copy_move(base);
+  test_copy_tree(base);
+  test_move_tree(base);
+  test_copy_newer(base);
+  test_durable(base);
+  test_io_batch(base);
+
+  system(("rm -rf "+base).c_str());
+
+  return check_status();
 }
@@ -0,0 +1,244 @@
+// test_msg_reader.cc
+//
+//  Frames built with msg_builder must come out of msg_reader whole,
+//  however the bytes are split up on the way.
+
+#include "apt-watch-common.h"
+#include "test-check.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+
+using namespace std;
+
+/** \return the bytes msg_builder sends for the given frame. */
+static string encode(msg_builder &b)
+{
+  int fds[2];
+  string rval;
+
+  if(pipe(fds)!=0)
+    return rval;
+
+  CHECK(b.send(fds[1]));
+  close(fds[1]);
+
+  char buf[4096];
+  ssize_t amt;
+
+  while((amt=read(fds[0], buf, sizeof(buf)))>0)
+    rval.append(buf, amt);
+
+  close(fds[0]);
+
+  return rval;
+}
+
+/** Push the given bytes into a fresh pipe, closing the write end if
+ *  \b eof is set.  \return the read end.
+ */
+static int feed(const string &bytes, bool eof, int *writefd=NULL)
+{
+  int fds[2];
+
+  if(pipe(fds)!=0)
+    return -1;
+
+  if(!bytes.empty())
+    CHECK(write(fds[1], bytes.data(), bytes.size())==(ssize_t) bytes.size());
+
+  if(eof)
+    close(fds[1]);
+  else if(writefd!=NULL)
+    *writefd=fds[1];
+
+  return fds[0];
+}
+
+/** A frame arriving a byte at a time is only seen once it's whole. */
+static void test_torn_frame()
+{
+  msg_builder b(APPLET_REPLY_FETCH_PROGRESS);
+  b.put_uint64(1234567890123ULL).put_string("hello").put_bool(true);
+
+  string bytes=encode(b);
+
+  int fds[2];
+  CHECK(pipe(fds)==0);
+
+  msg_reader reader;
+  msg_frame frame;
+
+  for(string::size_type i=0; i<bytes.size(); ++i)
+    {
+      CHECK(!reader.next(frame));
+      CHECK(write(fds[1], bytes.data()+i, 1)==1);
+      CHECK(reader.fill(fds[0])==1);
+    }
+
+  CHECK(reader.next(frame));
+  CHECK(frame.id()==APPLET_REPLY_FETCH_PROGRESS);
+
+  uint64_t n;
+  string s;
+  bool flag;
+
+  CHECK(frame.get_uint64(n) && n==1234567890123ULL);
+  CHECK(frame.get_string(s) && s=="hello");
+  CHECK(frame.get_bool(flag) && flag);
+  CHECK(!frame.more());
+
+  CHECK(!reader.next(frame));
+  CHECK(!reader.corrupt());
+
+  close(fds[0]);
+  close(fds[1]);
+}
+
+/** Several frames read at once come out one by one, and a partial
+ *  one after them waits for the rest.
+ */
+static void test_many_frames()
+{
+  string bytes;
+
+  for(unsigned int i=0; i<10; ++i)
+    {
+      msg_builder b(APPLET_REPLY_PACKAGE_FETCHED);
+      b.put_uint32(i);
+      bytes+=encode(b);
+    }
+
+  // An empty payload is still a frame.
+  msg_builder empty(APPLET_REPLY_DOWNLOAD_COMPLETE);
+  bytes+=encode(empty);
+
+  msg_builder last(APPLET_REPLY_FATALERROR);
+  last.put_string("the end");
+  string tail=encode(last);
+
+  int writefd=-1;
+  int fd=feed(bytes+tail.substr(0, 3), false, &writefd);
+
+  msg_reader reader;
+  msg_frame frame;
+
+  CHECK(reader.fill(fd)>0);
+
+  for(uint32_t i=0; i<10; ++i)
+    {
+      uint32_t n;
+
+      CHECK(reader.next(frame));
+      CHECK(frame.id()==APPLET_REPLY_PACKAGE_FETCHED);
+      CHECK(frame.get_uint32(n) && n==i);
+    }
+
+  CHECK(reader.next(frame));
+  CHECK(frame.id()==APPLET_REPLY_DOWNLOAD_COMPLETE && !frame.more());
+
+  CHECK(!reader.next(frame));
+
+  CHECK(write(writefd, tail.data()+3, tail.size()-3)==(ssize_t) (tail.size()-3));
+  close(writefd);
+
+  string s;
+  CHECK(reader.read_frame(fd, frame));
+  CHECK(frame.id()==APPLET_REPLY_FATALERROR);
+  CHECK(frame.get_string(s) && s=="the end");
+
+  // Nothing more, and the other end is gone.
+  CHECK(!reader.read_frame(fd, frame));
+  CHECK(!reader.corrupt());
+
+  close(fd);
+}
+
+/** Reading past the end of a payload fails without consuming it. */
+static void test_short_payload()
+{
+  msg_builder b(APPLET_REPLY_AUTH_INFO);
+
+  // A string header promising more than is there.
+  b.put_uint32(100).put_byte('x');
+
+  int fd=feed(encode(b), true);
+
+  msg_reader reader;
+  msg_frame frame;
+  string s;
+  uint32_t n;
+  uint64_t big;
+  unsigned char c;
+
+  CHECK(reader.read_frame(fd, frame));
+  CHECK(!frame.get_string(s));
+  CHECK(!frame.get_uint64(big));
+  CHECK(frame.get_uint32(n) && n==100);
+  CHECK(frame.get_byte(c) && c=='x');
+  CHECK(!frame.get_byte(c));
+  CHECK(!frame.more());
+
+  close(fd);
+}
+
+/** A frame cut off by EOF is never returned. */
+static void test_eof_mid_frame()
+{
+  msg_builder b(APPLET_REPLY_AUTH_INFO);
+  b.put_string("never finished");
+
+  string bytes=encode(b);
+  int fd=feed(bytes.substr(0, bytes.size()-1), true);
+
+  msg_reader reader;
+  msg_frame frame;
+
+  CHECK(!reader.read_frame(fd, frame));
+  CHECK(!reader.corrupt());
+
+  close(fd);
+}
+
+/** A length header too big to be real marks the stream corrupt for
+ *  good.
+ */
+static void test_corrupt_header()
+{
+  string bytes(sizeof(uint32_t)+1, '\0');
+  uint32_t len=MAX_FRAME_PAYLOAD+1;
+
+  memcpy(&bytes[0], &len, sizeof(len));
+
+  msg_builder b(APPLET_REPLY_DOWNLOAD_COMPLETE);
+  bytes+=encode(b);
+
+  int fd=feed(bytes, true);
+
+  msg_reader reader;
+  msg_frame frame;
+
+  CHECK(!reader.read_frame(fd, frame));
+  CHECK(reader.corrupt());
+  CHECK(!reader.next(frame));
+
+  // Until it's told to start over.
+  reader.clear();
+  CHECK(!reader.corrupt());
+  CHECK(!reader.next(frame));
+
+  close(fd);
+}
+
+int main()
+{
+  test_torn_frame();
+  test_many_frames();
+  test_short_payload();
+  test_eof_mid_frame();
+  test_corrupt_header();
+
+  return check_status();
+}
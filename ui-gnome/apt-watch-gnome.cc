@@ -15,13 +15,16 @@
 #include <unistd.h>
 #include <signal.h>
 #include <assert.h>
+#include <errno.h>
 
+#include <fcntl.h>
 #include <sys/resource.h>
 
 #include <string>
 
 #include "apt-watch-common.h"
 #include "apt-watch-gnome.h"
+#include "progress-block.h"
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -46,6 +49,8 @@ applet_state state=NEED_SLAVE_START;
 bool reloading;
 bool can_upgrade;
 bool security_upgrades_available;
+// The most urgent UPGRADE_CLASS_* the slave reported.
+unsigned char upgrade_class;
 bool pending_update=false, pending_reload=false, pending_notify=false;
 
 // used for the progress stuff.
@@ -53,6 +58,30 @@ string progress_message;
 float progress_percent;
 bool progress_majorchange;
 
+// The last fetch progress numbers, if a fetch is running.
+fetch_progress fetch_status;
+bool fetch_status_valid=false;
+
+// The slave's shared progress block, if we are using one, and the
+// timer that samples it while a fetch is running.
+const progress_block *shared_progress;
+guint shared_progress_timeout;
+uint32_t shared_progress_seq;
+
+// During a download, the least urgent upgrade class that is
+// completely downloaded (-1 if none).
+int ready_class=-1;
+
+// Set if the running update downloads the upgrades too, so there's
+// no need to ask for a download when it finishes.
+bool update_downloads=false;
+
+// What the slave said the state was last time it ran, shown until
+// the cache is loaded; -1 if we haven't heard.
+int provisional_status=-1;
+bool provisional_current;
+time_t provisional_time;
+
 time_t last_timeout;
 tm *last_tm;
 
@@ -67,6 +96,9 @@ GConfClient *confclient;
 gint to_slave, from_slave;
 guint from_slave_input;
 
+// Buffers messages from the slave between reads.
+msg_reader slave_reader;
+
 // Stores the timeout for the update.
 guint update_timeout;
 
@@ -79,6 +111,7 @@ static gboolean do_update_timeout(gpointer data);
 static gboolean do_reload(gpointer data);
 static bool start_slave(PanelApplet *applet);
 static void drop_slave(PanelApplet *);
+static void run_error_dlg(const char *message);
 static void set_state(applet_state new_state,
 		      PanelApplet *applet);
 
@@ -183,8 +216,9 @@ static bool handle_gio_error(const char *msg,
 
 static void write_download_msg(int fd, bool update_all)
 {
-  write_msgid(fd, APPLET_CMD_DOWNLOAD);
-  write(fd, &update_all, sizeof(update_all));
+  ready_class=-1;
+
+  msg_builder(APPLET_CMD_DOWNLOAD).put_bool(update_all).send(fd);
 }
 
 static void maybe_download(PanelApplet *applet)
@@ -308,9 +342,10 @@ static void start_package_manager(PanelApplet *applet)
 {
   const package_manager *manager=get_package_manager(applet);
 
-  write_msgid(to_slave, APPLET_CMD_SU);
-  write(to_slave, &manager->run_in_xterm, sizeof(bool));
-  write_string(to_slave, manager->cmd);
+  msg_builder(APPLET_CMD_SU)
+    .put_bool(manager->run_in_xterm)
+    .put_string(manager->cmd)
+    .send(to_slave);
 }
 
 static void bonobo_package_manager(GtkAction       *action,
@@ -382,6 +417,171 @@ static void set_menu_visible(PanelApplet *applet,
     }
 }
 
+// Turn a number of seconds into something like "1h 02m" or "3m 10s".
+static string format_eta(uint64_t secs)
+{
+  char buf[64];
+
+  if(secs>=3600)
+    snprintf(buf, sizeof(buf), "%luh %02lum",
+	     (unsigned long) (secs/3600), (unsigned long) (secs%3600/60));
+  else if(secs>=60)
+    snprintf(buf, sizeof(buf), "%lum %02lus",
+	     (unsigned long) (secs/60), (unsigned long) (secs%60));
+  else
+    snprintf(buf, sizeof(buf), "%lus", (unsigned long) secs);
+
+  return buf;
+}
+
+static string format_fetch_progress(const fetch_progress &p)
+{
+  string rval;
+  char buf[256];
+
+  if(p.total_bytes==0)
+    {
+      snprintf(buf, sizeof(buf), "%lu/%lu items",
+	       (unsigned long) p.current_items, (unsigned long) p.total_items);
+      rval=buf;
+    }
+  else
+    {
+      gchar *cur=g_format_size(p.current_bytes);
+      gchar *total=g_format_size(p.total_bytes);
+
+      rval=string(cur)+"/"+total;
+
+      g_free(cur);
+      g_free(total);
+    }
+
+  if(p.eta>0)
+    rval+="; "+format_eta(p.eta)+" remaining";
+
+  // List downloads report bogus sizes (bug #168710), so only show a
+  // percentage for package downloads.
+  if(p.phase==PROGRESS_PHASE_DOWNLOAD && p.total_bytes>0)
+    {
+      snprintf(buf, sizeof(buf), ": %d%%",
+	       (int) (100*p.current_bytes/p.total_bytes));
+      rval+=buf;
+    }
+
+  return rval;
+}
+
+// How often to look at the shared progress block during a fetch.
+#define SHARED_PROGRESS_INTERVAL 500
+
+static gboolean sample_shared_progress(gpointer data)
+{
+  PanelApplet *applet=(PanelApplet *) data;
+
+  if(shared_progress==NULL)
+    {
+      shared_progress_timeout=0;
+      return FALSE;
+    }
+
+  fetch_progress p;
+  bool active;
+  uint32_t seq=progress_block_sample(shared_progress, p, active);
+
+  if(seq!=0 && seq!=shared_progress_seq)
+    {
+      shared_progress_seq=seq;
+
+      if(active)
+	{
+	  fetch_status=p;
+	  fetch_status_valid=true;
+
+	  set_state(state, applet);
+	}
+    }
+
+  return TRUE;
+}
+
+// Only run the sampling timer while there is something to show.
+static void update_shared_progress_timer(PanelApplet *applet)
+{
+  bool fetching=(state==UPDATING || state==DOWNLOADING);
+
+  if(shared_progress!=NULL && fetching && shared_progress_timeout==0)
+    shared_progress_timeout=g_timeout_add(SHARED_PROGRESS_INTERVAL,
+					  sample_shared_progress,
+					  applet);
+  else if((shared_progress==NULL || !fetching) && shared_progress_timeout!=0)
+    {
+      g_source_remove(shared_progress_timeout);
+      shared_progress_timeout=0;
+    }
+}
+
+static void drop_shared_progress()
+{
+  if(shared_progress_timeout!=0)
+    {
+      g_source_remove(shared_progress_timeout);
+      shared_progress_timeout=0;
+    }
+
+  progress_block_unmap(shared_progress);
+  shared_progress=NULL;
+  shared_progress_seq=0;
+}
+
+// Map the block the slave announced and tell it to stop sending
+// progress messages down the pipe.
+static void attach_shared_progress(uint32_t pid, uint32_t fd)
+{
+  char path[64];
+
+  snprintf(path, sizeof(path), "/proc/%lu/fd/%lu",
+	   (unsigned long) pid, (unsigned long) fd);
+
+  int myfd=open(path, O_RDONLY|O_CLOEXEC);
+
+  if(myfd==-1)
+    {
+      do_log("Can't open the shared progress block %s: %s\n",
+	     path, strerror(errno));
+      return;
+    }
+
+  const progress_block *block=progress_block_map(myfd);
+  close(myfd);
+
+  if(block==NULL)
+    {
+      do_log("Can't map the shared progress block %s\n", path);
+      return;
+    }
+
+  drop_shared_progress();
+  shared_progress=block;
+
+  msg_builder(APPLET_CMD_PROGRESS_SHM_ENABLE).put_bool(true).send(to_slave);
+}
+
+static bool get_shared_progress_enabled(PanelApplet *applet)
+{
+  string key=string(panel_applet_get_preferences_key(applet))+"/progress/shared_memory";
+  GError *err=NULL;
+
+  gboolean rval=gconf_client_get_bool(confclient, key.c_str(), &err);
+
+  if(err!=NULL)
+    {
+      g_error_free(err);
+      return false;
+    }
+
+  return rval;
+}
+
 static void set_state(applet_state new_state,
 		      PanelApplet *applet)
 {
@@ -401,7 +601,34 @@ static void set_state(applet_state new_state,
     case PREINIT:
       msg="Initializing";
 
-      if(old_state!=UPDATING && old_state!=PREINIT && old_state!=DOWNLOADING)
+      if(provisional_status>=0)
+	{
+	  // Show what we knew last time while the real answer loads.
+	  if(provisional_status==UPGRADE_CLASS_NONE)
+	    msg+="\nNo upgrades available";
+	  else if(provisional_status==UPGRADE_CLASS_NORMAL)
+	    msg+="\nUpgrades available";
+	  else if(provisional_status==UPGRADE_CLASS_SECURITY)
+	    msg+="\nSecurity upgrades available";
+	  else
+	    msg+="\nCritical upgrades available";
+
+	  if(!provisional_current)
+	    {
+	      strftime(tbuf, 100, "%m-%d at %l:%M %p",
+		       localtime(&provisional_time));
+	      msg+=" as of ";
+	      msg+=tbuf;
+	    }
+
+	  if(provisional_status==UPGRADE_CLASS_NONE)
+	    gtk_image_set_from_pixbuf(icon, static_swirl);
+	  else if(provisional_status==UPGRADE_CLASS_NORMAL)
+	    gtk_image_set_from_stock(icon, GTK_STOCK_DIALOG_INFO, GTK_ICON_SIZE_LARGE_TOOLBAR);
+	  else
+	    gtk_image_set_from_stock(icon, GTK_STOCK_DIALOG_WARNING, GTK_ICON_SIZE_LARGE_TOOLBAR);
+	}
+      else if(old_state!=UPDATING && old_state!=PREINIT && old_state!=DOWNLOADING)
 	gtk_image_set_from_animation(icon, rotating_swirl);
       break;
     case ERROR:
@@ -416,6 +643,8 @@ static void set_state(applet_state new_state,
 	msg += tbuf;
       } else if(!security_upgrades_available)
 	msg="Upgrades available";
+      else if(upgrade_class>=UPGRADE_CLASS_CRITICAL)
+	msg="Critical upgrades available";
       else
 	msg="Security upgrades available";
 
@@ -435,6 +664,12 @@ static void set_state(applet_state new_state,
     case DOWNLOADING:
       msg="Downloading upgrades";
 
+      // The slave fetches the most urgent upgrades first.
+      if(ready_class>=UPGRADE_CLASS_CRITICAL)
+	msg+="\nCritical upgrades are ready to install";
+      else if(ready_class>=UPGRADE_CLASS_SECURITY)
+	msg+="\nSecurity upgrades are ready to install";
+
       if(old_state!=UPDATING && old_state!=PREINIT && old_state!=DOWNLOADING)
 	gtk_image_set_from_animation(icon, rotating_swirl);
       break;
@@ -445,24 +680,12 @@ static void set_state(applet_state new_state,
       break;
     }
 
+  if(fetch_status_valid && (state==UPDATING || state==DOWNLOADING))
+    msg+=" ("+format_fetch_progress(fetch_status)+")";
   // Note that progress information from downloading package lists is useless
   // thanks to bug #168710.
-  if(!progress_message.empty() && state!=UPDATING)
-    {
-      char buf[1024];
-
-      // Percentage information is useless and confusing except for
-      // downloading packages.  TODO: send that fact with the download
-      // packet.
-      if(state!=DOWNLOADING)
-	snprintf(buf, 1024, "%s (%s)",
-		 msg.c_str(), progress_message.c_str());
-      else
-	snprintf(buf, 1024, "%s (%s): %d%%",
-		 msg.c_str(), progress_message.c_str(), (int) progress_percent);
-
-      msg=buf;
-    }
+  else if(!progress_message.empty() && state!=UPDATING)
+    msg+=" ("+progress_message+")";
 
   gtk_widget_set_tooltip_text (ebox, msg.c_str());
 
@@ -480,6 +703,8 @@ static void set_state(applet_state new_state,
       do_reload(applet);
     }
 
+  update_shared_progress_timer(applet);
+
   set_menu_visible(applet, "Start", state==NEED_SLAVE_START);
   set_menu_visible(applet, "CancelDownload", (state==DOWNLOADING || state==UPDATING));
 
@@ -495,11 +720,21 @@ static gboolean do_update(gpointer data)
     {
       do_log("Updating\n");
 
-      unsigned char msg=APPLET_CMD_UPDATE;
       PanelApplet *applet=(PanelApplet *) data;
 
       set_state(UPDATING, applet);
-      write(to_slave, &msg, sizeof(msg));
+
+      DownloadUpgrades download=get_download_upgrades(applet);
+
+      update_downloads=(download!=DOWNLOAD_NONE);
+      ready_class=-1;
+
+      if(update_downloads)
+	msg_builder(APPLET_CMD_UPDATE_AND_DOWNLOAD)
+	  .put_bool(download==DOWNLOAD_ALL)
+	  .send(to_slave);
+      else
+	write_msgid(to_slave, APPLET_CMD_UPDATE);
 
       string key=string(panel_applet_get_preferences_key(applet))+"/check/last_check";
 
@@ -542,12 +777,10 @@ static gboolean do_reload(gpointer data)
 {
   if(state==IDLE && !reloading)
     {
-      unsigned char msg=APPLET_CMD_RELOAD;
-
       reloading=true;
       set_state(state,
 		(PanelApplet *) data);
-      write(to_slave, &msg, sizeof(msg));
+      write_msgid(to_slave, APPLET_CMD_RELOAD);
     }
   else
     pending_reload=true;
@@ -652,20 +885,19 @@ static int ask_for_auth_info(const string &msg, bool echo)
 	handle_gerror("Unable to convert input from UTF8: %s",
 		      &err);
 
+	msg_builder authreply(APPLET_CMD_AUTHREPLY);
+
 	if (local != NULL) {
-	  s=strlen(local);
-	  write_msgid(to_slave, APPLET_CMD_AUTHREPLY);
-	  write(to_slave, &s, sizeof(s));
-	  write(to_slave, local, s);
+	  authreply.put_string(local).send(to_slave);
 
 	  memset(local, '\0', strlen(local));
 	  g_free(local);
 	} else {
-	  write_msgid(to_slave, APPLET_CMD_AUTHREPLY);
-	  write(to_slave, &s, sizeof(s));
-	  write(to_slave, reply, s);
+	  authreply.put_string(reply).send(to_slave);
 	}
 
+	authreply.wipe();
+
 	s=0;
       }
 
@@ -682,48 +914,6 @@ static int ask_for_auth_info(const string &msg, bool echo)
 
 }
 
-// assumes the string is in the form specified in protocols.txt
-//
-// Returns as many chars as can be read, or NULL if there is an error (ie,
-// no characters are available)
-static string read_string(GIOChannel *source)
-{
-  string::size_type size;
-  gsize amt_read;
-  GError *err=NULL;
-
-  g_io_channel_read_chars(source,
-			  (gchar *) &size,
-			  sizeof(size),
-			  &amt_read,
-			  &err);
-
-  if(handle_gio_error("I can't read a string from the slave: %s", &err))
-    return "";
-
-  if(amt_read<sizeof(size))
-    {
-      do_log("I can't read a string from the slave!\n");
-
-      return "";
-    }
-
-  char *buf=(char *) malloc(size+1);
-  g_io_channel_read_chars(source, buf, size, &amt_read, &err);
-
-  handle_gio_error("Unexpected error reading data from the slave: %s", &err);
-
-  buf[amt_read]=0;
-
-  do_log("Read \"%s\" from the slave.\n", buf);
-
-  string rval=buf;
-
-  g_free(buf);
-
-  return rval;
-}
-
 // TODO: decide when to trigger this by wrapping accessors around
 // the upgrade state.
 
@@ -754,7 +944,9 @@ static void do_notify(PanelApplet *applet)
   GtkWidget *dialog=GTK_WIDGET(gtk_builder_get_object(builder, "upgrade_dialog"));
   GtkWidget *label=GTK_WIDGET(gtk_builder_get_object(builder, "upgrade_message"));
 
-  if(security_upgrades_available)
+  if(upgrade_class>=UPGRADE_CLASS_CRITICAL)
+    message="<span weight=\"bold\" size=\"larger\">There are critical upgrades available</span>";
+  else if(security_upgrades_available)
     message="<span weight=\"bold\" size=\"larger\">There are security upgrades available</span>";
   else
     message="<span weight=\"bold\" size=\"larger\">There are upgrades available</span>";
@@ -770,247 +962,346 @@ static void do_notify(PanelApplet *applet)
   gtk_widget_destroy(dialog);
 }
 
-static gboolean handle_slave_msg(GIOChannel *source,
-				 GIOCondition condition,
-				 gpointer data)
+// Dispatch a single message from the slave.
+static void handle_slave_frame(msg_frame &frame, PanelApplet *applet)
 {
-  unsigned char msgtype;
+  unsigned char msgtype=frame.id();
   GtkWidget *dlg;
   string s;
-  PanelApplet *applet=(PanelApplet *) data;
-  GError *error=NULL;
-
-  // Can I just read from the underlying fd?  I don't trust glib's io
-  // channels.
-  GIOStatus status=g_io_channel_read_chars(source,
-					   (gchar *) &msgtype,
-					   sizeof(msgtype),
-					   NULL,
-					   &error);
 
   do_log("Got message %d\n", msgtype);
 
-  switch(status)
+  switch(msgtype)
     {
-    case G_IO_STATUS_ERROR:
-      do_log("Error reading from the slave: %s\n",
-	     error->message);
+    case APPLET_REPLY_AUTH_PROMPT_NOECHO:
+    case APPLET_REPLY_AUTH_PROMPT_ECHO:
+      if(!frame.get_string(s) || s.empty())
+	{
+	  drop_slave(applet);
 
-      drop_slave(applet);
-      break;
-    case G_IO_STATUS_EOF:
-      do_log("Got EOF while reading from the slave.\n");
+	  break;
+	}
 
-      drop_slave(applet);
+      if(ask_for_auth_info(s, msgtype==APPLET_REPLY_AUTH_PROMPT_ECHO)!=0)
+	write_msgid(to_slave, APPLET_CMD_AUTHCANCEL);
       break;
-    case G_IO_STATUS_AGAIN:
-      break;
-    case G_IO_STATUS_NORMAL:
-      switch(msgtype)
-	{
-	case APPLET_REPLY_AUTH_PROMPT_NOECHO:
-	case APPLET_REPLY_AUTH_PROMPT_ECHO:
-	  s=read_string(source);
 
-	  if(s.empty())
-	    {
-	      drop_slave(applet);
+    case APPLET_REPLY_PROGRESS_UPDATE:
+      {
+	string op;
 
-	      break;
-	    }
+	float percent;
 
-	  if(ask_for_auth_info(s, msgtype==APPLET_REPLY_AUTH_PROMPT_ECHO)!=0)
-	    write_msgid(to_slave, APPLET_CMD_AUTHCANCEL);
-	  break;
+	bool majorchange;
 
-	case APPLET_REPLY_PROGRESS_UPDATE:
+	if(!frame.get_string(op) ||
+	   !frame.get_float(percent) ||
+	   !frame.get_bool(majorchange))
 	  {
-	    string op;
+	    do_log("Protocol error: truncated progress message.\n");
+	    drop_slave(applet);
+	    break;
+	  }
 
-	    float percent;
+	do_log("Progress: %s %d%%\n",
+	       op.c_str(), (int) percent);
 
-	    gsize amt_read;
+	progress_message=op;
+	progress_percent=percent;
+	progress_majorchange=majorchange;
 
-	    bool majorchange;
+	set_state(state, applet);
+      }
+      break;
 
-	    GError *err=NULL;
+    case APPLET_REPLY_FETCH_PROGRESS:
+      if(!get_fetch_progress(frame, fetch_status))
+	{
+	  do_log("Protocol error: truncated fetch progress message.\n");
+	  drop_slave(applet);
+	  break;
+	}
 
-	    op=read_string(source);
+      do_log("Fetch progress: %lu/%lu bytes, %lu/%lu items\n",
+	     (unsigned long) fetch_status.current_bytes,
+	     (unsigned long) fetch_status.total_bytes,
+	     (unsigned long) fetch_status.current_items,
+	     (unsigned long) fetch_status.total_items);
 
-	    g_io_channel_read_chars(source,
-				    (gchar*) &percent,
-				    sizeof(percent),
-				    &amt_read,
-				    &err);
+      fetch_status_valid=true;
 
-	    if(handle_gio_error("Protocol error: can't read the percentage for the progress indicator:\n%s", &err))
-	      {
-		drop_slave(applet);
-		break;
-	      }
+      set_state(state, applet);
+      break;
 
-	    g_io_channel_read_chars(source,
-				    (gchar*) &majorchange,
-				    sizeof(majorchange),
-				    &amt_read,
-				    &err);
+    case APPLET_REPLY_PROGRESS_SHM:
+      {
+	uint32_t pid, fd;
 
-	    if(handle_gio_error("Protocol error: can't read the major change flag for the progress indicator:\n%s", &err))
-	      {
-		drop_slave(applet);
-		break;
-	      }
+	if(!frame.get_uint32(pid) || !frame.get_uint32(fd))
+	  {
+	    do_log("Protocol error: truncated shared progress message.\n");
+	    drop_slave(applet);
+	    break;
+	  }
 
-	    if(amt_read==0)
-	      {
-		drop_slave(applet);
-		break;
-	      }
+	attach_shared_progress(pid, fd);
+      }
+      break;
 
-	    do_log("Progress: %s %d%%\n",
-		   op.c_str(), (int) percent);
+    case APPLET_REPLY_INIT_PROVISIONAL:
+      {
+	unsigned char status;
+	bool current;
+	uint64_t when;
+	uint32_t count;
+
+	if(!frame.get_byte(status) ||
+	   !frame.get_bool(current) ||
+	   !frame.get_uint64(when) ||
+	   !frame.get_uint32(count))
+	  {
+	    do_log("Protocol error: truncated provisional state message.\n");
+	    drop_slave(applet);
+	    break;
+	  }
 
-	    progress_message=op;
-	    progress_percent=percent * 2;
-	    progress_majorchange=majorchange;
+	do_log("Provisional state %d (%s), %lu upgrades\n",
+	       status, current?"current":"stale", (unsigned long) count);
 
-	    set_state(state, applet);
-	  }
+	// Too late if the real state already arrived.
+	if(state!=PREINIT)
 	  break;
 
-	case APPLET_REPLY_PROGRESS_DONE:
-	  do_log("Progress done.\n");
-	  progress_message="";
-	  progress_percent=100;
-	  progress_majorchange=true;
+	provisional_status=status;
+	provisional_current=current;
+	provisional_time=when;
 
-	  set_state(state, applet);
-	  break;
+	set_state(state, applet);
+      }
+      break;
 
-	case APPLET_REPLY_AUTH_OK:
-	  break;
-	
-	case APPLET_REPLY_AUTH_FINISHED:
-	  do_reload(applet);
-	  break;
+    case APPLET_REPLY_PACKAGE_FETCHED:
+      {
+	string name;
+	unsigned char upgrade_class;
 
-	case APPLET_REPLY_CMD_COMPLETE_NOUPGRADES:
-	case APPLET_REPLY_CMD_COMPLETE_UPGRADES:
-	case APPLET_REPLY_CMD_COMPLETE_SECURITY_UPGRADES:
-	  assert(state==UPDATING || (state==IDLE && reloading));
+	if(!frame.get_string(name) || !frame.get_byte(upgrade_class))
+	  {
+	    do_log("Protocol error: truncated package fetched message.\n");
+	    drop_slave(applet);
+	    break;
+	  }
 
-	  reloading=false;
+	do_log("Fetched %s (class %d)\n", name.c_str(), upgrade_class);
+      }
+      break;
 
-	  // fallthrough
+    case APPLET_REPLY_CLASS_READY:
+      {
+	unsigned char upgrade_class;
 
-	case APPLET_REPLY_INIT_OK_NOUPGRADES:
-	case APPLET_REPLY_INIT_OK_UPGRADES:
-	case APPLET_REPLY_INIT_OK_SECURITY_UPGRADES:
+	if(!frame.get_byte(upgrade_class))
 	  {
-	    bool old_can_upgrade=can_upgrade;
-	    bool old_security_upgrades_available=security_upgrades_available;
-	    NotifyMessage notify=get_notify_message(applet);
-
-	    // hm
-	    if(msgtype==APPLET_REPLY_INIT_OK_NOUPGRADES ||
-	       msgtype==APPLET_REPLY_INIT_OK_UPGRADES ||
-	       msgtype==APPLET_REPLY_INIT_OK_SECURITY_UPGRADES)
-	      assert(state==PREINIT);
-
-	    can_upgrade=(msgtype!=APPLET_REPLY_INIT_OK_NOUPGRADES &&
-			 msgtype!=APPLET_REPLY_CMD_COMPLETE_NOUPGRADES);
-	    security_upgrades_available=(msgtype==APPLET_REPLY_INIT_OK_SECURITY_UPGRADES ||
-					 msgtype==APPLET_REPLY_CMD_COMPLETE_SECURITY_UPGRADES);
-
-	    set_state(IDLE, applet);
-
-	    maybe_download(applet);
-
-	    if(notify==NOTIFY_MESSAGE_ALL &&
-	       !old_can_upgrade && can_upgrade)
-	      pending_notify=true;
-	    else if(notify==NOTIFY_MESSAGE_SECURITY &&
-		    !old_security_upgrades_available &&
-		    security_upgrades_available)
-	      pending_notify=true;
-
-	    if(state == IDLE && pending_notify)
-	      do_notify(applet);
+	    do_log("Protocol error: truncated class ready message.\n");
+	    drop_slave(applet);
 	    break;
 	  }
 
-	case APPLET_REPLY_INIT_FAILED:
-	  assert(state==PREINIT);
-	case APPLET_REPLY_AUTH_FAIL:
-	case APPLET_REPLY_AUTH_ERRORMSG:
-	case APPLET_REPLY_AUTH_INFO:
-	case APPLET_REPLY_FATALERROR:
-	  s=read_string(source);
+	do_log("Upgrade class %d is ready\n", upgrade_class);
 
-	  if(s.empty())
-	    {
-	      drop_slave(applet);
+	// Rounds arrive most urgent first.
+	ready_class=upgrade_class;
 
-	      break;
-	    }
+	set_state(state, applet);
+      }
+      break;
 
-	  dlg=gtk_message_dialog_new(NULL, GTK_DIALOG_MODAL,
-				     (msgtype==APPLET_REPLY_AUTH_INFO)?GTK_MESSAGE_INFO:GTK_MESSAGE_ERROR,
-				     GTK_BUTTONS_CLOSE,
-				     (msgtype==APPLET_REPLY_INIT_FAILED)?
-				     "Failed to load the apt cache:\n%s":
-				     "%s",
-				     s.c_str());
+    case APPLET_REPLY_PROGRESS_DONE:
+      do_log("Progress done.\n");
+      progress_message="";
+      progress_percent=100;
+      progress_majorchange=true;
+      fetch_status_valid=false;
 
-	  gtk_window_set_position(GTK_WINDOW(dlg), GTK_WIN_POS_CENTER);
+      set_state(state, applet);
+      break;
 
-	  gtk_dialog_run(GTK_DIALOG(dlg));
+    case APPLET_REPLY_AUTH_OK:
+      break;
 
-	  gtk_widget_destroy(dlg);
+    case APPLET_REPLY_AUTH_FINISHED:
+      do_reload(applet);
+      break;
 
-	  if(msgtype==APPLET_REPLY_INIT_FAILED ||
-	     msgtype==APPLET_REPLY_FATALERROR)
-	    {
-	      drop_slave(applet);	
-	      set_state(ERROR, applet);
-	    }
-	  break;
+    case APPLET_REPLY_CMD_COMPLETE_NOUPGRADES:
+    case APPLET_REPLY_CMD_COMPLETE_UPGRADES:
+    case APPLET_REPLY_CMD_COMPLETE_SECURITY_UPGRADES:
+      assert(state==UPDATING || (state==IDLE && reloading));
 
-	case APPLET_REPLY_REQUEST_RELOAD:
-	  do_reload(applet);
+      reloading=false;
 
-	  break;
+      // fallthrough
 
-	case APPLET_REPLY_DOWNLOAD_COMPLETE:
-	  {
-	    set_state(IDLE, applet);
+    case APPLET_REPLY_INIT_OK_NOUPGRADES:
+    case APPLET_REPLY_INIT_OK_UPGRADES:
+    case APPLET_REPLY_INIT_OK_SECURITY_UPGRADES:
+      {
+	bool old_can_upgrade=can_upgrade;
+	bool old_security_upgrades_available=security_upgrades_available;
+	NotifyMessage notify=get_notify_message(applet);
 
-	    if(pending_notify)
-	      do_notify(applet);
+	// hm
+	if(msgtype==APPLET_REPLY_INIT_OK_NOUPGRADES ||
+	   msgtype==APPLET_REPLY_INIT_OK_UPGRADES ||
+	   msgtype==APPLET_REPLY_INIT_OK_SECURITY_UPGRADES)
+	  assert(state==PREINIT);
 
-	    break;
-	  }
+	provisional_status=-1;
+
+	can_upgrade=(msgtype!=APPLET_REPLY_INIT_OK_NOUPGRADES &&
+		     msgtype!=APPLET_REPLY_CMD_COMPLETE_NOUPGRADES);
+	security_upgrades_available=(msgtype==APPLET_REPLY_INIT_OK_SECURITY_UPGRADES ||
+				     msgtype==APPLET_REPLY_CMD_COMPLETE_SECURITY_UPGRADES);
+
+	// The exact class follows, if the slave knows about them.
+	if(!frame.get_byte(upgrade_class))
+	  upgrade_class=!can_upgrade?UPGRADE_CLASS_NONE:
+	    !security_upgrades_available?UPGRADE_CLASS_NORMAL:
+	    UPGRADE_CLASS_SECURITY;
+
+	set_state(IDLE, applet);
+
+	if(update_downloads)
+	  update_downloads=false;
+	else
+	  maybe_download(applet);
+
+	if(notify==NOTIFY_MESSAGE_ALL &&
+	   !old_can_upgrade && can_upgrade)
+	  pending_notify=true;
+	else if(notify==NOTIFY_MESSAGE_SECURITY &&
+		!old_security_upgrades_available &&
+		security_upgrades_available)
+	  pending_notify=true;
+
+	if(state == IDLE && pending_notify)
+	  do_notify(applet);
+	break;
+      }
+
+    case APPLET_REPLY_INIT_FAILED:
+      assert(state==PREINIT);
+      provisional_status=-1;
+    case APPLET_REPLY_AUTH_FAIL:
+    case APPLET_REPLY_AUTH_ERRORMSG:
+    case APPLET_REPLY_AUTH_INFO:
+    case APPLET_REPLY_FATALERROR:
+      if(!frame.get_string(s) || s.empty())
+	{
+	  drop_slave(applet);
 
-	default:
-	  dlg=gtk_message_dialog_new(NULL, GTK_DIALOG_MODAL,
-				     GTK_MESSAGE_ERROR,
-				     GTK_BUTTONS_CLOSE,
-				     "Garbled communication from slave: message code %d",
-				     msgtype);
+	  break;
+	}
+
+      do_log("Read \"%s\" from the slave.\n", s.c_str());
+
+      dlg=gtk_message_dialog_new(NULL, GTK_DIALOG_MODAL,
+				 (msgtype==APPLET_REPLY_AUTH_INFO)?GTK_MESSAGE_INFO:GTK_MESSAGE_ERROR,
+				 GTK_BUTTONS_CLOSE,
+				 (msgtype==APPLET_REPLY_INIT_FAILED)?
+				 "Failed to load the apt cache:\n%s":
+				 "%s",
+				 s.c_str());
 
-	  gtk_window_set_position(GTK_WINDOW(dlg), GTK_WIN_POS_CENTER);
+      gtk_window_set_position(GTK_WINDOW(dlg), GTK_WIN_POS_CENTER);
 
-	  gtk_dialog_run(GTK_DIALOG(dlg));
+      gtk_dialog_run(GTK_DIALOG(dlg));
 
-	  gtk_widget_destroy(dlg);
+      gtk_widget_destroy(dlg);
 
+      if(msgtype==APPLET_REPLY_INIT_FAILED ||
+	 msgtype==APPLET_REPLY_FATALERROR)
+	{
 	  drop_slave(applet);
+	  set_state(ERROR, applet);
 	}
       break;
+
+    case APPLET_REPLY_REQUEST_RELOAD:
+      do_reload(applet);
+
+      break;
+
+    case APPLET_REPLY_DOWNLOAD_COMPLETE:
+      {
+	// A cancelled update-and-download ends here rather than with
+	// the usual reply.
+	update_downloads=false;
+
+	set_state(IDLE, applet);
+
+	if(pending_notify)
+	  do_notify(applet);
+
+	break;
+      }
+
+    default:
+      dlg=gtk_message_dialog_new(NULL, GTK_DIALOG_MODAL,
+				 GTK_MESSAGE_ERROR,
+				 GTK_BUTTONS_CLOSE,
+				 "Garbled communication from slave: message code %d",
+				 msgtype);
+
+      gtk_window_set_position(GTK_WINDOW(dlg), GTK_WIN_POS_CENTER);
+
+      gtk_dialog_run(GTK_DIALOG(dlg));
+
+      gtk_widget_destroy(dlg);
+
+      drop_slave(applet);
     }
+}
+
+static gboolean handle_slave_msg(GIOChannel *source,
+				 GIOCondition condition,
+				 gpointer data)
+{
+  PanelApplet *applet=(PanelApplet *) data;
 
-  if(error!=NULL)
-    g_error_free(error);
+  // Read straight from the fd: one read() can bring in any number of
+  // frames, and a partial frame just waits in the buffer for the rest.
+  ssize_t amt=slave_reader.fill(g_io_channel_unix_get_fd(source));
+
+  if(amt<0)
+    {
+      do_log("Error reading from the slave: %s\n", strerror(errno));
+
+      drop_slave(applet);
+      return TRUE;
+    }
+  else if(amt==0)
+    {
+      do_log("Got EOF while reading from the slave.\n");
+
+      drop_slave(applet);
+      return TRUE;
+    }
+
+  msg_frame frame;
+
+  // Dialogs run a nested main loop, so this can be re-entered; each
+  // frame is removed from the buffer before it is handled so nothing
+  // is processed twice.  Stop as soon as the slave is dropped.
+  while(from_slave_input!=0 && slave_reader.next(frame))
+    handle_slave_frame(frame, applet);
+
+  if(from_slave_input!=0 && slave_reader.corrupt())
+    {
+      run_error_dlg("Garbled communication from slave: bad frame length");
+
+      drop_slave(applet);
+    }
 
   return TRUE;
 }
@@ -1028,6 +1319,13 @@ static void drop_slave(PanelApplet *applet)
   from_slave_input=0;
   from_slave=to_slave=0;
 
+  slave_reader.clear();
+
+  drop_shared_progress();
+
+  provisional_status=-1;
+  update_downloads=false;
+
   set_state(NEED_SLAVE_START, applet);
 }
 
@@ -1054,6 +1352,7 @@ static bool start_slave(PanelApplet *applet)
   progress_message="";
   progress_percent=0;
   progress_majorchange=false;
+  fetch_status_valid=false;
 
   do_log("Starting the slave.\n");
 
@@ -1096,6 +1395,11 @@ static bool start_slave(PanelApplet *applet)
 
   set_state(PREINIT, applet);
 
+  // Opt-in: sample fetch progress from shared memory instead of
+  // parsing a message for every change.
+  if(get_shared_progress_enabled(applet))
+    write_msgid(to_slave, APPLET_CMD_PROGRESS_SHM_REQUEST);
+
   GIOChannel *channel=g_io_channel_unix_new(from_slave);
   // glib uses UTF8 encoding by default, making it impossible to pass
   // binary data uncorrupted, a truly dreadful idea.